@@ -0,0 +1,129 @@
+/**
+ * Cycle counter profiler module
+ *
+ * This file is part of stm32-usb-dualcdc, an implementation of Dual VCP ports
+ * over USB for STM32F4xx controllers.
+ * This project is available at
+ * <https://github.com/jisszacharia/stm32-usb-dualcdc>
+ *
+ * stm32-usb-dualcdc is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or any
+ * later version (at your option).
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * GNU Lesser General Public License is available at
+ * <http://www.gnu.org/licenses/>
+ *
+ * This project uses STM32F4xx HAL library and STM32 USB Device Library
+ * ST's license agreement is available at
+ * <http://www.st.com/software_license_agreement_liberty_v2>
+ *
+ * Copyright (c) 2016 JZJ <jiss.joseph@gmail.com>
+**/
+
+/* Includes */
+#include <string.h>
+#include "stm32f4xx_hal.h"
+#include "cycprof.h"
+
+#if (CYCPROF_ENABLE != 0)
+
+/* Private */
+static CycProfTypeDef CycProf;
+static uint32_t CycProf_StartTick;
+
+/* Public */
+uint32_t CycProf_Entry;
+
+/* CycProf_Clear
+ * Empties every probe point and the idle count
+ */
+static void CycProf_Clear(void)
+{
+    uint8_t probe;
+
+    CycProf_StartTick = HAL_GetTick();
+    CycProf.idle_cycles = 0;
+    memset(CycProf.stat, 0, sizeof(CycProf.stat));
+    for(probe = 0; probe < CYCPROF_NUM; probe++)
+    {
+        CycProf.stat[probe].min = 0xFFFFFFFF;
+    }
+}
+
+/************************** Public ********************************************/
+/* CycProf_Init
+ * Starts the DWT cycle counter and empties every probe point
+ */
+void CycProf_Init(void)
+{
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+
+    CycProf.num = CYCPROF_NUM;
+    CycProf_Clear();
+}
+
+/* CycProf_Record
+ * Adds one run of a probe point
+ */
+void CycProf_Record(uint8_t probe, uint32_t cycles)
+{
+    CycProfStatTypeDef *stat = &CycProf.stat[probe];
+    uint32_t bucket = 32 - __CLZ(cycles);
+
+    if(bucket >= CYCPROF_BUCKETS)
+    {
+        bucket = CYCPROF_BUCKETS - 1;
+    }
+
+    stat->count++;
+    stat->sum += cycles;
+    if(cycles < stat->min)
+    {
+        stat->min = cycles;
+    }
+    if(cycles > stat->max)
+    {
+        stat->max = cycles;
+    }
+    stat->hist[bucket]++;
+}
+
+/* CycProf_Idle
+ * Adds cycles the main loop slept in WFI, called with interrupts masked
+ */
+void CycProf_Idle(uint32_t cycles)
+{
+    CycProf.idle_cycles += cycles;
+}
+
+/* CycProf_Snapshot
+ * Copies every probe point out with interrupts off, then empties them if
+ * reset is set. Returns the bytes copied.
+ */
+uint32_t CycProf_Snapshot(CycProfTypeDef *snap, uint8_t reset)
+{
+    uint32_t primask = __get_PRIMASK();
+
+    __disable_irq();
+    CycProf.core_clock = SystemCoreClock;
+    CycProf.elapsed_ms = HAL_GetTick() - CycProf_StartTick;
+    memcpy(snap, &CycProf, sizeof(CycProf));
+    if(reset)
+    {
+        CycProf_Clear();
+    }
+    __set_PRIMASK(primask);
+
+    return sizeof(CycProf);
+}
+
+#endif  /* CYCPROF_ENABLE */
+
+/********************************** EOF ***************************************/
@@ -0,0 +1,118 @@
+/**
+ * Cycle counter profiler Header file
+ *
+ * This file is part of stm32-usb-dualcdc, an implementation of Dual VCP ports
+ * over USB for STM32F4xx controllers.
+ * This project is available at
+ * <https://github.com/jisszacharia/stm32-usb-dualcdc>
+ *
+ * stm32-usb-dualcdc is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or any
+ * later version (at your option).
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * GNU Lesser General Public License is available at
+ * <http://www.gnu.org/licenses/>
+ *
+ * This project uses STM32F4xx HAL library and STM32 USB Device Library
+ * ST's license agreement is available at
+ * <http://www.st.com/software_license_agreement_liberty_v2>
+ *
+ * Copyright (c) 2016 JZJ <jiss.joseph@gmail.com>
+**/
+
+/* Multiple inclusion */
+#ifndef __CYCPROF_H
+#define __CYCPROF_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Includes */
+#include "stm32f4xx.h"
+
+/* Macros */
+// Set to 1 to time the USB interrupt, the class callbacks and the FIFO
+// copies of the driver with the DWT cycle counter. At 0 the probes compile
+// to nothing.
+#ifndef CYCPROF_ENABLE
+#define CYCPROF_ENABLE (0)
+#endif
+
+// Histogram buckets, bucket k counts runs below 2^k cycles and the last
+// one everything longer
+#define CYCPROF_BUCKETS (20)
+
+// Probe points
+#define CYCPROF_IRQ        (0)  // HAL_PCD_IRQHandler
+#define CYCPROF_DATAIN     (1)  // Bulk IN completion work
+#define CYCPROF_DATAOUT    (2)  // Bulk OUT completion work
+#define CYCPROF_RECEIVE    (3)  // Application Receive callback
+#define CYCPROF_TXCOMPLETE (4)  // Application TxComplete callback
+#define CYCPROF_SOF        (5)  // SOF work
+#define CYCPROF_BH         (6)  // DCDC_ProcessEvents
+#define CYCPROF_FIFOWR     (7)  // USB_WritePacket, slave mode Tx FIFO fill
+#define CYCPROF_FIFORD     (8)  // USB_ReadPacket, Rx FIFO drain
+#define CYCPROF_IRQLAT     (9)  // OTG interrupt entry to DCDC_DataIn/DataOut
+#define CYCPROF_NUM        (10)
+
+// Cycle counts of one probe point. The mean is sum / count.
+typedef struct {
+    uint64_t sum;
+    uint32_t count;
+    uint32_t min;
+    uint32_t max;
+    uint32_t reserved;
+    uint32_t hist[CYCPROF_BUCKETS];
+} CycProfStatTypeDef;
+
+// All probe points, as returned to the host. The CPU load over the interval
+// is 1 - idle_cycles / (elapsed_ms * core_clock / 1000).
+typedef struct {
+    uint32_t core_clock;            // SystemCoreClock, cycles per second
+    uint32_t num;                   // CYCPROF_NUM
+    uint32_t elapsed_ms;            // Since the counters were last emptied
+    uint32_t reserved;
+    uint64_t idle_cycles;           // Asleep in the main loop WFI in that time
+    CycProfStatTypeDef stat[CYCPROF_NUM];
+} CycProfTypeDef;
+
+#if (CYCPROF_ENABLE != 0)
+// Each probe point is only ever recorded from one context, so recording
+// takes no lock. Nest START and STOP with a name unique in the scope.
+#define CYCPROF_START(name)         uint32_t cycprof_##name = DWT->CYCCNT
+#define CYCPROF_STOP(name, probe)   CycProf_Record((probe), DWT->CYCCNT - cycprof_##name)
+
+// The OTG interrupt stamps its entry, a callback it reaches records the
+// cycles since then
+#define CYCPROF_ENTRY()             (CycProf_Entry = DWT->CYCCNT)
+#define CYCPROF_SINCE_ENTRY(probe)  CycProf_Record((probe), DWT->CYCCNT - CycProf_Entry)
+
+extern uint32_t CycProf_Entry;
+
+void     CycProf_Init(void);
+void     CycProf_Record(uint8_t probe, uint32_t cycles);
+void     CycProf_Idle(uint32_t cycles);
+uint32_t CycProf_Snapshot(CycProfTypeDef *snap, uint8_t reset);
+#else
+#define CYCPROF_START(name)
+#define CYCPROF_STOP(name, probe)
+#define CYCPROF_ENTRY()
+#define CYCPROF_SINCE_ENTRY(probe)
+#define CycProf_Init()
+#define CycProf_Idle(cycles)
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* __CYCPROF_H */
+
+/********************************** EOF ***************************************/
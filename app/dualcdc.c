@@ -33,12 +33,222 @@
 /* Externs */
 extern USBD_HandleTypeDef USBDevice;
 
+/* Macros */
+// Main loop side of the endpoint handover. Each ring has one consumer, but a
+// TxComplete callback may queue from the interrupt while the main loop is
+// mid write, and the HAL endpoint calls are not re-entrant. The producers
+// and the kick of an idle pipe therefore run with the USB interrupt held off.
+#ifdef USE_USB_FS
+#define DCDC_IRQn OTG_FS_IRQn
+#else
+#define DCDC_IRQn OTG_HS_IRQn
+#endif
+// With a PendSV bottom half the class also runs there, so the main loop
+// holds it off through BASEPRI as well. Locks nest, the callbacks the class
+// makes under a lock may call the public functions again.
+#if (DCDC_DEFER == DCDC_DEFER_PENDSV)
+#define DCDC_BH_BASEPRI (DCDC_BH_PRIORITY << (8 - __NVIC_PRIO_BITS))
+#define DCDC_MASK()   do { __set_BASEPRI(DCDC_BH_BASEPRI); NVIC_DisableIRQ(DCDC_IRQn); } while(0)
+#define DCDC_UNMASK() do { NVIC_EnableIRQ(DCDC_IRQn); __set_BASEPRI(0); } while(0)
+#else
+#define DCDC_MASK()   NVIC_DisableIRQ(DCDC_IRQn)
+#define DCDC_UNMASK() NVIC_EnableIRQ(DCDC_IRQn)
+#endif
+#define DCDC_LOCK()   do { DCDC_MASK(); __DSB(); __ISB(); DCDC_LockDepth++; } while(0)
+#define DCDC_UNLOCK() do { if(--DCDC_LockDepth == 0) { DCDC_UNMASK(); } } while(0)
+
+// Deferred events, packed as type | epnum << 8 | length << 16
+#define DCDC_EV_DATAIN  (1)
+#define DCDC_EV_DATAOUT (2)
+#define DCDC_EV_PACK(type, epnum, len) \
+    ((uint32_t)(type) | ((uint32_t)(epnum) << 8) | ((uint32_t)(len) << 16))
+
+// Rx pool and Tx ring storage of port n, word aligned for the core DMA
+#define DCDC_PORT_BUFFERS(n) \
+    __ALIGN_BEGIN uint8_t DCDC_RxBuf_P##n[DCDC_RXPOOL_NUM * DCDC_P##n##_RXBUF_SIZE] __ALIGN_END; \
+    __ALIGN_BEGIN uint8_t DCDC_TxBuf_P##n[DCDC_P##n##_TXBUF_SIZE] __ALIGN_END;
+
+// Entry of the per port storage table
+#define DCDC_PORT_BUFTAB(n) \
+    { DCDC_RxBuf_P##n, DCDC_P##n##_RXBUF_SIZE, DCDC_TxBuf_P##n, DCDC_P##n##_TXBUF_SIZE },
+
+// Entry of the Tx settings table
+#define DCDC_PORT_TXCFG(n) \
+    { DCDC_TX_COALESCE_BYTES, DCDC_TX_COALESCE_FRAMES, DCDC_TX_WEIGHT },
+
+// Per port part of the configuration descriptor
+#define DCDC_PORT_DESC(n) \
+    /* Interface Association Descriptor */ \
+    USB_LEN_IAD_DESC,   /* bLength */ \
+    USB_DESC_TYPE_IAD,  /* bDescriptorType */ \
+    DCDC_COMM_ITF(n - 1),   /* bFirstInterface */ \
+    0x02,   /* bInterfaceCount */ \
+    0x02,   /* bFunctionClass: CDC */ \
+    0x02,   /* bFunctionSubClass - Abstract Control Model */ \
+    0x01,   /* bFunctionProtocol - Common AT commands */ \
+    0x02,   /* iFunction */ \
+ \
+    /* Interface Descriptor */ \
+    USB_LEN_IF_DESC,            /* bLength */ \
+    USB_DESC_TYPE_INTERFACE,    /* bDescriptorType */ \
+    DCDC_COMM_ITF(n - 1),   /* bInterfaceNumber */ \
+    0x00,   /* bAlternateSetting */ \
+    0x01,   /* bNumEndpoints - One endpoint used */ \
+    0x02,   /* bInterfaceClass - CDC */ \
+    0x02,   /* bInterfaceSubClass - Abstract Control Model */ \
+    0x01,   /* bInterfaceProtocol - Common AT commands */ \
+    0x00,   /* iInterface: */ \
+ \
+    /* Header Functional Descriptor */ \
+    0x05,   /* bLength */ \
+    0x24,   /* bDescriptorType - CS_INTERFACE */ \
+    0x00,   /* bDescriptorSubtype */ \
+    0x10,   /* bcdCDC */ \
+    0x01, \
+    /* Call Managment Functional Descriptor */ \
+    0x05,   /* bFunctionLength */ \
+    0x24,   /* bDescriptorType - CS_INTERFACE */ \
+    0x01,   /* bDescriptorSubtype */ \
+    0x00,   /* bmCapabilities - D0+D1 */ \
+    DCDC_DATA_ITF(n - 1),   /* bDataInterface */ \
+    /* ACM Functional Descriptor */ \
+    0x04,   /* bFunctionLength */ \
+    0x24,   /* bDescriptorType - CS_INTERFACE */ \
+    0x02,   /* bDescriptorSubtype */ \
+    0x02,   /* bmCapabilities */ \
+    /* Union Functional Descriptor */ \
+    0x05,   /* bFunctionLength */ \
+    0x24,   /* bDescriptorType - CS_INTERFACE */ \
+    0x06,   /* bDescriptorSubtype */ \
+    DCDC_COMM_ITF(n - 1),   /* bMasterInterface - Communication Class Interface */ \
+    DCDC_DATA_ITF(n - 1),   /* bSlaveInterface0 - Data Class Interface */ \
+    /* Command EP Descriptor */ \
+    USB_LEN_EP_DESC,        /* bLength */ \
+    USB_DESC_TYPE_ENDPOINT, /* bDescriptorType */ \
+    DCDC_INTRIN_EP(n - 1),  /* bEndpointAddress */ \
+    0x03,           /* bmAttributes: Interrupt */ \
+    DCDC_CMD_PACKET_SIZE,  /* wMaxPacketSize */ \
+    0x00, \
+    0xFF,           /* bInterval: */ \
+    /* Data class interface descriptor */ \
+    USB_LEN_IF_DESC,            /* bLength */ \
+    USB_DESC_TYPE_INTERFACE,    /* bDescriptorType */ \
+    DCDC_DATA_ITF(n - 1),   /* bInterfaceNumber */ \
+    0x00,   /* bAlternateSetting */ \
+    0x02,   /* bNumEndpoints - Two endpoints */ \
+    0x0A,   /* bInterfaceClass - CDC */ \
+    0x00,   /* bInterfaceSubClass */ \
+    0x00,   /* bInterfaceProtocol */ \
+    0x00,   /* iInterface */ \
+    /* Data OUT EP Descriptor */ \
+    USB_LEN_EP_DESC,        /* bLength */ \
+    USB_DESC_TYPE_ENDPOINT, /* bDescriptorType */ \
+    DCDC_BULKOUT_EP(n - 1), /* bEndpointAddress */ \
+    0x02,           /* bmAttributes - Bulk */ \
+    LOBYTE(DCDC_DATA_PACKET_SIZE),  /* wMaxPacketSize */ \
+    HIBYTE(DCDC_DATA_PACKET_SIZE), \
+    0x00,           /* bInterval - ignore for bulk transfer */ \
+    /* Data IN EP Descriptor */ \
+    USB_LEN_EP_DESC,        /* bLength */ \
+    USB_DESC_TYPE_ENDPOINT, /* bDescriptorType */ \
+    DCDC_BULKIN_EP(n - 1),  /* bEndpointAddress */ \
+    0x02,           /* bmAttributes - Bulk */ \
+    LOBYTE(DCDC_DATA_PACKET_SIZE),  /* wMaxPacketSize */ \
+    HIBYTE(DCDC_DATA_PACKET_SIZE), \
+    0x00,           /* bInterval */
+
 /* Public */
 // USBD CDC Tx/Rx buffers
-uint8_t DCDC_RxBuf_P1[DCDC_RXBUF_SIZE]; // VCP1 RX Buffer
-uint8_t DCDC_TxBuf_P1[DCDC_TXBUF_SIZE]; // VCP1 TX Buffer
-uint8_t DCDC_RxBuf_P2[DCDC_RXBUF_SIZE]; // VCP2 RX Buffer
-uint8_t DCDC_TxBuf_P2[DCDC_TXBUF_SIZE]; // VCP2 TX Buffer
+DCDC_FOREACH_PORT(DCDC_PORT_BUFFERS)
+#if (USBD_DMA_ENABLE != 0)
+__ALIGN_BEGIN uint8_t DCDC_TxBounce[DCDC_NUM_PORTS][DCDC_TXBOUNCE_SIZE] __ALIGN_END; // Unaligned TX
+#endif
+
+/* Private */
+// Storage of each port
+typedef struct {
+    uint8_t *rx_buf;
+    uint32_t rx_size;
+    uint8_t *tx_buf;
+    uint32_t tx_size;
+} DCDC_PortBufTypeDef;
+
+static const DCDC_PortBufTypeDef DCDC_PortBuf[DCDC_NUM_PORTS] =
+{
+    DCDC_FOREACH_PORT(DCDC_PORT_BUFTAB)
+};
+
+// Tx settings of each port, kept across re-enumeration
+typedef struct {
+    uint32_t min_len;       // Coalescing: send once this much is queued
+    uint16_t max_frames;    // or once this many SOFs passed, 0 sends at once
+    uint32_t weight;        // Bytes per SOF period, 0 for no limit
+} DCDC_TxCfgTypeDef;
+
+static DCDC_TxCfgTypeDef DCDC_TxCfg[DCDC_NUM_PORTS] =
+{
+    DCDC_FOREACH_PORT(DCDC_PORT_TXCFG)
+};
+
+// Port offered the pipe first on the next scheduling pass
+static uint8_t DCDC_TxTurn;
+
+// SOFs seen since start up, the time base of coalescing
+static __IO uint32_t DCDC_SofCount;
+
+// Users of the SOF interrupt, one bit per port holding Tx data, one per
+// port with a run on OUT transfer (DCDC_SOF_RX), DCDC_SOF_APP while
+// DCDC_CountSof asks for every frame and DCDC_SOF_HOST while the host does
+// with DCDC_VREQ_SET_SOF. The interrupt is only unmasked while some bit is
+// set.
+#define DCDC_SOF_RX(idx) (1U << (16 + (idx)))
+#define DCDC_SOF_HOST (1U << 30)
+#define DCDC_SOF_APP (1U << 31)
+static uint32_t DCDC_SofUsers;
+
+// Nesting depth of DCDC_LOCK
+static uint32_t DCDC_LockDepth;
+
+// DCDC_EVF_x waiting for the main loop
+static __IO uint32_t DCDC_Events;
+
+// Runtime counters of every port, kept across re-enumeration. The host's
+// reset only moves the base. Each counter is written either from the
+// interrupt or under DCDC_LOCK, so increments never race.
+static DCDC_PortStatsTypeDef DCDC_Stats[DCDC_NUM_PORTS];
+static DCDC_PortStatsTypeDef DCDC_StatsBase[DCDC_NUM_PORTS];
+
+// DCDC_VREQ_GET_STATS reply, stable while EP0 sends it
+__ALIGN_BEGIN static DCDC_PortStatsTypeDef DCDC_StatsSnap[DCDC_NUM_PORTS] __ALIGN_END;
+
+#if (CYCPROF_ENABLE != 0)
+// DCDC_VREQ_GET_PROFILE reply, stable while EP0 sends it
+__ALIGN_BEGIN static CycProfTypeDef DCDC_ProfSnap __ALIGN_END;
+#endif
+
+#if (USBTRACE_ENABLE != 0)
+// DCDC_VREQ_GET_TRACE reply, stable while EP0 sends it
+__ALIGN_BEGIN static UsbTraceTypeDef DCDC_TraceSnap __ALIGN_END;
+#endif
+
+#if (SELFTEST_ENABLE != 0)
+// DCDC_VREQ_GET_SELFTEST reply, stable while EP0 sends it
+__ALIGN_BEGIN static SelfTestResultTypeDef DCDC_SelfTestSnap[DCDC_NUM_PORTS] __ALIGN_END;
+#endif
+
+#if (DCDC_DEFER != DCDC_DEFER_NONE)
+// OTG interrupt -> bottom half. Events queued before base belong to a
+// configuration that has since been torn down and are dropped.
+typedef struct {
+    uint32_t ev[DCDC_EVENT_NUM];
+    __IO uint32_t head;
+    __IO uint32_t tail;
+    __IO uint32_t base;
+    __IO uint8_t sof;       // SOF work pending, not queued per frame
+} DCDC_EventQueueTypeDef;
+
+static DCDC_EventQueueTypeDef DCDC_EvQueue;
+#endif
 
 /* Function prototypes */
 static uint8_t  DCDC_Init (USBD_HandleTypeDef *pdev,
@@ -61,9 +271,35 @@ static uint8_t  *DCDC_GetOtherSpeedCfgDesc (uint16_t *length);
 static uint8_t  *DCDC_GetDeviceQualifierDescriptor (uint16_t *length);
 
 static uint8_t  DCDC_SetTxBuffer  (USBD_HandleTypeDef   *pdev, uint8_t epnum,
-                                   uint8_t  *pbuff, uint16_t length);
+                                   uint8_t  *pbuff, uint32_t length);
 static uint8_t  DCDC_SetRxBuffer  (USBD_HandleTypeDef   *pdev, uint8_t epnum,
                                    uint8_t  *pbuff);
+static uint8_t  DCDC_TransmitPacket(USBD_HandleTypeDef *pdev, uint8_t ep_addr);
+static uint8_t  DCDC_HandleDataIn (USBD_HandleTypeDef *pdev, uint8_t epnum);
+static uint8_t  DCDC_HandleDataOut (USBD_HandleTypeDef *pdev, uint8_t epnum,
+                                    uint32_t rx_len);
+static void     DCDC_HandleSOF (USBD_HandleTypeDef *pdev);
+static void     DCDC_TxSchedule (USBD_HandleTypeDef *pdev);
+static void     DCDC_SofNeed (USBD_HandleTypeDef *pdev, uint32_t user, uint8_t need);
+#if (DCDC_DEFER != DCDC_DEFER_NONE)
+static uint8_t  DCDC_PostEvent (uint32_t ev);
+#endif
+static uint8_t  DCDC_TxKick (USBD_HandleTypeDef *pdev, DCDC_PortTypeDef *port);
+static void     DCDC_TxLatBin (DCDC_PortTypeDef *port, uint32_t stamp, uint32_t now);
+static void     DCDC_TxLatDone (DCDC_PortTypeDef *port);
+static void     DCDC_RxDone (USBD_HandleTypeDef *pdev, DCDC_PortTypeDef *port,
+                             uint32_t rx_len, uint8_t flushed);
+static void     DCDC_RxArm (USBD_HandleTypeDef *pdev, DCDC_PortTypeDef *port,
+                            uint32_t lead);
+static void     DCDC_RxFlush (USBD_HandleTypeDef *pdev, DCDC_PortTypeDef *port);
+static void     DCDC_RxKick (USBD_HandleTypeDef *pdev, DCDC_PortTypeDef *port);
+static void     DCDC_RxPoolInit (DCDC_RxPoolTypeDef *rxp, uint8_t *bufs,
+                                 uint32_t xfer_size);
+static uint32_t DCDC_RxSlot (DCDC_RxPoolTypeDef *rxp, uint8_t *rx_buf);
+static void     DCDC_RxRelease (USBD_HandleTypeDef *pdev, DCDC_PortTypeDef *port,
+                                uint32_t slot);
+static uint8_t  DCDC_VendorRequest (USBD_HandleTypeDef *pdev, USBD_SetupReqTypedef *req);
+static uint32_t DCDC_StatsSnapshot (uint8_t reset);
 
 // DCDC interface class callbacks
 USBD_ClassTypeDef  DCDC_cbs =
@@ -100,176 +336,21 @@ __ALIGN_BEGIN static uint8_t hUSBDeviceQualifierDesc[USB_LEN_DEV_QUALIFIER_DESC]
 };
 
 // DCDC Configuration Descriptor
-__ALIGN_BEGIN static uint8_t hUSBConfigDesc[] __ALIGN_END =
+__ALIGN_BEGIN static uint8_t hUSBConfigDesc[DCDC_CONFIG_DESC_SIZE] __ALIGN_END =
 {
     /* Configuration Descriptor */
     USB_LEN_CFG_DESC,               /* bLength */
     USB_DESC_TYPE_CONFIGURATION,    /* bDescriptorType */
-    DCDC_CONFIG_DESC_SIZE_LB,        /* wTotalLength */
-    DCDC_CONFIG_DESC_SIZE_HB,
-    0x04,   /* bNumInterfaces */
+    LOBYTE(DCDC_CONFIG_DESC_SIZE),  /* wTotalLength */
+    HIBYTE(DCDC_CONFIG_DESC_SIZE),
+    2 * DCDC_NUM_PORTS,   /* bNumInterfaces */
     0x01,   /* bConfigurationValue */
     0x00,   /* iConfiguration : Index of string descriptor describing the configuration */
     0xC0,   /* bmAttributes - Self Powered */
     0x32,   /* bMaxPower - 100 mA */
 
-    /* Interface Association Descriptor */
-    USB_LEN_IAD_DESC,   /* bLength */
-    USB_DESC_TYPE_IAD,  /* bDescriptorType */
-    0x00,   /* bFirstInterface */
-    0x02,   /* bInterfaceCount */
-    0x02,   /* bFunctionClass: CDC */
-    0x02,   /* bFunctionSubClass - Abstract Control Model */
-    0x01,   /* bFunctionProtocol - Common AT commands */
-    0x02,   /* iFunction */
-
-    /* Interface Descriptor */
-    USB_LEN_IF_DESC,            /* bLength */
-    USB_DESC_TYPE_INTERFACE,    /* bDescriptorType */
-    0x00,   /* bInterfaceNumber */
-    0x00,   /* bAlternateSetting */
-    0x01,   /* bNumEndpoints - One endpoint used */
-    0x02,   /* bInterfaceClass - CDC */
-    0x02,   /* bInterfaceSubClass - Abstract Control Model */
-    0x01,   /* bInterfaceProtocol - Common AT commands */
-    0x00,   /* iInterface: */
-
-    /* Header Functional Descriptor */
-    0x05,   /* bLength */
-    0x24,   /* bDescriptorType - CS_INTERFACE */
-    0x00,   /* bDescriptorSubtype */
-    0x10,   /* bcdCDC */
-    0x01,
-    /* Call Managment Functional Descriptor */
-    0x05,   /* bFunctionLength */
-    0x24,   /* bDescriptorType - CS_INTERFACE */
-    0x01,   /* bDescriptorSubtype */
-    0x00,   /* bmCapabilities - D0+D1 */
-    0x01,   /* bDataInterface - 1 */
-    /* ACM Functional Descriptor */
-    0x04,   /* bFunctionLength */
-    0x24,   /* bDescriptorType - CS_INTERFACE */
-    0x02,   /* bDescriptorSubtype */
-    0x02,   /* bmCapabilities */
-    /* Union Functional Descriptor */
-    0x05,   /* bFunctionLength */
-    0x24,   /* bDescriptorType - CS_INTERFACE */
-    0x06,   /* bDescriptorSubtype */
-    0x00,   /* bMasterInterface - Communication Class Interface */
-    0x01,   /* bSlaveInterface0 - Data Class Interface */
-    /* EP2 Descriptor */
-    USB_LEN_EP_DESC,        /* bLength */
-    USB_DESC_TYPE_ENDPOINT, /* bDescriptorType */
-    DCDC_P1_INTRIN_EP,     /* bEndpointAddress: (IN2) */
-    0x03,           /* bmAttributes: Interrupt */
-    DCDC_CMD_PACKET_SIZE,  /* wMaxPacketSize */
-    0x00,
-    0xFF,           /* bInterval: */
-    /* Data class interface descriptor */
-    USB_LEN_IF_DESC,            /* bLength */
-    USB_DESC_TYPE_INTERFACE,    /* bDescriptorType */
-    0x01,   /* bInterfaceNumber */
-    0x00,   /* bAlternateSetting */
-    0x02,   /* bNumEndpoints - Two endpoints */
-    0x0A,   /* bInterfaceClass - CDC */
-    0x00,   /* bInterfaceSubClass */
-    0x00,   /* bInterfaceProtocol */
-    0x00,   /* iInterface */
-    /* EP3 Descriptor */
-    USB_LEN_EP_DESC,        /* bLength */
-    USB_DESC_TYPE_ENDPOINT, /* bDescriptorType */
-    DCDC_P1_BULKOUT_EP,    /* bEndpointAddress - (OUT3) */
-    0x02,           /* bmAttributes - Bulk */
-    LOBYTE(DCDC_DATA_PACKET_SIZE),  /* wMaxPacketSize */
-    HIBYTE(DCDC_DATA_PACKET_SIZE),
-    0x00,           /* bInterval - ignore for bulk transfer */
-    /* EP1 Descriptor */
-    USB_LEN_EP_DESC,        /* bLength */
-    USB_DESC_TYPE_ENDPOINT, /* bDescriptorType */
-    DCDC_P1_BULKIN_EP,     /* bEndpointAddress - (IN1) */
-    0x02,           /* bmAttributes - Bulk */
-    LOBYTE(DCDC_DATA_PACKET_SIZE),  /* wMaxPacketSize */
-    HIBYTE(DCDC_DATA_PACKET_SIZE),
-    0x00,           /* bInterval */
-
-    /* Interface Association Descriptor */
-    USB_LEN_IAD_DESC,   /* bLength */
-    USB_DESC_TYPE_IAD,  /* bDescriptorType */
-    0x02,   /* bFirstInterface */
-    0x02,   /* bInterfaceCount */
-    0x02,   /* bFunctionClass: CDC */
-    0x02,   /* bFunctionSubClass - Abstract Control Model */
-    0x01,   /* bFunctionProtocol - Common AT commands */
-    0x02,   /* iFunction */
-
-    /* Interface Descriptor */
-    USB_LEN_IF_DESC,            /* bLength */
-    USB_DESC_TYPE_INTERFACE,    /* bDescriptorType */
-    0x02,   /* bInterfaceNumber */
-    0x00,   /* bAlternateSetting */
-    0x01,   /* bNumEndpoints - One endpoint used */
-    0x02,   /* bInterfaceClass - CDC */
-    0x02,   /* bInterfaceSubClass - Abstract Control Model */
-    0x01,   /* bInterfaceProtocol - Common AT commands */
-    0x00,   /* iInterface: */
-
-    /* Header Functional Descriptor */
-    0x05,   /* bLength */
-    0x24,   /* bDescriptorType - CS_INTERFACE */
-    0x00,   /* bDescriptorSubtype */
-    0x10,   /* bcdCDC */
-    0x01,
-    /* Call Managment Functional Descriptor */
-    0x05,   /* bFunctionLength */
-    0x24,   /* bDescriptorType - CS_INTERFACE */
-    0x01,   /* bDescriptorSubtype */
-    0x00,   /* bmCapabilities - D0+D1 */
-    0x03,   /* bDataInterface - 3 */
-    /* ACM Functional Descriptor */
-    0x04,   /* bFunctionLength */
-    0x24,   /* bDescriptorType - CS_INTERFACE */
-    0x02,   /* bDescriptorSubtype */
-    0x02,   /* bmCapabilities */
-    /* Union Functional Descriptor */
-    0x05,   /* bFunctionLength */
-    0x24,   /* bDescriptorType - CS_INTERFACE */
-    0x06,   /* bDescriptorSubtype */
-    0x02,   /* bMasterInterface - Communication Class Interface */
-    0x03,   /* bSlaveInterface0 - Data Class Interface */
-    /* EP2 Descriptor */
-    USB_LEN_EP_DESC,        /* bLength */
-    USB_DESC_TYPE_ENDPOINT, /* bDescriptorType */
-    DCDC_P2_INTRIN_EP,     /* bEndpointAddress: (IN2) */
-    0x03,           /* bmAttributes: Interrupt */
-    DCDC_CMD_PACKET_SIZE,  /* wMaxPacketSize */
-    0x00,
-    0xFF,           /* bInterval: */
-    /* Data class interface descriptor */
-    USB_LEN_IF_DESC,            /* bLength */
-    USB_DESC_TYPE_INTERFACE,    /* bDescriptorType */
-    0x03,   /* bInterfaceNumber */
-    0x00,   /* bAlternateSetting */
-    0x02,   /* bNumEndpoints - Two endpoints */
-    0x0A,   /* bInterfaceClass - CDC */
-    0x00,   /* bInterfaceSubClass */
-    0x00,   /* bInterfaceProtocol */
-    0x00,   /* iInterface */
-    /* EP3 Descriptor */
-    USB_LEN_EP_DESC,        /* bLength */
-    USB_DESC_TYPE_ENDPOINT, /* bDescriptorType */
-    DCDC_P2_BULKOUT_EP,    /* bEndpointAddress - (OUT3) */
-    0x02,           /* bmAttributes - Bulk */
-    LOBYTE(DCDC_DATA_PACKET_SIZE),  /* wMaxPacketSize */
-    HIBYTE(DCDC_DATA_PACKET_SIZE),
-    0x00,           /* bInterval - ignore for bulk transfer */
-    /* EP1 Descriptor */
-    USB_LEN_EP_DESC,        /* bLength */
-    USB_DESC_TYPE_ENDPOINT, /* bDescriptorType */
-    DCDC_P2_BULKIN_EP,     /* bEndpointAddress - (IN1) */
-    0x02,           /* bmAttributes - Bulk */
-    LOBYTE(DCDC_DATA_PACKET_SIZE),  /* wMaxPacketSize */
-    HIBYTE(DCDC_DATA_PACKET_SIZE),
-    0x00           /* bInterval */
+    /* One IAD, Communication and Data Class interface per port */
+    DCDC_FOREACH_PORT(DCDC_PORT_DESC)
 };
 
 /************************* Private ********************************************/
@@ -279,121 +360,120 @@ __ALIGN_BEGIN static uint8_t hUSBConfigDesc[] __ALIGN_END =
 static uint8_t  DCDC_Init (USBD_HandleTypeDef *pdev,
                            uint8_t cfgidx)
 {
+    uint8_t idx;
+
     pdev->pClassData = USBD_malloc(sizeof(DCDC_HandleTypeDef));
     if(pdev->pClassData == NULL)
     {
         return DCDC_FAIL;
     }
 
-    if(pdev->dev_speed == USBD_SPEED_HIGH)
+    for(idx = 0; idx < DCDC_NUM_PORTS; idx++)
     {
-        /* Open VCP1 EP IN */
-        USBD_LL_OpenEP(pdev,
-                       DCDC_P1_BULKIN_EP,
-                       USBD_EP_TYPE_BULK,
-                       DCDC_DATA_HS_IN_PACKET_SIZE);
-
-        /* Open VCP1 EP OUT */
-        USBD_LL_OpenEP(pdev,
-                       DCDC_P1_BULKOUT_EP,
-                       USBD_EP_TYPE_BULK,
-                       DCDC_DATA_HS_OUT_PACKET_SIZE);
-
-        /* Open VCP2 EP IN */
-        USBD_LL_OpenEP(pdev,
-                       DCDC_P2_BULKIN_EP,
-                       USBD_EP_TYPE_BULK,
-                       DCDC_DATA_HS_IN_PACKET_SIZE);
+        if(pdev->dev_speed == USBD_SPEED_HIGH)
+        {
+            /* Open VCP EP IN */
+            USBD_LL_OpenEP(pdev,
+                           DCDC_BULKIN_EP(idx),
+                           USBD_EP_TYPE_BULK,
+                           DCDC_DATA_HS_IN_PACKET_SIZE);
+
+            /* Open VCP EP OUT */
+            USBD_LL_OpenEP(pdev,
+                           DCDC_BULKOUT_EP(idx),
+                           USBD_EP_TYPE_BULK,
+                           DCDC_DATA_HS_OUT_PACKET_SIZE);
+        }
+        else
+        {
+            /* Open VCP EP IN */
+            USBD_LL_OpenEP(pdev,
+                           DCDC_BULKIN_EP(idx),
+                           USBD_EP_TYPE_BULK,
+                           DCDC_DATA_FS_IN_PACKET_SIZE);
+
+            /* Open VCP EP OUT */
+            USBD_LL_OpenEP(pdev,
+                           DCDC_BULKOUT_EP(idx),
+                           USBD_EP_TYPE_BULK,
+                           DCDC_DATA_FS_OUT_PACKET_SIZE);
+        }
 
-        /* Open VCP2 EP OUT */
+        /* Open VCP Command IN EP */
         USBD_LL_OpenEP(pdev,
-                       DCDC_P2_BULKOUT_EP,
-                       USBD_EP_TYPE_BULK,
-                       DCDC_DATA_HS_OUT_PACKET_SIZE);
+                       DCDC_INTRIN_EP(idx),
+                       USBD_EP_TYPE_INTR,
+                       DCDC_CMD_PACKET_SIZE);
 
+        /* Init  physical Interface components */
+        ((DCDC_ItfTypeDef *)pdev->pUserData)->CDC[idx]->Init();
     }
-    else
-    {
-        /* Open VCP1 EP IN */
-        USBD_LL_OpenEP(pdev,
-                       DCDC_P1_BULKIN_EP,
-                       USBD_EP_TYPE_BULK,
-                       DCDC_DATA_FS_IN_PACKET_SIZE);
-
-        /* Open VCP1 EP OUT */
-        USBD_LL_OpenEP(pdev,
-                       DCDC_P1_BULKOUT_EP,
-                       USBD_EP_TYPE_BULK,
-                       DCDC_DATA_FS_OUT_PACKET_SIZE);
-
-        /* Open VCP2 EP IN */
-        USBD_LL_OpenEP(pdev,
-                       DCDC_P2_BULKIN_EP,
-                       USBD_EP_TYPE_BULK,
-                       DCDC_DATA_FS_IN_PACKET_SIZE);
 
-        /* Open VCP2 EP OUT */
-        USBD_LL_OpenEP(pdev,
-                       DCDC_P2_BULKOUT_EP,
-                       USBD_EP_TYPE_BULK,
-                       DCDC_DATA_FS_OUT_PACKET_SIZE);
-    }
+    DCDC_HandleTypeDef *hdls = (DCDC_HandleTypeDef*) pdev->pClassData;
 
-    /* Open VCP1 Command IN EP */
-    USBD_LL_OpenEP(pdev,
-                   DCDC_P1_INTRIN_EP,
-                   USBD_EP_TYPE_INTR,
-                   DCDC_CMD_PACKET_SIZE);
+#if (DCDC_DEFER != DCDC_DEFER_NONE)
+    /* Anything still queued refers to the previous configuration */
+    DCDC_EvQueue.base = DCDC_EvQueue.head;
+#endif
 
-    /* Open VCP2 Command IN EP */
-    USBD_LL_OpenEP(pdev,
-                   DCDC_P2_INTRIN_EP,
-                   USBD_EP_TYPE_INTR,
-                   DCDC_CMD_PACKET_SIZE);
+    /* Nothing held yet, SOF only if the application counts frames */
+    DCDC_SofUsers &= DCDC_SOF_APP;
+    USBD_LL_EnableSOF(pdev, (DCDC_SofUsers != 0));
+    DCDC_Notify(DCDC_EVF_CONFIG);
 
-    /* Init  physical Interface components */
-    ((DCDC_ItfTypeDef *)pdev->pUserData)->CDC1->Init();
-    ((DCDC_ItfTypeDef *)pdev->pUserData)->CDC2->Init();
+    /* Build the endpoint and interface lookup tables */
+    memset(hdls->in_ep_port, 0, sizeof(hdls->in_ep_port));
+    memset(hdls->out_ep_port, 0, sizeof(hdls->out_ep_port));
+    memset(hdls->itf_port, 0, sizeof(hdls->itf_port));
+    hdls->cmd_port = NULL;
 
-    DCDC_HandleTypeDef *hdls = (DCDC_HandleTypeDef*) pdev->pClassData;
+    /* Cycle counter for the Tx latency stamps */
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
 
-    /* Init Xfer states */
-    hdls->hcdc1.TxState = 0;
-    hdls->hcdc1.RxState = 0;
-    hdls->hcdc2.TxState = 0;
-    hdls->hcdc2.RxState = 0;
-
-    /* Init Buffers */
-    DCDC_SetRxBuffer(pdev, DCDC_P1_BULKOUT_EP, DCDC_RxBuf_P1);
-    DCDC_SetTxBuffer(pdev, DCDC_P1_BULKIN_EP, DCDC_TxBuf_P1, 0);
-    DCDC_SetRxBuffer(pdev, DCDC_P2_BULKOUT_EP, DCDC_RxBuf_P2);
-    DCDC_SetTxBuffer(pdev, DCDC_P2_BULKIN_EP, DCDC_TxBuf_P2, 0);
-
-    if(pdev->dev_speed == USBD_SPEED_HIGH)
-    {
-        /* Prepare VCP1 Out endpoint to receive next packet */
-        USBD_LL_PrepareReceive(pdev,
-                               DCDC_P1_BULKOUT_EP,
-                               hdls->hcdc1.RxBuffer,
-                               DCDC_DATA_HS_OUT_PACKET_SIZE);
-        /* Prepare VCP2 Out endpoint to receive next packet */
-        USBD_LL_PrepareReceive(pdev,
-                               DCDC_P2_BULKOUT_EP,
-                               hdls->hcdc2.RxBuffer,
-                               DCDC_DATA_HS_OUT_PACKET_SIZE);
+    for(idx = 0; idx < DCDC_NUM_PORTS; idx++)
+    {
+        DCDC_PortTypeDef *port = &hdls->port[idx];
+
+        port->idx = idx;
+        port->in_ep = DCDC_BULKIN_EP(idx);
+        port->out_ep = DCDC_BULKOUT_EP(idx);
+        hdls->in_ep_port[port->in_ep & 0x0F] = port;
+        hdls->out_ep_port[port->out_ep & 0x0F] = port;
+        hdls->itf_port[DCDC_COMM_ITF(idx)] = port;
     }
-    else
+
+    for(idx = 0; idx < DCDC_NUM_PORTS; idx++)
     {
-        /* Prepare VCP1 Out endpoint to receive next packet */
-        USBD_LL_PrepareReceive(pdev,
-                               DCDC_P1_BULKOUT_EP,
-                               hdls->hcdc1.RxBuffer,
-                               DCDC_DATA_FS_OUT_PACKET_SIZE);
-        /* Prepare VCP2 Out endpoint to receive next packet */
-        USBD_LL_PrepareReceive(pdev,
-                               DCDC_P2_BULKOUT_EP,
-                               hdls->hcdc2.RxBuffer,
-                               DCDC_DATA_FS_OUT_PACKET_SIZE);
+        DCDC_PortTypeDef *port = &hdls->port[idx];
+
+        /* Init Xfer states */
+        port->hcdc.TxState = 0;
+        port->hcdc.RxState = 0;
+        port->hcdc.CmdOpCode = 0xFF;
+
+        /* Init Tx queue and Rx pool */
+        RingBuf_Init(&port->txq.ring, DCDC_PortBuf[idx].tx_buf, DCDC_PortBuf[idx].tx_size);
+        port->txq.desc_head = port->txq.desc_tail = 0;
+        port->txq.desc_offset = 0;
+#if (USBD_DMA_ENABLE != 0)
+        port->txq.bounce = DCDC_TxBounce[idx];
+#else
+        port->txq.bounce = NULL;
+#endif
+        port->txq.src = DCDC_TXSRC_NONE;
+        port->txq.held = 0;
+        port->txq.round = DCDC_SofCount;
+        port->txq.credit = DCDC_TxCfg[idx].weight;
+        memset(&port->lat, 0, sizeof(port->lat));
+        port->naking = 0;
+        DCDC_RxPoolInit(&port->rxp, DCDC_PortBuf[idx].rx_buf, DCDC_PortBuf[idx].rx_size);
+
+        /* Init Buffers */
+        DCDC_SetTxBuffer(pdev, port->in_ep, DCDC_PortBuf[idx].tx_buf, 0);
+
+        /* Prepare Out endpoint to receive first packet */
+        DCDC_RxKick(pdev, port);
     }
 
     return DCDC_OK;
@@ -405,25 +485,32 @@ static uint8_t  DCDC_Init (USBD_HandleTypeDef *pdev,
 static uint8_t  DCDC_DeInit (USBD_HandleTypeDef *pdev,
                              uint8_t cfgidx)
 {
-    /* Flush and close VCP1 and VCP2 endpoints */
-    USBD_LL_FlushEP(pdev, DCDC_P1_BULKIN_EP);
-    USBD_LL_CloseEP(pdev, DCDC_P1_BULKIN_EP);
-    USBD_LL_FlushEP(pdev, DCDC_P1_BULKOUT_EP);
-    USBD_LL_CloseEP(pdev, DCDC_P1_BULKOUT_EP);
-    USBD_LL_FlushEP(pdev, DCDC_P1_INTRIN_EP);
-    USBD_LL_CloseEP(pdev, DCDC_P1_INTRIN_EP);
-    USBD_LL_FlushEP(pdev, DCDC_P2_BULKIN_EP);
-    USBD_LL_CloseEP(pdev, DCDC_P2_BULKIN_EP);
-    USBD_LL_FlushEP(pdev, DCDC_P2_BULKOUT_EP);
-    USBD_LL_CloseEP(pdev, DCDC_P2_BULKOUT_EP);
-    USBD_LL_FlushEP(pdev, DCDC_P2_INTRIN_EP);
-    USBD_LL_CloseEP(pdev, DCDC_P2_INTRIN_EP);
+    uint8_t idx;
+
+    /* Held Tx data goes with the configuration, a frame count resumes
+    with the next one */
+    DCDC_SofUsers &= DCDC_SOF_APP;
+    USBD_LL_EnableSOF(pdev, 0);
+    DCDC_Notify(DCDC_EVF_CONFIG);
+
+    /* Flush and close VCP endpoints */
+    for(idx = 0; idx < DCDC_NUM_PORTS; idx++)
+    {
+        USBD_LL_FlushEP(pdev, DCDC_BULKIN_EP(idx));
+        USBD_LL_CloseEP(pdev, DCDC_BULKIN_EP(idx));
+        USBD_LL_FlushEP(pdev, DCDC_BULKOUT_EP(idx));
+        USBD_LL_CloseEP(pdev, DCDC_BULKOUT_EP(idx));
+        USBD_LL_FlushEP(pdev, DCDC_INTRIN_EP(idx));
+        USBD_LL_CloseEP(pdev, DCDC_INTRIN_EP(idx));
+    }
 
     /* DeInit  physical Interface components */
     if(pdev->pClassData != NULL)
     {
-        ((DCDC_ItfTypeDef *)pdev->pUserData)->CDC1->DeInit();
-        ((DCDC_ItfTypeDef *)pdev->pUserData)->CDC2->DeInit();
+        for(idx = 0; idx < DCDC_NUM_PORTS; idx++)
+        {
+            ((DCDC_ItfTypeDef *)pdev->pUserData)->CDC[idx]->DeInit();
+        }
         USBD_free(pdev->pClassData);
         pdev->pClassData = NULL;
     }
@@ -443,80 +530,54 @@ static uint8_t  DCDC_Setup (USBD_HandleTypeDef *pdev,
     }
 
     DCDC_HandleTypeDef *hdls = (DCDC_HandleTypeDef*) pdev->pClassData;
+    DCDC_PortTypeDef *port;
+    USBD_CDC_HandleTypeDef *hcdc;
+    USBD_CDC_ItfTypeDef *itf;
 
     switch (req->bmRequest & USB_REQ_TYPE_MASK)
     {
         case USB_REQ_TYPE_CLASS :
+        /* Class requests go to the Communication Class Interface of a port */
+        if(LOBYTE(req->wIndex) >= (2 * DCDC_NUM_PORTS))
+        {
+            break;
+        }
+        port = hdls->itf_port[LOBYTE(req->wIndex)];
+        if(port == NULL)
+        {
+            break;
+        }
+        hcdc = &port->hcdc;
+        itf = ((DCDC_ItfTypeDef *)pdev->pUserData)->CDC[port->idx];
+
         if (req->wLength)
         {
             if (req->bmRequest & 0x80)
             {
-                switch(req->wIndex)
-                {
-                    case 2:
-                        ((DCDC_ItfTypeDef *)pdev->pUserData)->CDC2->Control(req->bRequest,
-                                                                                (uint8_t *)(hdls->hcdc2.data),
-                                                                                req->wLength);
-                        USBD_CtlSendData (pdev, (uint8_t *)(hdls->hcdc2.data),
-                                            req->wLength);
-                        break;
-
-                    case 0:
-                        ((DCDC_ItfTypeDef *)pdev->pUserData)->CDC1->Control(req->bRequest,
-                                                                                 (uint8_t *)(hdls->hcdc1.data),
-                                                                                req->wLength);
-                          USBD_CtlSendData (pdev, (uint8_t *)(hdls->hcdc1.data),
-                                            req->wLength);
-                          break;
-
-                    default:
-                        break;
-                }
+                itf->Control(req->bRequest, (uint8_t *)(hcdc->data),
+                             req->wLength);
+                USBD_CtlSendData (pdev, (uint8_t *)(hcdc->data),
+                                  req->wLength);
             }
             else
             {
-                switch(req->wIndex)
-                {
-                    case 2:
-                        hdls->hcdc2.CmdOpCode = req->bRequest;
-                        hdls->hcdc2.CmdLength = req->wLength;
-                        USBD_CtlPrepareRx (pdev, (uint8_t *)(hdls->hcdc2.data),
-                                           req->wLength);
-                        break;
-
-                    case 0:
-                        hdls->hcdc1.CmdOpCode = req->bRequest;
-                        hdls->hcdc1.CmdLength = req->wLength;
-                        USBD_CtlPrepareRx (pdev, (uint8_t *)(hdls->hcdc1.data),
-                                           req->wLength);
-                        break;
-
-                    default:
-                        break;
-                }
+                hcdc->CmdOpCode = req->bRequest;
+                hcdc->CmdLength = req->wLength;
+                hdls->cmd_port = port;
+                USBD_CtlPrepareRx (pdev, (uint8_t *)(hcdc->data),
+                                   req->wLength);
             }
         }
         else
         {
-            switch(req->wIndex)
-            {
-                case 2:
-                    ((DCDC_ItfTypeDef *)pdev->pUserData)->CDC2->Control(req->bRequest,
-                                                                             NULL, 0);
-                      break;
-
-                case 0:
-                    ((DCDC_ItfTypeDef *)pdev->pUserData)->CDC1->Control(req->bRequest,
-                                                                             NULL, 0);
-                      break;
-
-                default:
-                    break;
-            }
+            itf->Control(req->bRequest, NULL, 0);
         }
 
         break;
 
+        case USB_REQ_TYPE_VENDOR :
+        return DCDC_VendorRequest(pdev, req);
+
         default:
         break;
     }
@@ -528,6 +589,20 @@ static uint8_t  DCDC_Setup (USBD_HandleTypeDef *pdev,
  * Handle IN packets
  */
 static uint8_t  DCDC_DataIn (USBD_HandleTypeDef *pdev, uint8_t epnum)
+{
+    CYCPROF_SINCE_ENTRY(CYCPROF_IRQLAT);
+
+#if (DCDC_DEFER != DCDC_DEFER_NONE)
+    return DCDC_PostEvent(DCDC_EV_PACK(DCDC_EV_DATAIN, epnum, 0));
+#else
+    return DCDC_HandleDataIn(pdev, epnum);
+#endif
+}
+
+/* DCDC_HandleDataIn
+ * Releases what a finished Bulk IN transfer sent and starts the next one
+ */
+static uint8_t  DCDC_HandleDataIn (USBD_HandleTypeDef *pdev, uint8_t epnum)
 {
     if(pdev->pClassData == NULL)
     {
@@ -535,23 +610,75 @@ static uint8_t  DCDC_DataIn (USBD_HandleTypeDef *pdev, uint8_t epnum)
     }
 
     DCDC_HandleTypeDef *hdls = (DCDC_HandleTypeDef*) pdev->pClassData;
-    USBD_CDC_HandleTypeDef *hcdc;
-
-    uint8_t ep_addr = epnum | 0x80;
-    if (ep_addr == DCDC_P1_BULKIN_EP)
+    DCDC_PortTypeDef *port = hdls->in_ep_port[epnum & 0x0F];
+    if (port == NULL)
     {
-        hcdc = &hdls->hcdc1;
+        return USBD_FAIL;
     }
-    else if (ep_addr == DCDC_P2_BULKIN_EP)
+
+    CYCPROF_START(datain);
+    USBD_CDC_HandleTypeDef *hcdc = &port->hcdc;
+    DCDC_TxQueueTypeDef *txq = &port->txq;
+    DCDC_TxCompleteTypeDef done = ((DCDC_ItfTypeDef *)pdev->pUserData)->TxComplete;
+
+    uint32_t sent = hcdc->TxLength;
+    uint8_t src = txq->src;
+    DCDC_PortStatsTypeDef *stats = &DCDC_Stats[port->idx];
+
+    USBTRACE(USBTRACE_TXDONE, port->in_ep, sent);
+    stats->tx_bytes += sent;
+    stats->tx_packets += (sent != 0) ? ((sent + DCDC_DATA_PACKET_SIZE - 1) / DCDC_DATA_PACKET_SIZE) : 1;
+    stats->tx_pending_us += (DWT->CYCCNT - port->tx_stamp) / (SystemCoreClock / 1000000);
+
+    /* Release what just went out */
+    if(src == DCDC_TXSRC_DESC)
     {
-        hcdc = &hdls->hcdc2;
+        DCDC_BufDescTypeDef *desc = &txq->desc[txq->desc_tail & (DCDC_TXDESC_NUM - 1)];
+
+        txq->desc_offset += sent;
+        if(txq->desc_offset >= desc->len)
+        {
+            uint8_t *buf = desc->buf;
+            uint32_t len = desc->len;
+
+            DCDC_TxLatBin(port, txq->desc_stamp[txq->desc_tail & (DCDC_TXDESC_NUM - 1)],
+                          DWT->CYCCNT);
+            txq->desc_offset = 0;
+            txq->desc_tail++;
+            /* Hand the buffer back, the owner may resubmit from here */
+            if(done != NULL)
+            {
+                CYCPROF_START(txcomplete);
+                done(port->idx + DCDC_PORT1, buf, len);
+                CYCPROF_STOP(txcomplete, CYCPROF_TXCOMPLETE);
+            }
+        }
     }
-    else
+    else if(src == DCDC_TXSRC_RING)
     {
-        return USBD_FAIL;
+        RingBuf_Consume(&txq->ring, sent);
+        DCDC_TxLatDone(port);
     }
 
+    /* Ring space or a descriptor slot came free */
+    DCDC_Notify(DCDC_EVF_TX(port->idx));
+
+    /* Drain the next span or descriptor, the ports taking turns */
     hcdc->TxState = 0;
+    DCDC_TxSchedule(pdev);
+
+    /* Pipe going idle after a full packet, the host only completes its
+    read on a short one, so close the stream with a ZLP. Not while data is
+    held for coalescing or weight, its own transfer ends the read. */
+    if((hcdc->TxState == 0) && (src != DCDC_TXSRC_ZLP) && !txq->held &&
+       (sent != 0) && ((sent % DCDC_DATA_PACKET_SIZE) == 0))
+    {
+        txq->src = DCDC_TXSRC_ZLP;
+        DCDC_SetTxBuffer(pdev, port->in_ep, hcdc->TxBuffer, 0);
+        DCDC_TransmitPacket(pdev, port->in_ep);
+    }
+
+    CYCPROF_STOP(datain, CYCPROF_DATAIN);
     return USBD_OK;
 }
 
@@ -565,13 +692,110 @@ static uint8_t  DCDC_SOF (USBD_HandleTypeDef *pdev)
         return USBD_FAIL;
     }
 
+    DCDC_SofCount++;
+
+#if (DCDC_DEFER != DCDC_DEFER_NONE)
+    /* One flag, not an event per frame */
+    DCDC_EvQueue.sof = 1;
+#if (DCDC_DEFER == DCDC_DEFER_PENDSV)
+    SCB->ICSR = SCB_ICSR_PENDSVSET_Msk;
+#else
+    DCDC_Notify(DCDC_EVF_BH);
+#endif
+#else
+    DCDC_HandleSOF(pdev);
+#endif
+
     return USBD_OK;
 }
 
+/* DCDC_SofNeed
+ * Adds or drops a user of the SOF interrupt, masking it when none is left
+ */
+static void DCDC_SofNeed(USBD_HandleTypeDef *pdev,
+                         uint32_t user,
+                         uint8_t need)
+{
+    uint32_t users = need ? (DCDC_SofUsers | user) : (DCDC_SofUsers & ~user);
+
+    if((users != 0) != (DCDC_SofUsers != 0))
+    {
+        USBD_LL_EnableSOF(pdev, (users != 0));
+    }
+    DCDC_SofUsers = users;
+}
+
+/* DCDC_HandleSOF
+ * Sends ring data whose coalescing time ran out and ends OUT transfers left
+ * waiting for the rest of a write
+ */
+static void DCDC_HandleSOF (USBD_HandleTypeDef *pdev)
+{
+    DCDC_HandleTypeDef *hdls = (DCDC_HandleTypeDef*) pdev->pClassData;
+    uint8_t idx;
+
+    if(hdls == NULL)
+    {
+        return;
+    }
+
+    CYCPROF_START(sof);
+    DCDC_TxSchedule(pdev);
+    for(idx = 0; idx < DCDC_NUM_PORTS; idx++)
+    {
+        DCDC_RxFlush(pdev, &hdls->port[idx]);
+    }
+    CYCPROF_STOP(sof, CYCPROF_SOF);
+}
+
+/* DCDC_TxSchedule
+ * Offers every idle port the pipe, starting one further along each pass so
+ * no port is always served first. DCDC_PRIO_PORT is offered it ahead of
+ * the turn. Ports past their weight sit the pass out until the next SOF.
+ */
+static void DCDC_TxSchedule(USBD_HandleTypeDef *pdev)
+{
+    DCDC_HandleTypeDef *hdls = (DCDC_HandleTypeDef*) pdev->pClassData;
+    uint8_t idx = DCDC_TxTurn;
+    uint8_t n;
+
+#if (DCDC_PRIO_PORT != 0)
+    /* Its turn comes round again below, by then the pipe is busy */
+    DCDC_TxKick(pdev, &hdls->port[DCDC_PRIO_PORT - DCDC_PORT1]);
+#endif
+
+    for(n = 0; n < DCDC_NUM_PORTS; n++)
+    {
+        DCDC_TxKick(pdev, &hdls->port[idx]);
+        idx = (idx + 1 < DCDC_NUM_PORTS) ? (idx + 1) : 0;
+    }
+
+    DCDC_TxTurn = (DCDC_TxTurn + 1 < DCDC_NUM_PORTS) ? (DCDC_TxTurn + 1) : 0;
+}
+
 /* DCDC_DataOut
  * Handle OUT packets
  */
 static uint8_t  DCDC_DataOut (USBD_HandleTypeDef *pdev, uint8_t epnum)
+{
+    CYCPROF_SINCE_ENTRY(CYCPROF_IRQLAT);
+
+    /* The transfer ended on a full buffer or a short packet, get the
+    received data length */
+    uint32_t rx_len = USBD_LL_GetRxDataSize (pdev, epnum);
+
+#if (DCDC_DEFER != DCDC_DEFER_NONE)
+    return DCDC_PostEvent(DCDC_EV_PACK(DCDC_EV_DATAOUT, epnum, rx_len));
+#else
+    return DCDC_HandleDataOut(pdev, epnum, rx_len);
+#endif
+}
+
+/* DCDC_HandleDataOut
+ * Handles a finished Bulk OUT transfer, see DCDC_RxDone
+ */
+static uint8_t  DCDC_HandleDataOut (USBD_HandleTypeDef *pdev, uint8_t epnum,
+                                    uint32_t rx_len)
 {
     if(pdev->pClassData == NULL)
     {
@@ -579,37 +803,15 @@ static uint8_t  DCDC_DataOut (USBD_HandleTypeDef *pdev, uint8_t epnum)
     }
 
     DCDC_HandleTypeDef *hdls = (DCDC_HandleTypeDef*) pdev->pClassData;
-    USBD_CDC_HandleTypeDef *hcdc;
-
-    if (epnum == DCDC_P1_BULKOUT_EP)
-    {
-        hcdc = &hdls->hcdc1;
-        /* Get the received data length */
-        hcdc->RxLength = USBD_LL_GetRxDataSize (pdev, epnum);
-        /* USB data will be immediately processed, this allow next USB traffic being
-        NAKed till the end of the application Xfer */
-        ((DCDC_ItfTypeDef *)pdev->pUserData)->CDC1->Receive(hcdc->RxBuffer, &hcdc->RxLength);
-        /* Prepare VCP1 Out endpoint to receive next packet */
-        USBD_LL_PrepareReceive(pdev, DCDC_P1_BULKOUT_EP, hcdc->RxBuffer,
-                               DCDC_DATA_HS_OUT_PACKET_SIZE);
-    }
-    else if (epnum == DCDC_P2_BULKOUT_EP)
-    {
-        hcdc = &hdls->hcdc2;
-        /* Get the received data length */
-        hcdc->RxLength = USBD_LL_GetRxDataSize (pdev, epnum);
-        /* USB data will be immediately processed, this allow next USB traffic being
-        NAKed till the end of the application Xfer */
-        ((DCDC_ItfTypeDef *)pdev->pUserData)->CDC2->Receive(hcdc->RxBuffer, &hcdc->RxLength);
-        /* Prepare VCP2 Out endpoint to receive next packet */
-        USBD_LL_PrepareReceive(pdev, DCDC_P2_BULKOUT_EP, hcdc->RxBuffer,
-                               DCDC_DATA_HS_OUT_PACKET_SIZE);
-    }
-    else
+    DCDC_PortTypeDef *port = hdls->out_ep_port[epnum & 0x0F];
+    if (port == NULL)
     {
         return USBD_FAIL;
     }
 
+    CYCPROF_START(dataout);
+    DCDC_RxDone(pdev, port, rx_len, 0);
+    CYCPROF_STOP(dataout, CYCPROF_DATAOUT);
     return USBD_OK;
 }
 
@@ -632,13 +834,16 @@ static uint8_t  DCDC_EP0_RxReady (USBD_HandleTypeDef *pdev)
     }
 
     DCDC_HandleTypeDef *hdls = (DCDC_HandleTypeDef*) pdev->pClassData;
+    DCDC_PortTypeDef *port = hdls->cmd_port;
 
-    if((pdev->pUserData != NULL) && (hdls->hcdc1.CmdOpCode != 0xFF))
+    /* The port that took the request in DCDC_Setup */
+    if((pdev->pUserData != NULL) && (port != NULL) && (port->hcdc.CmdOpCode != 0xFF))
     {
-        ((DCDC_ItfTypeDef *)pdev->pUserData)->CDC1->Control(hdls->hcdc1.CmdOpCode,
-                                                            (uint8_t *)(hdls->hcdc1.data),
-                                                            hdls->hcdc1.CmdLength);
-          hdls->hcdc1.CmdOpCode = 0xFF;
+        ((DCDC_ItfTypeDef *)pdev->pUserData)->CDC[port->idx]->Control(port->hcdc.CmdOpCode,
+                                                                       (uint8_t *)(port->hcdc.data),
+                                                                       port->hcdc.CmdLength);
+        port->hcdc.CmdOpCode = 0xFF;
+        hdls->cmd_port = NULL;
     }
 
     return USBD_OK;
@@ -686,7 +891,7 @@ static uint8_t  *DCDC_GetDeviceQualifierDescriptor (uint16_t *length)
 static uint8_t  DCDC_SetTxBuffer  (USBD_HandleTypeDef   *pdev,
                                    uint8_t epnum,
                                    uint8_t  *pbuff,
-                                   uint16_t length)
+                                   uint32_t length)
 {
     if(pdev->pClassData == NULL)
     {
@@ -694,23 +899,15 @@ static uint8_t  DCDC_SetTxBuffer  (USBD_HandleTypeDef   *pdev,
     }
 
     DCDC_HandleTypeDef *hdls = (DCDC_HandleTypeDef*) pdev->pClassData;
-    USBD_CDC_HandleTypeDef *hcdc;
+    DCDC_PortTypeDef *port = hdls->in_ep_port[epnum & 0x0F];
 
-    if (epnum == DCDC_P1_BULKIN_EP)
-    {
-        hcdc = &hdls->hcdc1;
-    }
-    else if (epnum == DCDC_P2_BULKIN_EP)
-    {
-        hcdc = &hdls->hcdc2;
-    }
-    else
+    if (port == NULL)
     {
         return USBD_FAIL;
     }
 
-    hcdc->TxBuffer = pbuff;
-    hcdc->TxLength = length;
+    port->hcdc.TxBuffer = pbuff;
+    port->hcdc.TxLength = length;
     return USBD_OK;
 }
 
@@ -727,22 +924,14 @@ static uint8_t  DCDC_SetRxBuffer  (USBD_HandleTypeDef   *pdev,
     }
 
     DCDC_HandleTypeDef *hdls = (DCDC_HandleTypeDef*) pdev->pClassData;
-    USBD_CDC_HandleTypeDef *hcdc;
+    DCDC_PortTypeDef *port = hdls->out_ep_port[epnum & 0x0F];
 
-    if (epnum == DCDC_P1_BULKOUT_EP)
-    {
-        hcdc = &hdls->hcdc1;
-    }
-    else if (epnum == DCDC_P2_BULKOUT_EP)
-    {
-        hcdc = &hdls->hcdc2;
-    }
-    else
+    if (port == NULL)
     {
         return USBD_FAIL;
     }
 
-    hcdc->RxBuffer = pbuff;
+    port->hcdc.RxBuffer = pbuff;
     return USBD_OK;
 }
 
@@ -758,25 +947,21 @@ static uint8_t DCDC_TransmitPacket(USBD_HandleTypeDef *pdev,
     }
 
     DCDC_HandleTypeDef *hdls = (DCDC_HandleTypeDef*) pdev->pClassData;
-    USBD_CDC_HandleTypeDef *hcdc;
+    DCDC_PortTypeDef *port = hdls->in_ep_port[ep_addr & 0x0F];
 
-    if (ep_addr == DCDC_P1_BULKIN_EP)
-    {
-        hcdc = &hdls->hcdc1;
-    }
-    else if (ep_addr == DCDC_P2_BULKIN_EP)
-    {
-        hcdc = &hdls->hcdc2;
-    }
-    else
+    if (port == NULL)
     {
         return USBD_FAIL;
     }
 
+    USBD_CDC_HandleTypeDef *hcdc = &port->hcdc;
+
     if(hcdc->TxState == 0)
     {
         /* Tx Transfer in progress */
         hcdc->TxState = 1;
+        port->tx_stamp = DWT->CYCCNT;
+        USBTRACE(USBTRACE_TXSTART, ep_addr, hcdc->TxLength);
 
         /* Transmit next packet */
         USBD_LL_Transmit(pdev,
@@ -792,9 +977,533 @@ static uint8_t DCDC_TransmitPacket(USBD_HandleTypeDef *pdev,
     }
 }
 
+/* DCDC_TxKick
+ * Starts a transfer from the Tx ring or the descriptor queue if the pipe
+ * is idle. Alternates between the two when both have data, but finishes a
+ * descriptor longer than one transfer before switching.
+ */
+static uint8_t DCDC_TxKick(USBD_HandleTypeDef *pdev,
+                           DCDC_PortTypeDef *port)
+{
+    USBD_CDC_HandleTypeDef *hcdc = &port->hcdc;
+    DCDC_TxQueueTypeDef *txq = &port->txq;
+    uint8_t *tx_buf;
+    uint32_t tx_len;
+
+    if(hcdc->TxState != 0)
+    {
+        return USBD_BUSY;
+    }
+
+    uint32_t span_len = RingBuf_PeekSpan(&txq->ring, &tx_buf);
+    uint8_t has_desc = (txq->desc_head != txq->desc_tail);
+
+    if(has_desc && ((span_len == 0) || (txq->src != DCDC_TXSRC_DESC) ||
+                    (txq->desc_offset != 0)))
+    {
+        DCDC_BufDescTypeDef *desc = &txq->desc[txq->desc_tail & (DCDC_TXDESC_NUM - 1)];
+        tx_buf = desc->buf + txq->desc_offset;
+        tx_len = desc->len - txq->desc_offset;
+        txq->src = DCDC_TXSRC_DESC;
+    }
+    else if(span_len != 0)
+    {
+        /* Let small writes gather into fuller packets, DCDC_HandleSOF
+        comes back when the hold time is up. Never on the priority port. */
+        const DCDC_TxCfgTypeDef *coal = &DCDC_TxCfg[port->idx];
+        if((coal->max_frames != 0) && !has_desc &&
+           ((port->idx + DCDC_PORT1) != DCDC_PRIO_PORT) &&
+           (RingBuf_Used(&txq->ring) < coal->min_len))
+        {
+            if(!txq->held)
+            {
+                txq->held = 1;
+                txq->hold_sof = DCDC_SofCount;
+                DCDC_SofNeed(pdev, 1U << port->idx, 1);
+            }
+            if((DCDC_SofCount - txq->hold_sof) < coal->max_frames)
+            {
+                return USBD_OK;
+            }
+        }
+
+        tx_len = span_len;
+        txq->src = DCDC_TXSRC_RING;
+    }
+    else
+    {
+        return USBD_OK;
+    }
+
+    /* Whole packets only, so a split never leaves a short one mid stream */
+    if(tx_len > DCDC_TX_MAX_XFER)
+    {
+        tx_len = DCDC_TX_MAX_XFER;
+    }
+
+    /* Each SOF period a weighted port gets its weight in bytes, taken when
+    a transfer starts. Past it the port waits for the next SOF. */
+    uint32_t weight = DCDC_TxCfg[port->idx].weight;
+    if(weight != 0)
+    {
+        if(txq->round != DCDC_SofCount)
+        {
+            txq->round = DCDC_SofCount;
+            txq->credit = weight;
+        }
+        if(tx_len > txq->credit)
+        {
+            tx_len = txq->credit - (txq->credit % DCDC_DATA_PACKET_SIZE);
+        }
+        if(tx_len == 0)
+        {
+            if(!txq->held)
+            {
+                txq->held = 1;
+                txq->hold_sof = DCDC_SofCount;
+                DCDC_SofNeed(pdev, 1U << port->idx, 1);
+            }
+            return USBD_OK;
+        }
+    }
+
+    if(txq->held)
+    {
+        txq->held = 0;
+        DCDC_SofNeed(pdev, 1U << port->idx, 0);
+    }
+
+    /* The core DMA only reads whole words, stage anything else. Ring spans
+    start unaligned after odd writes, submissions are whatever the caller had */
+    if((txq->bounce != NULL) && (((uint32_t)tx_buf & 0x3) != 0))
+    {
+        if(tx_len > DCDC_TXBOUNCE_SIZE)
+        {
+            tx_len = DCDC_TXBOUNCE_SIZE;
+        }
+        memcpy(txq->bounce, tx_buf, tx_len);
+        tx_buf = txq->bounce;
+    }
+
+    uint8_t ret = DCDC_SetTxBuffer(pdev, port->in_ep, tx_buf, tx_len);
+    if(ret == USBD_OK)
+    {
+        ret = DCDC_TransmitPacket(pdev, port->in_ep);
+    }
+    if((ret == USBD_OK) && (weight != 0))
+    {
+        txq->credit -= tx_len;
+    }
+
+    return ret;
+}
+
+/* DCDC_TxLatBin
+ * Counts one Tx completion in the port's latency histogram
+ */
+static void DCDC_TxLatBin(DCDC_PortTypeDef *port,
+                          uint32_t stamp,
+                          uint32_t now)
+{
+    uint32_t us = (now - stamp) / (SystemCoreClock / 1000000);
+    uint32_t bucket = 32 - __CLZ(us);
+
+    if(bucket >= DCDC_TXLAT_BUCKETS)
+    {
+        bucket = DCDC_TXLAT_BUCKETS - 1;
+    }
+    DCDC_Stats[port->idx].tx_lat[bucket]++;
+}
+
+/* DCDC_TxLatDone
+ * Bins the latency of every timed write the ring tail has now passed
+ */
+static void DCDC_TxLatDone(DCDC_PortTypeDef *port)
+{
+    DCDC_TxLatTypeDef *lat = &port->lat;
+    uint32_t rd = port->txq.ring.tail;
+    uint32_t now = DWT->CYCCNT;
+    uint32_t tail;
+
+    while((tail = lat->tail) != lat->head)
+    {
+        uint32_t mark = tail & (DCDC_TXLAT_MARKS - 1);
+        if((int32_t)(rd - lat->end[mark]) < 0)
+        {
+            break;
+        }
+
+        DCDC_TxLatBin(port, lat->stamp[mark], now);
+        lat->tail = tail + 1;
+    }
+}
+
+/* DCDC_RxDone
+ * Takes the rx_len bytes of a finished or flushed OUT transfer. A full
+ * first packet runs on into the rest of the buffer, anything else ends the
+ * buffer: it is queued for the application and the endpoint re-armed.
+ */
+static void DCDC_RxDone(USBD_HandleTypeDef *pdev,
+                        DCDC_PortTypeDef *port,
+                        uint32_t rx_len,
+                        uint8_t flushed)
+{
+    USBD_CDC_HandleTypeDef *hcdc = &port->hcdc;
+    DCDC_RxPoolTypeDef *rxp = &port->rxp;
+    USBD_CDC_ItfTypeDef *itf = ((DCDC_ItfTypeDef *)pdev->pUserData)->CDC[port->idx];
+
+    USBTRACE(USBTRACE_RXDONE, port->out_ep, rx_len);
+
+    DCDC_Stats[port->idx].rx_bytes += rx_len;
+    if(rx_len != 0)
+    {
+        DCDC_Stats[port->idx].rx_packets += (rx_len + DCDC_DATA_PACKET_SIZE - 1) / DCDC_DATA_PACKET_SIZE;
+    }
+    else if(!flushed)
+    {
+        DCDC_Stats[port->idx].rx_packets++;
+    }
+    if(flushed)
+    {
+        DCDC_Stats[port->idx].rx_flush++;
+    }
+
+    if(!flushed && (rxp->lead == 0) && (rx_len == DCDC_DATA_PACKET_SIZE) &&
+       (rx_len < rxp->xfer_size))
+    {
+        /* Only a one packet transfer ends on a full packet, the write may
+        go on past it */
+        DCDC_RxArm(pdev, port, rx_len);
+        return;
+    }
+
+    hcdc->RxLength = rxp->lead + rx_len;
+    hcdc->RxState = 0;
+    rxp->streaming = (hcdc->RxLength == rxp->xfer_size);
+    DCDC_SofNeed(pdev, DCDC_SOF_RX(port->idx), 0);
+
+    if(hcdc->RxLength == 0)
+    {
+        /* Nothing to hand over, put the same buffer straight back */
+        hcdc->RxState = 1;
+        DCDC_RxArm(pdev, port, 0);
+        return;
+    }
+
+    /* Queue the filled buffer for the application */
+    uint32_t head = rxp->ready_head;
+    rxp->ready[head & (DCDC_RXPOOL_NUM - 1)].buf = hcdc->RxBuffer;
+    rxp->ready[head & (DCDC_RXPOOL_NUM - 1)].len = hcdc->RxLength;
+    __DMB();
+    rxp->ready_head = head + 1;
+
+    /* Let the application know a buffer is waiting, by reference */
+    CYCPROF_START(receive);
+    itf->Receive(hcdc->RxBuffer, &hcdc->RxLength);
+    CYCPROF_STOP(receive, CYCPROF_RECEIVE);
+    DCDC_Notify(DCDC_EVF_RX(port->idx));
+
+    /* Re-arm with a fresh buffer, or NAK until one is released */
+    DCDC_RxKick(pdev, port);
+}
+
+/* DCDC_RxArm
+ * Arms RxBuffer past its first lead bytes. A fresh buffer takes one packet
+ * unless the last one filled up. Any longer transfer may end on a packet
+ * boundary with no ZLP to follow, DCDC_RxFlush ends it after
+ * DCDC_RX_FLUSH_FRAMES SOFs.
+ */
+static void DCDC_RxArm(USBD_HandleTypeDef *pdev,
+                       DCDC_PortTypeDef *port,
+                       uint32_t lead)
+{
+    USBD_CDC_HandleTypeDef *hcdc = &port->hcdc;
+    DCDC_RxPoolTypeDef *rxp = &port->rxp;
+    uint32_t len = rxp->xfer_size - lead;
+
+    if((lead == 0) && !rxp->streaming)
+    {
+        len = DCDC_DATA_PACKET_SIZE;
+    }
+
+    rxp->lead = lead;
+    USBD_LL_PrepareReceive(pdev, port->out_ep, hcdc->RxBuffer + lead, len);
+    USBTRACE(USBTRACE_RXARM, port->out_ep, len);
+
+    if((lead != 0) || (len > DCDC_DATA_PACKET_SIZE))
+    {
+        rxp->flush_sof = DCDC_SofCount;
+        DCDC_SofNeed(pdev, DCDC_SOF_RX(port->idx), 1);
+    }
+    else
+    {
+        DCDC_SofNeed(pdev, DCDC_SOF_RX(port->idx), 0);
+    }
+}
+
+/* DCDC_RxFlush
+ * Ends a run on OUT transfer that waited DCDC_RX_FLUSH_FRAMES SOFs and
+ * hands over what it got
+ */
+static void DCDC_RxFlush(USBD_HandleTypeDef *pdev,
+                         DCDC_PortTypeDef *port)
+{
+    if(((DCDC_SofUsers & DCDC_SOF_RX(port->idx)) == 0) ||
+       ((DCDC_SofCount - port->rxp.flush_sof) < DCDC_RX_FLUSH_FRAMES))
+    {
+        return;
+    }
+
+    /* A transfer that completed first has its DataOut on the way */
+    if(USBD_LL_EndReceive(pdev, port->out_ep) != USBD_OK)
+    {
+        return;
+    }
+
+    DCDC_RxDone(pdev, port, USBD_LL_GetRxDataSize(pdev, port->out_ep), 1);
+}
+
+/* DCDC_RxKick
+ * Arms an idle OUT endpoint with the next free pool buffer, if any
+ */
+static void DCDC_RxKick(USBD_HandleTypeDef *pdev,
+                        DCDC_PortTypeDef *port)
+{
+    USBD_CDC_HandleTypeDef *hcdc = &port->hcdc;
+    DCDC_RxPoolTypeDef *rxp = &port->rxp;
+    uint32_t tail = rxp->free_tail;
+
+    if(hcdc->RxState != 0)
+    {
+        return;
+    }
+
+    if(rxp->free_head != tail)
+    {
+        DCDC_SetRxBuffer(pdev, port->out_ep, rxp->free[tail & (DCDC_RXPOOL_NUM - 1)]);
+        rxp->free_tail = tail + 1;
+        hcdc->RxState = 1;
+        DCDC_RxArm(pdev, port, 0);
+
+        if(port->naking)
+        {
+            port->naking = 0;
+            DCDC_Stats[port->idx].rx_nak_us += (DWT->CYCCNT - port->nak_stamp) /
+                                               (SystemCoreClock / 1000000);
+        }
+    }
+    else if(!port->naking)
+    {
+        /* All buffers are with the application, the host gets NAKs */
+        port->naking = 1;
+        port->nak_stamp = DWT->CYCCNT;
+        DCDC_Stats[port->idx].rx_overrun++;
+        USBTRACE(USBTRACE_RXNAK, port->out_ep, 0);
+    }
+}
+
+/* DCDC_RxPoolInit
+ * Puts all buffers of a port on the free list
+ */
+static void DCDC_RxPoolInit(DCDC_RxPoolTypeDef *rxp,
+                            uint8_t *bufs,
+                            uint32_t xfer_size)
+{
+    uint32_t i;
+
+    for(i = 0; i < DCDC_RXPOOL_NUM; i++)
+    {
+        rxp->free[i] = &bufs[i * xfer_size];
+        rxp->loaned[i] = 0;
+    }
+    rxp->bufs = bufs;
+    rxp->xfer_size = xfer_size;
+    rxp->lead = 0;
+    rxp->streaming = 0;
+    rxp->flush_sof = 0;
+    rxp->free_head = DCDC_RXPOOL_NUM;
+    rxp->free_tail = 0;
+    rxp->ready_head = 0;
+    rxp->ready_tail = 0;
+    rxp->rd_offset = 0;
+}
+
+/* DCDC_RxSlot
+ * Returns the pool index of rx_buf, DCDC_RXPOOL_NUM if it is not one of
+ * the pool's buffers
+ */
+static uint32_t DCDC_RxSlot(DCDC_RxPoolTypeDef *rxp,
+                            uint8_t *rx_buf)
+{
+    uint32_t off = (uint32_t)(rx_buf - rxp->bufs);
+
+    if((rx_buf < rxp->bufs) || (off >= (DCDC_RXPOOL_NUM * rxp->xfer_size)) ||
+       ((off % rxp->xfer_size) != 0))
+    {
+        return DCDC_RXPOOL_NUM;
+    }
+    return off / rxp->xfer_size;
+}
+
+/* DCDC_RxRelease
+ * Returns a pool buffer to the free list and resumes a NAKing endpoint.
+ * Must run with the USB interrupt held off or from the USB interrupt.
+ */
+static void DCDC_RxRelease(USBD_HandleTypeDef *pdev,
+                           DCDC_PortTypeDef *port,
+                           uint32_t slot)
+{
+    DCDC_RxPoolTypeDef *rxp = &port->rxp;
+    uint32_t head = rxp->free_head;
+
+    rxp->free[head & (DCDC_RXPOOL_NUM - 1)] = &rxp->bufs[slot * rxp->xfer_size];
+    rxp->free_head = head + 1;
+    DCDC_RxKick(pdev, port);
+}
+
+#if (DCDC_DEFER != DCDC_DEFER_NONE)
+/* DCDC_PostEvent
+ * Queues an endpoint event for the bottom half, called from the OTG interrupt
+ */
+static uint8_t DCDC_PostEvent(uint32_t ev)
+{
+    uint32_t head = DCDC_EvQueue.head;
+
+    if((head - DCDC_EvQueue.tail) >= DCDC_EVENT_NUM)
+    {
+        return USBD_FAIL;
+    }
+
+    DCDC_EvQueue.ev[head & (DCDC_EVENT_NUM - 1)] = ev;
+    __DMB();
+    DCDC_EvQueue.head = head + 1;
+
+#if (DCDC_DEFER == DCDC_DEFER_PENDSV)
+    SCB->ICSR = SCB_ICSR_PENDSVSET_Msk;
+#else
+    DCDC_Notify(DCDC_EVF_BH);
+#endif
+
+    return USBD_OK;
+}
+#endif
+
+/* DCDC_VendorRequest
+ * Serves the DCDC_VREQ_x diagnostics requests, stalls anything else
+ */
+static uint8_t DCDC_VendorRequest(USBD_HandleTypeDef *pdev,
+                                  USBD_SetupReqTypedef *req)
+{
+    uint32_t len;
+
+    switch(req->bRequest)
+    {
+        case DCDC_VREQ_GET_STATS:
+        if((req->bmRequest & 0x80) && (req->wLength != 0))
+        {
+            len = DCDC_StatsSnapshot((req->wValue & DCDC_VREQ_RESET) != 0);
+            USBD_CtlSendData(pdev, (uint8_t *)DCDC_StatsSnap, MIN(len, req->wLength));
+            return USBD_OK;
+        }
+        break;
+
+#if (CYCPROF_ENABLE != 0)
+        case DCDC_VREQ_GET_PROFILE:
+        if((req->bmRequest & 0x80) && (req->wLength != 0))
+        {
+            len = CycProf_Snapshot(&DCDC_ProfSnap, (req->wValue & DCDC_VREQ_RESET) != 0);
+            USBD_CtlSendData(pdev, (uint8_t *)&DCDC_ProfSnap, MIN(len, req->wLength));
+            return USBD_OK;
+        }
+        break;
+
+        /* Lets the host profile the idle CPU with the SOF interrupt gated
+        and with it taken every frame */
+        case DCDC_VREQ_SET_SOF:
+        if(!(req->bmRequest & 0x80) && (req->wLength == 0))
+        {
+            DCDC_SofNeed(pdev, DCDC_SOF_HOST, (req->wValue & 0x1) != 0);
+            if((req->bmRequest & USB_REQ_RECIPIENT_MASK) == USB_REQ_RECIPIENT_DEVICE)
+            {
+                USBD_CtlSendStatus(pdev);
+            }
+            return USBD_OK;
+        }
+        break;
+#endif
+
+#if (USBTRACE_ENABLE != 0)
+        case DCDC_VREQ_GET_TRACE:
+        if((req->bmRequest & 0x80) && (req->wLength != 0))
+        {
+            len = UsbTrace_Snapshot(&DCDC_TraceSnap);
+            USBD_CtlSendData(pdev, (uint8_t *)&DCDC_TraceSnap, MIN(len, req->wLength));
+            return USBD_OK;
+        }
+        break;
+#endif
+
+#if (SELFTEST_ENABLE != 0)
+        case DCDC_VREQ_GET_SELFTEST:
+        if((req->bmRequest & 0x80) && (req->wLength != 0))
+        {
+            len = SelfTest_Snapshot(DCDC_SelfTestSnap, (req->wValue & DCDC_VREQ_RESET) != 0);
+            USBD_CtlSendData(pdev, (uint8_t *)DCDC_SelfTestSnap, MIN(len, req->wLength));
+            return USBD_OK;
+        }
+        break;
+
+        case DCDC_VREQ_SET_SELFTEST:
+        if(!(req->bmRequest & 0x80) && (req->wLength == 0) &&
+           (SelfTest_SetMode(HIBYTE(req->wValue), LOBYTE(req->wValue)) == USBD_OK))
+        {
+            /* USBD_StdItfReq sends the status of an interface request */
+            if((req->bmRequest & USB_REQ_RECIPIENT_MASK) == USB_REQ_RECIPIENT_DEVICE)
+            {
+                USBD_CtlSendStatus(pdev);
+            }
+            return USBD_OK;
+        }
+        break;
+#endif
+
+        default:
+        break;
+    }
+
+    USBD_CtlError(pdev, req);
+    return USBD_FAIL;
+}
+
+/* DCDC_StatsSnapshot
+ * Fills DCDC_StatsSnap with the counts since the last reset, and with
+ * reset set starts the next interval there. Each counter is read once, so
+ * nothing counted in between is lost. Returns the bytes filled.
+ */
+static uint32_t DCDC_StatsSnapshot(uint8_t reset)
+{
+    const uint32_t *now = (const uint32_t *)DCDC_Stats;
+    uint32_t *base = (uint32_t *)DCDC_StatsBase;
+    uint32_t *snap = (uint32_t *)DCDC_StatsSnap;
+    uint32_t i;
+
+    for(i = 0; i < ((DCDC_NUM_PORTS * sizeof(DCDC_PortStatsTypeDef)) / sizeof(uint32_t)); i++)
+    {
+        uint32_t v = *(const __IO uint32_t *)&now[i];
+
+        snap[i] = v - base[i];
+        if(reset)
+        {
+            base[i] = v;
+        }
+    }
+
+    return sizeof(DCDC_StatsSnap);
+}
+
 /************************** Public ********************************************/
 /* DCDC_RegisterInterface
- * Registers fops for a CDC port
+ * Registers fops for the CDC ports
  */
 uint8_t  DCDC_RegisterInterface  (USBD_HandleTypeDef   *pdev,
                                   DCDC_ItfTypeDef *fops)
@@ -811,49 +1520,452 @@ uint8_t  DCDC_RegisterInterface  (USBD_HandleTypeDef   *pdev,
 }
 
 /* DCDC_TransmitData
- * Transmits data over a VCP Port
+ * Queues data for a VCP Port. Returns USBD_BUSY only if the port's Tx ring
+ * cannot take all of tx_len, in which case nothing is queued. Payloads
+ * larger than the ring go through DCDC_SubmitData instead. The copy runs
+ * under DCDC_LOCK, so large writes hold the USB interrupt off for as long.
  */
 uint8_t DCDC_TransmitData(uint8_t com_port,
                           uint8_t *tx_buf,
-                          uint16_t tx_len)
+                          uint32_t tx_len)
 {
-    uint8_t epnum = 0;
-    uint8_t* buf = 0;
+    if((tx_buf == NULL) || (USBDevice.pClassData == NULL) ||
+       (com_port < DCDC_PORT1) || (com_port > DCDC_NUM_PORTS))
+    {
+        return USBD_FAIL;
+    }
+
+    DCDC_HandleTypeDef *hdls = (DCDC_HandleTypeDef*) USBDevice.pClassData;
+    DCDC_PortTypeDef *port = &hdls->port[com_port - DCDC_PORT1];
+    DCDC_TxQueueTypeDef *txq = &port->txq;
 
-    if(tx_buf == NULL)
+    /* A TxComplete callback may write too, one producer at a time */
+    DCDC_LOCK();
+    if(tx_len > txq->ring.size)
     {
+        DCDC_Stats[port->idx].tx_drop++;
+        DCDC_UNLOCK();
         return USBD_FAIL;
     }
 
-    /* Get endpoint from port number */
-    if(com_port == DCDC_PORT1)
+    /* Queue the data */
+    if(RingBuf_Write(&txq->ring, tx_buf, tx_len) != tx_len)
     {
-        epnum = DCDC_P1_BULKIN_EP;
-        buf = DCDC_TxBuf_P1;
-        if(tx_len > sizeof(DCDC_TxBuf_P1)) return USBD_FAIL;
+        DCDC_Stats[port->idx].tx_busy++;
+        DCDC_UNLOCK();
+        return USBD_BUSY;
     }
-    else if(com_port == DCDC_PORT2)
+
+    /* Time it to completion if a mark is free, else count it unsampled */
+    DCDC_TxLatTypeDef *lat = &port->lat;
+    uint32_t head = lat->head;
+    if((tx_len != 0) && ((head - lat->tail) < DCDC_TXLAT_MARKS))
     {
-        epnum = DCDC_P2_BULKIN_EP;
-        buf = DCDC_TxBuf_P2;
-        if(tx_len > sizeof(DCDC_TxBuf_P2)) return USBD_FAIL;
+        lat->end[head & (DCDC_TXLAT_MARKS - 1)] = txq->ring.head;
+        lat->stamp[head & (DCDC_TXLAT_MARKS - 1)] = DWT->CYCCNT;
+        __DMB();
+        lat->head = head + 1;
     }
-    else
+    else if(tx_len != 0)
+    {
+        DCDC_Stats[port->idx].tx_lat_unsampled++;
+    }
+
+    /* Start the pipe if DCDC_DataIn is not already draining it */
+    uint8_t ret = DCDC_TxKick(&USBDevice, port);
+    DCDC_UNLOCK();
+
+    return (ret == USBD_BUSY) ? USBD_OK : ret;
+}
+
+/* DCDC_SubmitData
+ * Queues a caller owned buffer of any length for a VCP Port without copying
+ * it. The buffer must stay untouched until the TxComplete callback returns
+ * it. Returns USBD_BUSY if DCDC_TXDESC_NUM buffers are already pending.
+ */
+uint8_t DCDC_SubmitData(uint8_t com_port,
+                        uint8_t *tx_buf,
+                        uint32_t tx_len)
+{
+    if((tx_buf == NULL) || (USBDevice.pClassData == NULL) ||
+       (com_port < DCDC_PORT1) || (com_port > DCDC_NUM_PORTS))
     {
         return USBD_FAIL;
     }
 
-    /* Set the Tx Buffer */
-    memcpy(buf, tx_buf, tx_len);
-    uint8_t ret = DCDC_SetTxBuffer(&USBDevice, epnum, buf, tx_len);
-    /* Activate Tx */
-    if(ret == USBD_OK)
+    DCDC_HandleTypeDef *hdls = (DCDC_HandleTypeDef*) USBDevice.pClassData;
+    DCDC_PortTypeDef *port = &hdls->port[com_port - DCDC_PORT1];
+    DCDC_TxQueueTypeDef *txq = &port->txq;
+
+    /* A TxComplete callback may submit too, one producer at a time */
+    DCDC_LOCK();
+    uint32_t head = txq->desc_head;
+    if((head - txq->desc_tail) >= DCDC_TXDESC_NUM)
+    {
+        DCDC_Stats[port->idx].tx_busy++;
+        DCDC_UNLOCK();
+        return USBD_BUSY;
+    }
+
+    /* Fill the slot before publishing it */
+    txq->desc[head & (DCDC_TXDESC_NUM - 1)].buf = tx_buf;
+    txq->desc[head & (DCDC_TXDESC_NUM - 1)].len = tx_len;
+    txq->desc_stamp[head & (DCDC_TXDESC_NUM - 1)] = DWT->CYCCNT;
+    __DMB();
+    txq->desc_head = head + 1;
+
+    /* Start the pipe if DCDC_DataIn is not already draining it */
+    uint8_t ret = DCDC_TxKick(&USBDevice, port);
+    DCDC_UNLOCK();
+
+    return (ret == USBD_BUSY) ? USBD_OK : ret;
+}
+
+/* DCDC_GetRxBuffer
+ * Takes the oldest filled Rx buffer of a VCP Port on loan. Returns its data
+ * length, or 0 if none is waiting. Hand it back with DCDC_ReleaseRxBuffer.
+ */
+uint32_t DCDC_GetRxBuffer(uint8_t com_port,
+                          uint8_t **rx_buf)
+{
+    if((rx_buf == NULL) || (USBDevice.pClassData == NULL) ||
+       (com_port < DCDC_PORT1) || (com_port > DCDC_NUM_PORTS))
+    {
+        return 0;
+    }
+
+    DCDC_HandleTypeDef *hdls = (DCDC_HandleTypeDef*) USBDevice.pClassData;
+    DCDC_RxPoolTypeDef *rxp = &hdls->port[com_port - DCDC_PORT1].rxp;
+
+    uint32_t tail = rxp->ready_tail;
+    if(rxp->ready_head == tail)
     {
-        ret = DCDC_TransmitPacket(&USBDevice, epnum);
+        return 0;
     }
 
+    DCDC_BufDescTypeDef *desc = &rxp->ready[tail & (DCDC_RXPOOL_NUM - 1)];
+    uint32_t len = desc->len;
+    *rx_buf = desc->buf;
+    rxp->loaned[DCDC_RxSlot(rxp, desc->buf)] = 1;
+    rxp->ready_tail = tail + 1;
+
+    return len;
+}
+
+/* DCDC_ReleaseRxBuffer
+ * Returns a buffer taken with DCDC_GetRxBuffer to its VCP Port. May be
+ * called from the main loop or from a DCDC callback. Fails for a buffer
+ * that is not on loan: released already, or taken before the port was
+ * configured again.
+ */
+uint8_t DCDC_ReleaseRxBuffer(uint8_t com_port,
+                             uint8_t *rx_buf)
+{
+    if((rx_buf == NULL) || (USBDevice.pClassData == NULL) ||
+       (com_port < DCDC_PORT1) || (com_port > DCDC_NUM_PORTS))
+    {
+        return USBD_FAIL;
+    }
+
+    DCDC_HandleTypeDef *hdls = (DCDC_HandleTypeDef*) USBDevice.pClassData;
+    DCDC_PortTypeDef *port = &hdls->port[com_port - DCDC_PORT1];
+    uint32_t slot = DCDC_RxSlot(&port->rxp, rx_buf);
+    uint8_t ret = USBD_FAIL;
+
+    DCDC_LOCK();
+    if((slot < DCDC_RXPOOL_NUM) && port->rxp.loaned[slot])
+    {
+        port->rxp.loaned[slot] = 0;
+        DCDC_RxRelease(&USBDevice, port, slot);
+        ret = USBD_OK;
+    }
+    DCDC_UNLOCK();
+
     return ret;
 }
 
+/* DCDC_ReceiveData
+ * Copies up to rx_len bytes received on a VCP Port. Returns the bytes read.
+ * Convenience on top of the Rx pool, do not mix with DCDC_GetRxBuffer on
+ * the same port.
+ */
+uint32_t DCDC_ReceiveData(uint8_t com_port,
+                          uint8_t *rx_buf,
+                          uint32_t rx_len)
+{
+    uint32_t len = 0;
+
+    if((rx_buf == NULL) || (USBDevice.pClassData == NULL) ||
+       (com_port < DCDC_PORT1) || (com_port > DCDC_NUM_PORTS))
+    {
+        return 0;
+    }
+
+    DCDC_HandleTypeDef *hdls = (DCDC_HandleTypeDef*) USBDevice.pClassData;
+    DCDC_PortTypeDef *port = &hdls->port[com_port - DCDC_PORT1];
+    DCDC_RxPoolTypeDef *rxp = &port->rxp;
+
+    while((len < rx_len) && (rxp->ready_head != rxp->ready_tail))
+    {
+        uint32_t tail = rxp->ready_tail;
+        DCDC_BufDescTypeDef *desc = &rxp->ready[tail & (DCDC_RXPOOL_NUM - 1)];
+        uint32_t chunk = desc->len - rxp->rd_offset;
+
+        if(chunk > (rx_len - len))
+        {
+            chunk = rx_len - len;
+        }
+        memcpy(rx_buf + len, desc->buf + rxp->rd_offset, chunk);
+        len += chunk;
+        rxp->rd_offset += chunk;
+
+        /* Buffer drained, give it back to the endpoint */
+        if(rxp->rd_offset == desc->len)
+        {
+            uint32_t slot = DCDC_RxSlot(rxp, desc->buf);
+
+            rxp->rd_offset = 0;
+            rxp->ready_tail = tail + 1;
+            DCDC_LOCK();
+            DCDC_RxRelease(&USBDevice, port, slot);
+            DCDC_UNLOCK();
+        }
+    }
+
+    return len;
+}
+
+/* DCDC_SetTxCoalescing
+ * Sets how long ring data below min_len may wait for more before it is
+ * sent, in SOF periods: 1 ms on FS, 125 us on HS. 0 frames sends at once.
+ */
+uint8_t DCDC_SetTxCoalescing(uint8_t com_port,
+                             uint32_t min_len,
+                             uint16_t max_frames)
+{
+    if((com_port < DCDC_PORT1) || (com_port > DCDC_NUM_PORTS))
+    {
+        return USBD_FAIL;
+    }
+
+    DCDC_LOCK();
+    DCDC_TxCfg[com_port - DCDC_PORT1].min_len = min_len;
+    DCDC_TxCfg[com_port - DCDC_PORT1].max_frames = max_frames;
+
+    /* Release whatever the old setting was holding back */
+    if(USBDevice.pClassData != NULL)
+    {
+        DCDC_HandleTypeDef *hdls = (DCDC_HandleTypeDef*) USBDevice.pClassData;
+        DCDC_TxKick(&USBDevice, &hdls->port[com_port - DCDC_PORT1]);
+    }
+    DCDC_UNLOCK();
+
+    return USBD_OK;
+}
+
+/* DCDC_SetTxWeight
+ * Sets how many bytes the port may start sending per SOF period, 0 for no
+ * limit or at least one packet. Saturated ports then share the bus in
+ * proportion to their weights, a port at its weight is held to weight *
+ * 1000 bytes/s on FS and weight * 8000 on HS.
+ */
+uint8_t DCDC_SetTxWeight(uint8_t com_port,
+                         uint32_t bytes)
+{
+    if((com_port < DCDC_PORT1) || (com_port > DCDC_NUM_PORTS) ||
+       ((bytes != 0) && (bytes < DCDC_DATA_PACKET_SIZE)))
+    {
+        return USBD_FAIL;
+    }
+
+    DCDC_LOCK();
+    DCDC_TxCfg[com_port - DCDC_PORT1].weight = bytes;
+
+    /* The new weight applies from this round */
+    if(USBDevice.pClassData != NULL)
+    {
+        DCDC_HandleTypeDef *hdls = (DCDC_HandleTypeDef*) USBDevice.pClassData;
+        DCDC_PortTypeDef *port = &hdls->port[com_port - DCDC_PORT1];
+        port->txq.round = DCDC_SofCount;
+        port->txq.credit = bytes;
+        DCDC_TxKick(&USBDevice, port);
+    }
+    DCDC_UNLOCK();
+
+    return USBD_OK;
+}
+
+/* DCDC_GetSofCount
+ * Returns the SOF interrupts taken since start up
+ */
+uint32_t DCDC_GetSofCount(void)
+{
+    return DCDC_SofCount;
+}
+
+/* DCDC_CountSof
+ * Keeps the SOF interrupt unmasked while configured, so DCDC_GetSofCount
+ * counts every frame and not only those with Tx data held
+ */
+void DCDC_CountSof(uint8_t enable)
+{
+    DCDC_LOCK();
+    if(USBDevice.pClassData != NULL)
+    {
+        DCDC_SofNeed(&USBDevice, DCDC_SOF_APP, enable);
+    }
+    else
+    {
+        /* DCDC_Init picks it up */
+        DCDC_SofUsers = enable ? (DCDC_SofUsers | DCDC_SOF_APP) :
+                                 (DCDC_SofUsers & ~DCDC_SOF_APP);
+    }
+    DCDC_UNLOCK();
+}
+
+/* DCDC_GetTxLatency
+ * Reports the write or submission to completion latency of a port at the
+ * median and the 99th percentile, as the bucket bounds in microseconds,
+ * since DCDC_VREQ_GET_STATS last reset the stats. Only the sampled writes
+ * count, see tx_lat_unsampled. Returns USBD_FAIL until a write has
+ * completed.
+ */
+uint8_t DCDC_GetTxLatency(uint8_t com_port,
+                          uint32_t *p50_us,
+                          uint32_t *p99_us)
+{
+    uint32_t hist[DCDC_TXLAT_BUCKETS];
+    uint32_t total = 0;
+    uint32_t sum = 0;
+    uint8_t k;
+
+    if((p50_us == NULL) || (p99_us == NULL) ||
+       (com_port < DCDC_PORT1) || (com_port > DCDC_NUM_PORTS))
+    {
+        return USBD_FAIL;
+    }
+
+    /* One consistent snapshot */
+    DCDC_LOCK();
+    for(k = 0; k < DCDC_TXLAT_BUCKETS; k++)
+    {
+        hist[k] = DCDC_Stats[com_port - DCDC_PORT1].tx_lat[k] -
+                  DCDC_StatsBase[com_port - DCDC_PORT1].tx_lat[k];
+        total += hist[k];
+    }
+    DCDC_UNLOCK();
+
+    if(total == 0)
+    {
+        return USBD_FAIL;
+    }
+
+    *p50_us = *p99_us = 0;
+    for(k = 0; k < DCDC_TXLAT_BUCKETS; k++)
+    {
+        sum += hist[k];
+        if((*p50_us == 0) && ((uint64_t)sum * 100 >= (uint64_t)total * 50))
+        {
+            *p50_us = 1U << k;
+        }
+        if((uint64_t)sum * 100 >= (uint64_t)total * 99)
+        {
+            *p99_us = 1U << k;
+            break;
+        }
+    }
+
+    return USBD_OK;
+}
+
+/* DCDC_GetEvents
+ * Takes and clears the DCDC_EVF_x flags raised since the last call
+ */
+uint32_t DCDC_GetEvents(void)
+{
+    uint32_t events;
+
+    do
+    {
+        events = __LDREXW((uint32_t *)&DCDC_Events);
+    } while(__STREXW(0, (uint32_t *)&DCDC_Events) != 0);
+
+    return events;
+}
+
+/* DCDC_PeekEvents
+ * Returns the pending DCDC_EVF_x flags without clearing them
+ */
+uint32_t DCDC_PeekEvents(void)
+{
+    return DCDC_Events;
+}
+
+/* DCDC_Notify
+ * Raises main loop flags, the application its DCDC_EVF_APP. Exclusive
+ * access, the OTG interrupt may preempt the bottom half in the middle of
+ * an update.
+ */
+void DCDC_Notify(uint32_t flags)
+{
+    uint32_t events;
+
+    do
+    {
+        events = __LDREXW((uint32_t *)&DCDC_Events);
+    } while(__STREXW(events | flags, (uint32_t *)&DCDC_Events) != 0);
+}
+
+/* DCDC_ProcessEvents
+ * Bottom half, runs the class for the events queued by the OTG interrupt.
+ * Called from PendSV_Handler or from the main loop, depending on DCDC_DEFER.
+ */
+void DCDC_ProcessEvents(void)
+{
+#if (DCDC_DEFER != DCDC_DEFER_NONE)
+    uint32_t tail;
+    uint32_t ev;
+    CYCPROF_START(bh);
+
+    while((tail = DCDC_EvQueue.tail) != DCDC_EvQueue.head)
+    {
+        ev = DCDC_EvQueue.ev[tail & (DCDC_EVENT_NUM - 1)];
+
+        /* Same exclusion as a main loop kick, the HAL is not re-entrant */
+        DCDC_LOCK();
+        if((int32_t)(tail - DCDC_EvQueue.base) >= 0)
+        {
+            switch(ev & 0xFF)
+            {
+                case DCDC_EV_DATAIN:
+                DCDC_HandleDataIn(&USBDevice, (ev >> 8) & 0xFF);
+                break;
+
+                case DCDC_EV_DATAOUT:
+                DCDC_HandleDataOut(&USBDevice, (ev >> 8) & 0xFF, ev >> 16);
+                break;
+
+                default:
+                break;
+            }
+        }
+        DCDC_UNLOCK();
+
+        __DMB();
+        DCDC_EvQueue.tail = tail + 1;
+    }
+
+    if(DCDC_EvQueue.sof)
+    {
+        DCDC_EvQueue.sof = 0;
+        DCDC_LOCK();
+        DCDC_HandleSOF(&USBDevice);
+        DCDC_UNLOCK();
+    }
+
+    CYCPROF_STOP(bh, CYCPROF_BH);
+#endif
+}
+
 /************************ (C) COPYRIGHT STMicroelectronics *****END OF FILE****/
 
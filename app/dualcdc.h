@@ -39,6 +39,10 @@ extern "C" {
 #include "usbd_ctlreq.h"
 #include "usbd_cdc_if.h"
 #include "usbd_desc.h"
+#include "ringbuf.h"
+#include "cycprof.h"
+#include "usbtrace.h"
+#include "selftest.h"
 
 /* Macros */
 // DCDC status
@@ -46,21 +50,147 @@ extern "C" {
 #define DCDC_BUSY (1)
 #define DCDC_FAIL (2)
 
+// Number of VCP ports. Every port takes an interrupt IN, a bulk IN and a
+// bulk OUT endpoint besides EP0, so the core sets the limit: OTG FS has
+// three IN endpoints to spare, OTG HS five.
+#ifdef USE_USB_FS
+#define DCDC_DEV_ENDPOINTS (4)
+#else
+#define DCDC_DEV_ENDPOINTS (6)
+#endif
+#define DCDC_MAX_PORTS ((DCDC_DEV_ENDPOINTS - 1) / 2)
+
+#ifndef DCDC_NUM_PORTS
+#define DCDC_NUM_PORTS (DCDC_MAX_PORTS)
+#endif
+
+#if (DCDC_NUM_PORTS < 1) || (DCDC_NUM_PORTS > DCDC_MAX_PORTS) || (DCDC_NUM_PORTS > 4)
+#error "DCDC_NUM_PORTS exceeds the endpoints of the USB core"
+#endif
+#if ((2 * DCDC_NUM_PORTS) > USBD_MAX_NUM_INTERFACES)
+#error "USBD_MAX_NUM_INTERFACES too small for DCDC_NUM_PORTS"
+#endif
+
+// Expands X(n) once per port, n being the port number starting at 1. Per
+// port storage, descriptors and interface tables are generated from it.
+#if (DCDC_NUM_PORTS == 1)
+#define DCDC_FOREACH_PORT(X) X(1)
+#elif (DCDC_NUM_PORTS == 2)
+#define DCDC_FOREACH_PORT(X) X(1) X(2)
+#elif (DCDC_NUM_PORTS == 3)
+#define DCDC_FOREACH_PORT(X) X(1) X(2) X(3)
+#else
+#define DCDC_FOREACH_PORT(X) X(1) X(2) X(3) X(4)
+#endif
+
 // Rx and Tx buffer sizes
+#ifdef USE_USB_HS
+#define DCDC_RXBUF_SIZE  (4096)
+#else
 #define DCDC_RXBUF_SIZE  (512)
-#define DCDC_TXBUF_SIZE  (512)
+#endif
+#define DCDC_TXBUF_SIZE  (2048)
+
+// Per port Tx ring sizes, must be powers of two
+#ifndef DCDC_P1_TXBUF_SIZE
+#define DCDC_P1_TXBUF_SIZE (DCDC_TXBUF_SIZE)
+#endif
+#ifndef DCDC_P2_TXBUF_SIZE
+#define DCDC_P2_TXBUF_SIZE (DCDC_TXBUF_SIZE)
+#endif
+#ifndef DCDC_P3_TXBUF_SIZE
+#define DCDC_P3_TXBUF_SIZE (DCDC_TXBUF_SIZE)
+#endif
+#ifndef DCDC_P4_TXBUF_SIZE
+#define DCDC_P4_TXBUF_SIZE (DCDC_TXBUF_SIZE)
+#endif
+
+#if !RINGBUF_IS_POW2(DCDC_P1_TXBUF_SIZE) || !RINGBUF_IS_POW2(DCDC_P2_TXBUF_SIZE) || \
+    !RINGBUF_IS_POW2(DCDC_P3_TXBUF_SIZE) || !RINGBUF_IS_POW2(DCDC_P4_TXBUF_SIZE)
+#error "DCDC Tx ring sizes must be powers of two"
+#endif
+
+// Depth of the per port zero copy submit queue, must be a power of two
+#define DCDC_TXDESC_NUM (8)
+
+#if !RINGBUF_IS_POW2(DCDC_TXDESC_NUM)
+#error "DCDC_TXDESC_NUM must be a power of two"
+#endif
+
+// Rx buffers per port, must be a power of two. Each takes one whole OUT
+// transfer. The OUT endpoint is only re-armed while one is free, otherwise
+// the host is NAKed until the application releases a buffer.
+#define DCDC_RXPOOL_NUM (4)
+
+#if !RINGBUF_IS_POW2(DCDC_RXPOOL_NUM)
+#error "DCDC_RXPOOL_NUM must be a power of two"
+#endif
+
+// Where the bulk data path runs. With DCDC_DEFER_NONE the class handles
+// its endpoints inside the OTG interrupt. Otherwise the interrupt only
+// queues an event per finished bulk transfer, and the class with the
+// application callbacks runs later from PendSV or from DCDC_ProcessEvents
+// in the main loop. EP0 and bus events are always handled in the interrupt.
+#define DCDC_DEFER_NONE   (0)
+#define DCDC_DEFER_PENDSV (1)
+#define DCDC_DEFER_POLL   (2)
+
+#ifndef DCDC_DEFER
+#define DCDC_DEFER (DCDC_DEFER_NONE)
+#endif
+
+// NVIC preemption priorities of the OTG interrupt and the PendSV bottom half
+#ifndef DCDC_IRQ_PRIORITY
+#define DCDC_IRQ_PRIORITY (1)
+#endif
+#ifndef DCDC_BH_PRIORITY
+#define DCDC_BH_PRIORITY  (15)
+#endif
+
+#if (DCDC_DEFER == DCDC_DEFER_PENDSV) && (DCDC_BH_PRIORITY <= DCDC_IRQ_PRIORITY)
+#error "DCDC_BH_PRIORITY must be below the OTG interrupt priority"
+#endif
+
+// Deferred event queue depth, must be a power of two. Every bulk endpoint
+// has at most one transfer in flight, so two per port cannot overflow.
+#define DCDC_EVENT_NUM (8)
+
+#if !RINGBUF_IS_POW2(DCDC_EVENT_NUM) || (DCDC_EVENT_NUM < (2 * DCDC_NUM_PORTS))
+#error "DCDC_EVENT_NUM must be a power of two of at least two per port"
+#endif
+
+// Vendor requests, to the device or to any interface of the class.
+// Set DCDC_VREQ_RESET in wValue to clear the counters once they are read.
+#define DCDC_VREQ_GET_PROFILE  (0x01)   // IN, CycProfTypeDef
+#define DCDC_VREQ_GET_STATS    (0x02)   // IN, DCDC_PortStatsTypeDef per port
+#define DCDC_VREQ_GET_TRACE    (0x03)   // IN, UsbTraceTypeDef
+#define DCDC_VREQ_GET_SELFTEST (0x04)   // IN, SelfTestResultTypeDef per port
+#define DCDC_VREQ_SET_SELFTEST (0x05)   // OUT, no data, wValue port << 8 | SELFTEST_x
+#define DCDC_VREQ_SET_SOF      (0x06)   // OUT, no data, wValue 1 keeps SOF unmasked, 0 gates it
+#define DCDC_VREQ_RESET        (0x0001)
+
+// Main loop wake up flags, set by the class and taken with DCDC_GetEvents
+#define DCDC_EVF_RX(idx)  (1U << (idx))         // Rx buffer ready on port idx
+#define DCDC_EVF_TX(idx)  (1U << (8 + (idx)))   // Tx data sent on port idx
+#define DCDC_EVF_BH       (1U << 16)            // DCDC_ProcessEvents has work
+#define DCDC_EVF_CONFIG   (1U << 17)            // Configuration set or cleared
+#define DCDC_EVF_APP      (1U << 18)            // Raised by the application
 
 // Ports
 #define DCDC_PORT1 (0x01)
 #define DCDC_PORT2 (0x02)
+#define DCDC_PORT3 (0x03)
+#define DCDC_PORT4 (0x04)
+
+// Endpoints of port index p, counting from 0. Ports take consecutive
+// endpoint pairs: 0x81/0x82/0x01 for the first, 0x83/0x84/0x03 next.
+#define DCDC_INTRIN_EP(p)  (0x81 + 2 * (p))    // EP for CDC commands
+#define DCDC_BULKIN_EP(p)  (0x82 + 2 * (p))    // EP for data IN
+#define DCDC_BULKOUT_EP(p) (0x01 + 2 * (p))    // EP for data OUT
 
-// Endpoints for both ports
-#define DCDC_P1_INTRIN_EP  (0x81)  // Port 1 EP for CDC commands
-#define DCDC_P1_BULKIN_EP  (0x82)  // Port 1 EP for data IN
-#define DCDC_P1_BULKOUT_EP (0x01)  // Port 1 EP for data OUT
-#define DCDC_P2_INTRIN_EP  (0x83)  // Port 2 EP for CDC commands
-#define DCDC_P2_BULKIN_EP  (0x84)  // Port 2 EP for data IN
-#define DCDC_P2_BULKOUT_EP (0x03)  // Port 2 EP for data OUT
+// Interfaces of port index p
+#define DCDC_COMM_ITF(p)   (2 * (p))
+#define DCDC_DATA_ITF(p)   (2 * (p) + 1)
 
 // Endpoint parameters
 #ifdef USE_USB_HS
@@ -76,26 +206,308 @@ extern "C" {
 #define DCDC_DATA_FS_IN_PACKET_SIZE  (DCDC_DATA_PACKET_SIZE)
 #define DCDC_DATA_FS_OUT_PACKET_SIZE (DCDC_DATA_PACKET_SIZE)
 
-// Config descriptor size
-#define DCDC_CONFIG_DESC_SIZE_LB (0x8D)
-#define DCDC_CONFIG_DESC_SIZE_HB (0x00)
+// Per port OUT transfer sizes. A transfer completes on a full buffer or on
+// a short packet, so bulk uploads take one DCDC_DataOut per buffer instead
+// of one per packet. Must be whole packets, the core writes pktcnt * MPS.
+// A fresh buffer is armed for one packet and only runs on into the rest
+// after a full one, see DCDC_RX_FLUSH_FRAMES.
+#ifndef DCDC_P1_RXBUF_SIZE
+#define DCDC_P1_RXBUF_SIZE (DCDC_RXBUF_SIZE)
+#endif
+#ifndef DCDC_P2_RXBUF_SIZE
+#define DCDC_P2_RXBUF_SIZE (DCDC_RXBUF_SIZE)
+#endif
+#ifndef DCDC_P3_RXBUF_SIZE
+#define DCDC_P3_RXBUF_SIZE (DCDC_RXBUF_SIZE)
+#endif
+#ifndef DCDC_P4_RXBUF_SIZE
+#define DCDC_P4_RXBUF_SIZE (DCDC_RXBUF_SIZE)
+#endif
+
+#if (DCDC_P1_RXBUF_SIZE % DCDC_DATA_PACKET_SIZE) || (DCDC_P2_RXBUF_SIZE % DCDC_DATA_PACKET_SIZE) || \
+    (DCDC_P3_RXBUF_SIZE % DCDC_DATA_PACKET_SIZE) || (DCDC_P4_RXBUF_SIZE % DCDC_DATA_PACKET_SIZE)
+#error "DCDC Rx buffer sizes must be multiples of DCDC_DATA_PACKET_SIZE"
+#endif
+#if (DCDC_P1_RXBUF_SIZE > 0xFFFF) || (DCDC_P2_RXBUF_SIZE > 0xFFFF) || \
+    (DCDC_P3_RXBUF_SIZE > 0xFFFF) || (DCDC_P4_RXBUF_SIZE > 0xFFFF)
+#error "DCDC Rx buffer sizes must fit USBD_LL_PrepareReceive"
+#endif
 
-// Dual CDC interfaces
+// SOFs, frames on FS and microframes on HS, a Bulk OUT transfer that ran on
+// past its first packet may wait for the rest of the buffer before it is
+// ended early. Hosts send no ZLP after a write of whole packets, such a
+// write is handed over this long after its last packet.
+#ifndef DCDC_RX_FLUSH_FRAMES
+#ifdef USE_USB_FS
+#define DCDC_RX_FLUSH_FRAMES (1)
+#else
+#define DCDC_RX_FLUSH_FRAMES (8)
+#endif
+#endif
+
+#if (DCDC_RX_FLUSH_FRAMES == 0)
+#error "DCDC_RX_FLUSH_FRAMES must be at least 1"
+#endif
+
+// Largest single Bulk IN transfer, DIEPTSIZ counts at most 1023 packets.
+// Longer submissions go out as several transfers of this size.
+#define DCDC_TX_MAX_XFER (1023 * DCDC_DATA_PACKET_SIZE)
+
+// Per port staging buffer for Tx data the core DMA cannot read in place,
+// whole packets so a bounced transfer never ends short mid stream
+#define DCDC_TXBOUNCE_SIZE (4 * DCDC_DATA_PACKET_SIZE)
+
+// Default Tx coalescing of every port, see DCDC_SetTxCoalescing. Ring data
+// below DCDC_TX_COALESCE_BYTES waits up to DCDC_TX_COALESCE_FRAMES SOFs,
+// frames on FS and microframes on HS, for more to arrive. 0 frames is off.
+#ifndef DCDC_TX_COALESCE_FRAMES
+#define DCDC_TX_COALESCE_FRAMES (0)
+#endif
+#ifndef DCDC_TX_COALESCE_BYTES
+#define DCDC_TX_COALESCE_BYTES  (DCDC_DATA_PACKET_SIZE)
+#endif
+
+// Default Tx weight of every port in bytes per SOF period, see
+// DCDC_SetTxWeight. Every port has its own Bulk IN endpoint and the host
+// polls them all, so a port past its bytes waits for the next SOF and the
+// bus time goes to the others. 0 is no limit.
+#ifndef DCDC_TX_WEIGHT
+#define DCDC_TX_WEIGHT (0)
+#endif
+
+#if (DCDC_TX_WEIGHT != 0) && (DCDC_TX_WEIGHT < DCDC_DATA_PACKET_SIZE)
+#error "DCDC_TX_WEIGHT must be 0 or at least one packet"
+#endif
+
+// Latency critical port, DCDC_PORT1 onwards, 0 for none. Its ring writes
+// are never held for coalescing, it is offered the pipe first on every
+// scheduling pass and its Bulk IN FIFO gets the FIFO RAM the other bulk
+// IN FIFOs do not strictly need.
+#ifndef DCDC_PRIO_PORT
+#define DCDC_PRIO_PORT (0)
+#endif
+
+#if (DCDC_PRIO_PORT > DCDC_NUM_PORTS)
+#error "DCDC_PRIO_PORT must be 0 or a configured port"
+#endif
+
+// Tx write or submission to completion latency, kept per port as a
+// histogram of log2 microsecond buckets in the stats. Bucket k counts
+// latencies below 2^k us. Every submission is timed. Ring writes are
+// sampled: at most DCDC_TXLAT_MARKS per port are timed at once, and a write
+// made while all are in flight is counted in tx_lat_unsampled instead.
+// Under a burst of small writes the percentiles cover only the first writes
+// of each drain, so read them against that count.
+#define DCDC_TXLAT_BUCKETS (16)
+#define DCDC_TXLAT_MARKS   (8)
+
+#if !RINGBUF_IS_POW2(DCDC_TXLAT_MARKS)
+#error "DCDC_TXLAT_MARKS must be a power of 2"
+#endif
+
+// FIFO RAM plan, all sizes in 32-bit words. The core shares one RAM between
+// the Rx FIFO and a Tx FIFO per IN endpoint, laid out by USBD_LL_Init from
+// these values. EP0 and the interrupt IN endpoints get the hardware minimum,
+// the Rx FIFO what RM0090 asks for with DCDC_RXFIFO_PACKETS data packets,
+// and the bulk IN FIFOs share what is left in whole packets so a packet can
+// be loaded while the previous one is on the bus. With DCDC_PRIO_PORT set
+// the other bulk IN FIFOs keep two packets and the priority port takes the
+// rest. Rounding leftovers go back to the Rx FIFO.
+#ifdef USE_USB_FS
+#define DCDC_FIFO_WORDS      (320)      // 1.25 KB on OTG FS
+#define DCDC_TXFIFO_MAX      (256)      // DIEPTXFx limit
+#else
+#define DCDC_FIFO_WORDS      (1024)     // 4 KB on OTG HS
+#define DCDC_TXFIFO_MAX      (512)      // DIEPTXFx limit
+#endif
+#define DCDC_TXFIFO_MIN      (16)       // DIEPTXFx limit
+
+// Kept free at the top of the RAM for the DMA address registers
+#if (USBD_DMA_ENABLE != 0)
+#define DCDC_FIFO_DMA_WORDS  (4 * DCDC_DEV_ENDPOINTS)
+#else
+#define DCDC_FIFO_DMA_WORDS  (0)
+#endif
+
+#ifndef DCDC_RXFIFO_PACKETS
+#define DCDC_RXFIFO_PACKETS  (2)
+#endif
+
+#define DCDC_FIFO_WMAX(a, b)    (((a) > (b)) ? (a) : (b))
+#define DCDC_FIFO_WMIN(a, b)    (((a) < (b)) ? (a) : (b))
+#define DCDC_PACKET_WORDS       (DCDC_DATA_PACKET_SIZE / 4)
+
+// Setup packets and global NAK, a data packet plus status word each, and
+// transfer complete status of EP0 and the bulk OUT endpoints
+#define DCDC_RXFIFO_MIN_WORDS   ((5 + 8) + DCDC_RXFIFO_PACKETS * (DCDC_PACKET_WORDS + 1) + \
+                                 2 * (1 + DCDC_NUM_PORTS) + 1)
+#define DCDC_EP0_TXFIFO_WORDS   (DCDC_FIFO_WMAX(DCDC_TXFIFO_MIN, 0x40 / 4))
+#define DCDC_CMD_TXFIFO_WORDS   (DCDC_FIFO_WMAX(DCDC_TXFIFO_MIN, DCDC_CMD_PACKET_SIZE / 4))
+#define DCDC_BULK_TXFIFO_SPARE  (DCDC_FIFO_WORDS - DCDC_FIFO_DMA_WORDS - DCDC_RXFIFO_MIN_WORDS - \
+                                 DCDC_EP0_TXFIFO_WORDS - DCDC_NUM_PORTS * DCDC_CMD_TXFIFO_WORDS)
+#if (DCDC_PRIO_PORT != 0) && (DCDC_NUM_PORTS > 1)
+#define DCDC_BULK_TXFIFO_WORDS  (2 * DCDC_PACKET_WORDS)
+#define DCDC_PRIO_TXFIFO_WORDS  (DCDC_FIFO_WMIN(DCDC_TXFIFO_MAX, DCDC_BULK_TXFIFO_SPARE - \
+                                 (DCDC_NUM_PORTS - 1) * DCDC_BULK_TXFIFO_WORDS) / \
+                                 DCDC_PACKET_WORDS * DCDC_PACKET_WORDS)
+#else
+#define DCDC_BULK_TXFIFO_WORDS  (DCDC_FIFO_WMIN(DCDC_TXFIFO_MAX, DCDC_BULK_TXFIFO_SPARE / DCDC_NUM_PORTS) / \
+                                 DCDC_PACKET_WORDS * DCDC_PACKET_WORDS)
+#define DCDC_PRIO_TXFIFO_WORDS  (DCDC_BULK_TXFIFO_WORDS)
+#endif
+// Bulk IN FIFO of port index p, 0 for DCDC_PORT1
+#define DCDC_BULKIN_TXFIFO_WORDS(p) ((((p) + 1) == DCDC_PRIO_PORT) ? DCDC_PRIO_TXFIFO_WORDS : \
+                                     DCDC_BULK_TXFIFO_WORDS)
+#define DCDC_RXFIFO_WORDS       (DCDC_FIFO_WORDS - DCDC_FIFO_DMA_WORDS - DCDC_EP0_TXFIFO_WORDS - \
+                                 DCDC_NUM_PORTS * DCDC_CMD_TXFIFO_WORDS - \
+                                 (DCDC_NUM_PORTS - 1) * DCDC_BULK_TXFIFO_WORDS - DCDC_PRIO_TXFIFO_WORDS)
+
+#if (DCDC_FIFO_WORDS < (DCDC_FIFO_DMA_WORDS + DCDC_RXFIFO_MIN_WORDS + DCDC_EP0_TXFIFO_WORDS + \
+                        DCDC_NUM_PORTS * DCDC_CMD_TXFIFO_WORDS))
+#error "DCDC FIFO plan overflows the USB core FIFO RAM"
+#endif
+#if (DCDC_BULK_TXFIFO_WORDS < (2 * DCDC_PACKET_WORDS)) || (DCDC_PRIO_TXFIFO_WORDS < (2 * DCDC_PACKET_WORDS))
+#error "DCDC FIFO plan leaves less than two packets per Bulk IN FIFO"
+#endif
+
+// Config descriptor size, an IAD and two interfaces per port
+#define DCDC_PORT_DESC_SIZE   (66)
+#define DCDC_CONFIG_DESC_SIZE (USB_LEN_CFG_DESC + DCDC_NUM_PORTS * DCDC_PORT_DESC_SIZE)
+
+// Returns ownership of a DCDC_SubmitData buffer, called from DCDC_DataIn. It
+// may queue more data on any port.
+typedef void (*DCDC_TxCompleteTypeDef)(uint8_t com_port, uint8_t *tx_buf, uint32_t tx_len);
+
+// CDC interfaces, CDC[0] serves DCDC_PORT1
 typedef struct {
-    USBD_CDC_ItfTypeDef *CDC1;
-    USBD_CDC_ItfTypeDef *CDC2;
+    USBD_CDC_ItfTypeDef *CDC[DCDC_NUM_PORTS];
+    DCDC_TxCompleteTypeDef TxComplete;      // Optional, may be NULL
 } DCDC_ItfTypeDef;
 
-// Dual CDC handles
+// Buffer handed between the application and the class
+typedef struct {
+    uint8_t *buf;
+    uint32_t len;
+} DCDC_BufDescTypeDef;
+
+// Source of the transfer currently on a Bulk IN endpoint
+#define DCDC_TXSRC_NONE (0)
+#define DCDC_TXSRC_RING (1)     // Span of the copying Tx ring
+#define DCDC_TXSRC_DESC (2)     // Head of the zero copy descriptor queue
+#define DCDC_TXSRC_ZLP  (3)     // Zero length packet closing the stream
+
+// Per port Tx queues, both fed under the class lock from the main loop or a
+// TxComplete callback and drained by DCDC_DataIn.
+// Each keeps its own order, when both have data the endpoint alternates.
+typedef struct {
+    RingBufTypeDef ring;                        // DCDC_TransmitData
+    DCDC_BufDescTypeDef desc[DCDC_TXDESC_NUM];  // DCDC_SubmitData
+    __IO uint32_t desc_head;                    // Advanced by DCDC_SubmitData
+    __IO uint32_t desc_tail;                    // Advanced by DCDC_DataIn
+    uint32_t desc_offset;                       // Bytes of the head sent
+    uint8_t *bounce;                            // DMA staging, NULL if unused
+    uint8_t src;                                // DCDC_TXSRC_x in flight
+    uint8_t held;                               // Waiting on SOFs, coalescing or weight
+    uint32_t hold_sof;                          // SOF count when the hold began
+    uint32_t round;                             // SOF count the credit belongs to
+    uint32_t credit;                            // Bytes left of the weight this round
+    uint32_t desc_stamp[DCDC_TXDESC_NUM];       // DWT cycle count of each submission
+} DCDC_TxQueueTypeDef;
+
+// Per port Tx latency marks. DCDC_TransmitData marks where each write ends
+// in the ring and when it was made, DCDC_DataIn bins the marks the ring
+// tail has passed into tx_lat.
+typedef struct {
+    uint32_t end[DCDC_TXLAT_MARKS];             // Ring head after the write
+    uint32_t stamp[DCDC_TXLAT_MARKS];           // DWT cycle count of the write
+    __IO uint32_t head;                         // Advanced by DCDC_TransmitData
+    __IO uint32_t tail;                         // Advanced by DCDC_DataIn
+} DCDC_TxLatTypeDef;
+
+// Per port runtime counters, DCDC_VREQ_GET_STATS returns one per port in
+// port order. Counters are written from the USB interrupt or under the class
+// lock, so no two writers race, and wrap. A host not reading shows as tx_busy
+// and tx_pending_us climbing, an application not keeping up as rx_overrun
+// and rx_nak_us.
+typedef struct {
+    uint32_t tx_bytes;          // Sent on Bulk IN
+    uint32_t tx_packets;        // Bulk IN packets, ZLPs included
+    uint32_t tx_pending_us;     // Bulk IN transfers waiting for the host
+    uint32_t tx_busy;           // DCDC_TransmitData/SubmitData USBD_BUSY
+    uint32_t tx_drop;           // DCDC_TransmitData larger than the ring
+    uint32_t rx_bytes;          // Received on Bulk OUT
+    uint32_t rx_packets;        // Bulk OUT packets, ZLPs included
+    uint32_t rx_overrun;        // Rx pool ran dry, Bulk OUT NAKing
+    uint32_t rx_nak_us;         // Time spent NAKing for a free buffer
+    uint32_t rx_flush;          // Bulk OUT transfers ended by DCDC_RX_FLUSH_FRAMES
+    uint32_t tx_lat_unsampled;  // DCDC_TransmitData writes left out of tx_lat
+    uint32_t tx_lat[DCDC_TXLAT_BUCKETS];    // Tx completions by log2 us latency
+} DCDC_PortStatsTypeDef;
+
+// Per port Rx buffer pool. Filled buffers are loaned to the application in
+// arrival order and come back through DCDC_ReleaseRxBuffer, which takes back
+// only a buffer of this pool that is on loan.
+typedef struct {
+    uint8_t *bufs;                              // Buffer 0, xfer_size apart
+    __IO uint8_t loaned[DCDC_RXPOOL_NUM];       // Set while the application has it
+    uint8_t *free[DCDC_RXPOOL_NUM];             // Ready to be armed
+    __IO uint32_t free_head;                    // Advanced on release
+    __IO uint32_t free_tail;                    // Advanced when armed
+    uint32_t xfer_size;                         // OUT transfer size
+    uint32_t lead;                              // RxBuffer bytes ahead of the armed transfer
+    uint8_t streaming;                          // Last buffer filled up, arm the next one whole
+    uint32_t flush_sof;                         // DCDC_SofCount when a run on transfer was armed
+    DCDC_BufDescTypeDef ready[DCDC_RXPOOL_NUM]; // Filled, not yet taken
+    __IO uint32_t ready_head;                   // Advanced by DCDC_DataOut
+    __IO uint32_t ready_tail;                   // Advanced when taken
+    uint32_t rd_offset;                         // DCDC_ReceiveData progress
+} DCDC_RxPoolTypeDef;
+
+// Per port handle
+typedef struct {
+    USBD_CDC_HandleTypeDef hcdc;
+    DCDC_TxQueueTypeDef txq;    // Main loop -> Bulk IN
+    DCDC_RxPoolTypeDef rxp;     // Bulk OUT -> Main loop
+    DCDC_TxLatTypeDef lat;      // Write to completion latency
+    uint32_t tx_stamp;          // DWT cycle count the IN transfer started
+    uint32_t nak_stamp;         // DWT cycle count the OUT endpoint ran dry
+    uint8_t naking;             // OUT endpoint left unarmed, no free buffer
+    uint8_t idx;                // com_port - DCDC_PORT1
+    uint8_t in_ep;              // Bulk IN endpoint address
+    uint8_t out_ep;             // Bulk OUT endpoint address
+} DCDC_PortTypeDef;
+
+// Size of the endpoint lookup tables, indexed by endpoint number
+#define DCDC_EP_TABLE_SIZE (16)
+
+// DCDC handles, port[0] is DCDC_PORT1. The lookup tables are filled by
+// DCDC_Init and hold NULL where no port owns the number, so the data path
+// finds its port with a single indexed load.
 typedef struct {
-    USBD_CDC_HandleTypeDef hcdc1;
-    USBD_CDC_HandleTypeDef hcdc2;
+    DCDC_PortTypeDef port[DCDC_NUM_PORTS];
+    DCDC_PortTypeDef *in_ep_port[DCDC_EP_TABLE_SIZE];   // By Bulk IN EP number
+    DCDC_PortTypeDef *out_ep_port[DCDC_EP_TABLE_SIZE];  // By Bulk OUT EP number
+    DCDC_PortTypeDef *itf_port[2 * DCDC_NUM_PORTS];     // By interface number
+    DCDC_PortTypeDef *cmd_port;                         // Awaiting EP0 data
 } DCDC_HandleTypeDef;
 
 extern USBD_ClassTypeDef  DCDC;
 
 uint8_t DCDC_RegisterInterface (USBD_HandleTypeDef *pdev, DCDC_ItfTypeDef *fops);
-uint8_t DCDC_TransmitData(uint8_t com_port, uint8_t *tx_buf, uint16_t tx_len);
+uint8_t DCDC_TransmitData(uint8_t com_port, uint8_t *tx_buf, uint32_t tx_len);
+uint8_t DCDC_SubmitData(uint8_t com_port, uint8_t *tx_buf, uint32_t tx_len);
+uint32_t DCDC_GetRxBuffer(uint8_t com_port, uint8_t **rx_buf);
+uint8_t DCDC_ReleaseRxBuffer(uint8_t com_port, uint8_t *rx_buf);
+uint32_t DCDC_ReceiveData(uint8_t com_port, uint8_t *rx_buf, uint32_t rx_len);
+uint8_t DCDC_SetTxCoalescing(uint8_t com_port, uint32_t min_len, uint16_t max_frames);
+uint8_t DCDC_SetTxWeight(uint8_t com_port, uint32_t bytes);
+uint32_t DCDC_GetSofCount(void);
+void DCDC_CountSof(uint8_t enable);
+uint8_t DCDC_GetTxLatency(uint8_t com_port, uint32_t *p50_us, uint32_t *p99_us);
+void DCDC_ProcessEvents(void);
+uint32_t DCDC_GetEvents(void);
+uint32_t DCDC_PeekEvents(void);
+void DCDC_Notify(uint32_t flags);
 
 #ifdef __cplusplus
 }
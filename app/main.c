@@ -37,6 +37,12 @@ extern DCDC_ItfTypeDef DCDC_fops;
 /* Global */
 USBD_HandleTypeDef   USBDevice;
 
+// Core cycles spent asleep in the main loop, and the reference point of
+// the last GetCpuLoad call
+static __IO uint64_t IdleCycles;
+static uint64_t LoadIdleCycles;
+static uint32_t LoadTick;
+
 /* Function prototypes */
 void PlatformInit(void);
 
@@ -57,8 +63,67 @@ int main()
 
     while(1)
     {
-        CDC_Itf_ProcessData();
+        // Sleep until the class raises a flag. Interrupts stay masked from
+        // the check to the WFI so a flag set in between still wakes the
+        // core, and the ISR only runs once the idle time is booked.
+        __disable_irq();
+        if(DCDC_PeekEvents() == 0)
+        {
+            uint32_t start = DWT->CYCCNT;
+            __WFI();
+            uint32_t slept = DWT->CYCCNT - start;
+            IdleCycles += slept;
+            CycProf_Idle(slept);
+        }
+        __enable_irq();
+
+        uint32_t events = DCDC_GetEvents();
+#if (DCDC_DEFER == DCDC_DEFER_POLL)
+        if(events & DCDC_EVF_BH)
+        {
+            DCDC_ProcessEvents();
+        }
+#endif
+        if(events != 0)
+        {
+            CDC_Itf_ProcessData();
+        }
+    }
+}
+
+/* GetIdleCycles
+ * Returns the core cycles the main loop has slept since start up
+ */
+uint64_t GetIdleCycles(void)
+{
+    uint64_t idle;
+
+    __disable_irq();
+    idle = IdleCycles;
+    __enable_irq();
+
+    return idle;
+}
+
+/* GetCpuLoad
+ * Returns the CPU utilization since the previous call in 0.01 % steps,
+ * the share of the core clock not spent asleep in the main loop
+ */
+uint32_t GetCpuLoad(void)
+{
+    uint64_t idle = GetIdleCycles();
+    uint32_t tick = HAL_GetTick();
+    uint64_t total = (uint64_t)(tick - LoadTick) * (SystemCoreClock / 1000);
+    uint64_t slept = idle - LoadIdleCycles;
+
+    LoadIdleCycles = idle;
+    LoadTick = tick;
+
+    if((total == 0) || (slept >= total))
+    {
+        return 0;
     }
+    return (uint32_t)(((total - slept) * 10000) / total);
 }
 
 void PlatformInit(void)
@@ -66,6 +131,14 @@ void PlatformInit(void)
     // Init the ST HAL first
     HAL_Init();
 
+    // Callback timing and USB event trace, when built in
+    CycProf_Init();
+    UsbTrace_Init();
+
+    // Cycle counter for the idle time
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+
     // GPIO A, B and C
     __HAL_RCC_GPIOA_CLK_ENABLE();
     __HAL_RCC_GPIOB_CLK_ENABLE();
@@ -41,6 +41,8 @@ extern "C" {
 /* Exported constants */
 /* Exported macros */
 /* Exported functions */
+uint64_t GetIdleCycles(void);
+uint32_t GetCpuLoad(void);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,105 @@
+/**
+ * Ring buffer module
+ *
+ * This file is part of stm32-usb-dualcdc, an implementation of Dual VCP ports
+ * over USB for STM32F4xx controllers.
+ * This project is available at
+ * <https://github.com/jisszacharia/stm32-usb-dualcdc>
+ *
+ * stm32-usb-dualcdc is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or any
+ * later version (at your option).
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * GNU Lesser General Public License is available at
+ * <http://www.gnu.org/licenses/>
+ *
+ * This project uses STM32F4xx HAL library and STM32 USB Device Library
+ * ST's license agreement is available at
+ * <http://www.st.com/software_license_agreement_liberty_v2>
+ *
+ * Copyright (c) 2016 JZJ <jiss.joseph@gmail.com>
+**/
+
+/* Includes */
+#include <string.h>
+#include "ringbuf.h"
+
+/************************** Public ********************************************/
+/* RingBuf_Init
+ * Attaches storage to a ring and empties it
+ */
+void RingBuf_Init(RingBufTypeDef *rb, uint8_t *buf, uint32_t size)
+{
+    rb->buf = buf;
+    rb->size = size;
+    rb->head = 0;
+    rb->tail = 0;
+}
+
+/* RingBuf_Used
+ * Returns the number of bytes waiting to be read
+ */
+uint32_t RingBuf_Used(RingBufTypeDef *rb)
+{
+    return rb->head - rb->tail;
+}
+
+/* RingBuf_Write
+ * Copies len bytes in, all or nothing. Returns the bytes written.
+ */
+uint32_t RingBuf_Write(RingBufTypeDef *rb, const uint8_t *data, uint32_t len)
+{
+    uint32_t head = rb->head;
+    uint32_t idx = head & (rb->size - 1);
+    uint32_t first;
+
+    if(len > rb->size - (head - rb->tail))
+    {
+        return 0;
+    }
+
+    first = rb->size - idx;
+    if(first > len)
+    {
+        first = len;
+    }
+    memcpy(&rb->buf[idx], data, first);
+    memcpy(rb->buf, data + first, len - first);
+
+    /* Data must land before the consumer sees the new head */
+    __DMB();
+    rb->head = head + len;
+
+    return len;
+}
+
+/* RingBuf_PeekSpan
+ * Returns the longest contiguous readable block without consuming it
+ */
+uint32_t RingBuf_PeekSpan(RingBufTypeDef *rb, uint8_t **data)
+{
+    uint32_t tail = rb->tail;
+    uint32_t idx = tail & (rb->size - 1);
+    uint32_t used = rb->head - tail;
+    uint32_t span = rb->size - idx;
+
+    *data = &rb->buf[idx];
+    return (used < span) ? used : span;
+}
+
+/* RingBuf_Consume
+ * Releases len bytes previously returned by RingBuf_PeekSpan
+ */
+void RingBuf_Consume(RingBufTypeDef *rb, uint32_t len)
+{
+    __DMB();
+    rb->tail += len;
+}
+
+/********************************** EOF ***************************************/
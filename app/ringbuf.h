@@ -0,0 +1,71 @@
+/**
+ * Ring buffer Header file
+ *
+ * This file is part of stm32-usb-dualcdc, an implementation of Dual VCP ports
+ * over USB for STM32F4xx controllers.
+ * This project is available at
+ * <https://github.com/jisszacharia/stm32-usb-dualcdc>
+ *
+ * stm32-usb-dualcdc is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or any
+ * later version (at your option).
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * GNU Lesser General Public License is available at
+ * <http://www.gnu.org/licenses/>
+ *
+ * This project uses STM32F4xx HAL library and STM32 USB Device Library
+ * ST's license agreement is available at
+ * <http://www.st.com/software_license_agreement_liberty_v2>
+ *
+ * Copyright (c) 2016 JZJ <jiss.joseph@gmail.com>
+**/
+
+/* Multiple inclusion */
+#ifndef __RINGBUF_H
+#define __RINGBUF_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Includes */
+#include "stm32f4xx.h"
+
+/* Macros */
+// Evaluates to 1 if x is a non-zero power of two
+#define RINGBUF_IS_POW2(x) (((x) != 0) && (((x) & ((x) - 1)) == 0))
+
+// Single producer / single consumer byte ring
+// head is only advanced by the producer and tail only by the consumer, so
+// one side may run in thread mode and the other in an ISR without locking.
+// Both indices run freely and are masked on access, size must be a power of 2.
+typedef struct {
+    uint8_t *buf;        // Storage
+    uint32_t size;       // Storage size in bytes
+    __IO uint32_t head;  // Write index
+    __IO uint32_t tail;  // Read index
+} RingBufTypeDef;
+
+void     RingBuf_Init(RingBufTypeDef *rb, uint8_t *buf, uint32_t size);
+uint32_t RingBuf_Used(RingBufTypeDef *rb);
+
+// Producer side
+uint32_t RingBuf_Write(RingBufTypeDef *rb, const uint8_t *data, uint32_t len);
+
+// Consumer side
+uint32_t RingBuf_PeekSpan(RingBufTypeDef *rb, uint8_t **data);
+void     RingBuf_Consume(RingBufTypeDef *rb, uint32_t len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* __RINGBUF_H */
+
+/********************************** EOF ***************************************/
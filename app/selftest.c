@@ -0,0 +1,446 @@
+/**
+ * PRBS self-test module
+ *
+ * This file is part of stm32-usb-dualcdc, an implementation of Dual VCP ports
+ * over USB for STM32F4xx controllers.
+ * This project is available at
+ * <https://github.com/jisszacharia/stm32-usb-dualcdc>
+ *
+ * stm32-usb-dualcdc is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or any
+ * later version (at your option).
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * GNU Lesser General Public License is available at
+ * <http://www.gnu.org/licenses/>
+ *
+ * This project uses STM32F4xx HAL library and STM32 USB Device Library
+ * ST's license agreement is available at
+ * <http://www.st.com/software_license_agreement_liberty_v2>
+ *
+ * Copyright (c) 2016 JZJ <jiss.joseph@gmail.com>
+**/
+
+/* Includes */
+#include "dualcdc.h"
+
+#if (SELFTEST_ENABLE != 0)
+
+/* Macros */
+// PRBS-31, x^31 + x^28 + 1 as in ITU-T O.150 but not inverted. The stream
+// goes out MSB first and bit n is bit n-28 xor bit n-31, so up to 28 new
+// bits follow at once from the last 31 kept in the state.
+#define SELFTEST_PRBS_MASK (0x7FFFFFFFU)
+#define SELFTEST_PRBS_SEED (0x7FFFFFFFU)
+
+// A buffer with more than 1 in 2^SHIFT bits wrong is out of step, not
+// noisy. Random data has every other bit wrong.
+#define SELFTEST_LOSS_SHIFT (2)
+
+// Counters of one port. The main loop adds to them with interrupts off, so
+// a snapshot from EP0 never sees half of a 64 bit update.
+typedef struct {
+    uint64_t tx_bytes;
+    uint64_t rx_bytes;
+    uint64_t bit_errors;
+    uint32_t sync_loss;
+} SelfTestCountTypeDef;
+
+// State of one port
+typedef struct {
+    __IO uint8_t mode;          // SELFTEST_x, set from EP0
+    __IO uint8_t start;         // Bumped by each mode change
+    uint8_t started;            // start the sink last restarted at
+    uint8_t locked;             // Sink in step
+    uint8_t seeded;             // Bytes shifted into rx_lfsr while out of step
+    __IO uint8_t drops;         // Bumped as the class drops the submissions
+    uint8_t dropped;            // drops the queue was last reset at
+    uint32_t tx_lfsr;           // Last 31 bits sent
+    uint32_t rx_lfsr;           // Last 31 bits expected
+    uint32_t tx_queued;         // Source buffers submitted
+    __IO uint32_t tx_done;      // Source buffers sent, from TxComplete
+    uint32_t tx_counted;        // tx_done already in count
+    SelfTestCountTypeDef count; // Since start up, main loop only
+    SelfTestCountTypeDef base;  // count at the last mode change or reset
+    uint32_t sof_base;          // DCDC_GetSofCount at the same point
+} SelfTestPortTypeDef;
+
+/* Private */
+static SelfTestPortTypeDef SelfTest_Port[DCDC_NUM_PORTS];
+
+// Source buffers, submitted in turn and never copied
+__ALIGN_BEGIN static uint8_t SelfTest_TxBuf[DCDC_NUM_PORTS][SELFTEST_TXBUF_NUM][SELFTEST_TXBUF_SIZE] __ALIGN_END;
+
+/* Private function prototypes */
+static uint32_t SelfTest_Prbs8 (uint32_t *lfsr);
+static uint32_t SelfTest_Prbs32 (uint32_t *lfsr);
+static uint32_t SelfTest_PopCount (uint32_t x);
+static void     SelfTest_Fill (SelfTestPortTypeDef *st, uint8_t *buf, uint32_t len);
+static void     SelfTest_Check (SelfTestPortTypeDef *st, const uint8_t *buf, uint32_t len);
+static void     SelfTest_Rebase (SelfTestPortTypeDef *st);
+
+/************************** Private *******************************************/
+/* SelfTest_Prbs8
+ * Next 8 bits of the sequence, first bit in bit 7
+ */
+static uint32_t SelfTest_Prbs8(uint32_t *lfsr)
+{
+    uint32_t s = *lfsr;
+    uint32_t bits = ((s >> 20) ^ (s >> 23)) & 0xFF;
+
+    *lfsr = ((s << 8) | bits) & SELFTEST_PRBS_MASK;
+    return bits;
+}
+
+/* SelfTest_Prbs32
+ * Next 32 bits of the sequence, first bit in bit 31. Two steps of 16 as
+ * only 28 follow from one state.
+ */
+static uint32_t SelfTest_Prbs32(uint32_t *lfsr)
+{
+    uint32_t s = *lfsr;
+    uint32_t hi = ((s >> 12) ^ (s >> 15)) & 0xFFFF;
+    uint32_t lo;
+
+    s = (s << 16) | hi;
+    lo = ((s >> 12) ^ (s >> 15)) & 0xFFFF;
+    *lfsr = ((s << 16) | lo) & SELFTEST_PRBS_MASK;
+
+    return (hi << 16) | lo;
+}
+
+/* SelfTest_PopCount
+ * Bits set in x, the M4 has no instruction for it
+ */
+static uint32_t SelfTest_PopCount(uint32_t x)
+{
+    x = x - ((x >> 1) & 0x55555555U);
+    x = (x & 0x33333333U) + ((x >> 2) & 0x33333333U);
+    x = (x + (x >> 4)) & 0x0F0F0F0FU;
+    return (x * 0x01010101U) >> 24;
+}
+
+/* SelfTest_Fill
+ * Continues the source stream into a word aligned buffer
+ */
+static void SelfTest_Fill(SelfTestPortTypeDef *st,
+                          uint8_t *buf,
+                          uint32_t len)
+{
+    uint32_t *word = (uint32_t *)buf;
+    uint32_t i;
+
+    /* Byte order on the wire is the bit order of the sequence */
+    for(i = 0; i < (len / 4); i++)
+    {
+        word[i] = __REV(SelfTest_Prbs32(&st->tx_lfsr));
+    }
+}
+
+/* SelfTest_Check
+ * Compares received data with the sequence and counts the wrong bits.
+ * Out of step, the first 31 bits received become the expected state. A
+ * buffer mostly wrong puts the sink back out of step.
+ */
+static void SelfTest_Check(SelfTestPortTypeDef *st,
+                           const uint8_t *buf,
+                           uint32_t len)
+{
+    uint32_t errors = 0;
+    uint32_t checked;
+    uint32_t primask;
+    uint8_t lost = 0;
+    uint32_t i = 0;
+
+    while(!st->locked && (i < len))
+    {
+        st->rx_lfsr = ((st->rx_lfsr << 8) | buf[i++]) & SELFTEST_PRBS_MASK;
+        if(st->seeded < 4)
+        {
+            st->seeded++;
+        }
+        /* All zeros would follow a dead line for ever */
+        st->locked = (st->seeded == 4) && (st->rx_lfsr != 0);
+    }
+    checked = len - i;
+
+    /* Bytes up to a word boundary, the words, then the rest */
+    while((i < len) && (((uint32_t)&buf[i] & 3) != 0))
+    {
+        errors += SelfTest_PopCount(buf[i++] ^ SelfTest_Prbs8(&st->rx_lfsr));
+    }
+    for(; (i + 4) <= len; i += 4)
+    {
+        uint32_t diff = __REV(*(const uint32_t *)&buf[i]) ^ SelfTest_Prbs32(&st->rx_lfsr);
+
+        if(diff != 0)
+        {
+            errors += SelfTest_PopCount(diff);
+        }
+    }
+    while(i < len)
+    {
+        errors += SelfTest_PopCount(buf[i++] ^ SelfTest_Prbs8(&st->rx_lfsr));
+    }
+
+    if((checked != 0) && (errors > ((checked * 8) >> SELFTEST_LOSS_SHIFT)))
+    {
+        st->locked = 0;
+        st->seeded = 0;
+        lost = 1;
+    }
+
+    primask = __get_PRIMASK();
+    __disable_irq();
+    st->count.rx_bytes += len;
+    if(lost)
+    {
+        st->count.sync_loss++;
+    }
+    else
+    {
+        st->count.bit_errors += errors;
+    }
+    __set_PRIMASK(primask);
+}
+
+/* SelfTest_Rebase
+ * Starts the reported interval of a port here. Called from EP0, the main
+ * loop only changes the counters with interrupts off.
+ */
+static void SelfTest_Rebase(SelfTestPortTypeDef *st)
+{
+    st->base = st->count;
+    st->sof_base = DCDC_GetSofCount();
+}
+
+/************************** Public ********************************************/
+/* SelfTest_Drop
+ * Called as the class deinitializes a port. Source buffers submitted
+ * before are gone with its configuration and never come back through
+ * TxComplete, SelfTest_Process starts the queue over.
+ */
+void SelfTest_Drop(uint8_t com_port)
+{
+    if((com_port >= DCDC_PORT1) && (com_port <= DCDC_NUM_PORTS))
+    {
+        SelfTest_Port[com_port - DCDC_PORT1].drops++;
+    }
+}
+
+/* SelfTest_SetMode
+ * Selects the mode of a port and restarts its results. The frame count
+ * runs while any port is under test.
+ */
+uint8_t SelfTest_SetMode(uint8_t com_port,
+                         uint8_t mode)
+{
+    uint8_t active = 0;
+    uint8_t idx;
+
+    if((com_port < DCDC_PORT1) || (com_port > DCDC_NUM_PORTS) ||
+       (mode > SELFTEST_BOTH))
+    {
+        return USBD_FAIL;
+    }
+
+    SelfTestPortTypeDef *st = &SelfTest_Port[com_port - DCDC_PORT1];
+
+    st->mode = mode;
+    st->start++;
+    SelfTest_Rebase(st);
+
+    for(idx = 0; idx < DCDC_NUM_PORTS; idx++)
+    {
+        active |= SelfTest_Port[idx].mode;
+    }
+    DCDC_CountSof(active != SELFTEST_OFF);
+
+    /* The main loop takes it from here */
+    DCDC_Notify(DCDC_EVF_APP);
+
+    return USBD_OK;
+}
+
+/* SelfTest_GetMode
+ * Returns the mode of a port, SELFTEST_OFF for an invalid one
+ */
+uint8_t SelfTest_GetMode(uint8_t com_port)
+{
+    if((com_port < DCDC_PORT1) || (com_port > DCDC_NUM_PORTS))
+    {
+        return SELFTEST_OFF;
+    }
+    return SelfTest_Port[com_port - DCDC_PORT1].mode;
+}
+
+/* SelfTest_LineCoding
+ * Selects the mode from a SET_LINE_CODING rate of SELFTEST_BAUD + mode
+ */
+void SelfTest_LineCoding(uint8_t com_port,
+                         uint32_t bitrate)
+{
+    if((bitrate & ~(uint32_t)SELFTEST_BOTH) == SELFTEST_BAUD)
+    {
+        SelfTest_SetMode(com_port, (uint8_t)(bitrate & SELFTEST_BOTH));
+    }
+}
+
+/* SelfTest_Process
+ * Main loop work of a port. Books the sent source buffers and, under test,
+ * refills and submits them and checks or drops all received data. Returns
+ * the mode run, the application owns the port's data at SELFTEST_OFF.
+ */
+uint8_t SelfTest_Process(uint8_t com_port)
+{
+    uint32_t primask;
+    uint32_t done;
+    uint32_t len;
+    uint8_t *buf;
+    uint8_t mode;
+
+    if((com_port < DCDC_PORT1) || (com_port > DCDC_NUM_PORTS))
+    {
+        return SELFTEST_OFF;
+    }
+
+    SelfTestPortTypeDef *st = &SelfTest_Port[com_port - DCDC_PORT1];
+
+    /* Nothing submitted before a new configuration comes back */
+    if(st->dropped != st->drops)
+    {
+        st->dropped = st->drops;
+        st->tx_queued = st->tx_done;
+        st->tx_counted = st->tx_done;
+        st->locked = 0;
+        st->seeded = 0;
+    }
+
+    done = st->tx_done;
+    if(done != st->tx_counted)
+    {
+        primask = __get_PRIMASK();
+        __disable_irq();
+        st->count.tx_bytes += (uint64_t)(done - st->tx_counted) * SELFTEST_TXBUF_SIZE;
+        __set_PRIMASK(primask);
+        st->tx_counted = done;
+    }
+
+    mode = st->mode;
+    if(mode == SELFTEST_OFF)
+    {
+        return SELFTEST_OFF;
+    }
+
+    /* A new mode resyncs the sink, the source stream just runs on */
+    if(st->started != st->start)
+    {
+        st->started = st->start;
+        st->locked = 0;
+        st->seeded = 0;
+    }
+    if(st->tx_lfsr == 0)
+    {
+        st->tx_lfsr = SELFTEST_PRBS_SEED;
+    }
+
+    while((len = DCDC_GetRxBuffer(com_port, &buf)) != 0)
+    {
+        if(mode & SELFTEST_SINK)
+        {
+            SelfTest_Check(st, buf, len);
+        }
+        DCDC_ReleaseRxBuffer(com_port, buf);
+    }
+
+    /* Keep every source buffer queued. One the class refused is filled
+    again from the same point, so the stream has no gap. */
+    while((mode & SELFTEST_SOURCE) &&
+          ((st->tx_queued - st->tx_done) < SELFTEST_TXBUF_NUM))
+    {
+        uint32_t lfsr = st->tx_lfsr;
+
+        buf = SelfTest_TxBuf[com_port - DCDC_PORT1][st->tx_queued & (SELFTEST_TXBUF_NUM - 1)];
+        SelfTest_Fill(st, buf, SELFTEST_TXBUF_SIZE);
+        if(DCDC_SubmitData(com_port, buf, SELFTEST_TXBUF_SIZE) != USBD_OK)
+        {
+            st->tx_lfsr = lfsr;
+            break;
+        }
+        st->tx_queued++;
+    }
+
+    return mode;
+}
+
+/* SelfTest_TxComplete
+ * Books a sent source buffer. Returns 1 if tx_buf was one, 0 if it
+ * belongs to the application.
+ */
+uint8_t SelfTest_TxComplete(uint8_t com_port,
+                            uint8_t *tx_buf)
+{
+    if((com_port < DCDC_PORT1) || (com_port > DCDC_NUM_PORTS))
+    {
+        return 0;
+    }
+
+    uint8_t (*bufs)[SELFTEST_TXBUF_SIZE] = SelfTest_TxBuf[com_port - DCDC_PORT1];
+
+    if((tx_buf < bufs[0]) || (tx_buf > bufs[SELFTEST_TXBUF_NUM - 1]))
+    {
+        return 0;
+    }
+
+    SelfTest_Port[com_port - DCDC_PORT1].tx_done++;
+    return 1;
+}
+
+/* SelfTest_Snapshot
+ * Fills snap with the results of every port, and with reset set starts
+ * the next interval there. Returns the bytes filled.
+ */
+uint32_t SelfTest_Snapshot(SelfTestResultTypeDef *snap,
+                           uint8_t reset)
+{
+    uint32_t sof = DCDC_GetSofCount();
+    uint8_t idx;
+
+    for(idx = 0; idx < DCDC_NUM_PORTS; idx++)
+    {
+        SelfTestPortTypeDef *st = &SelfTest_Port[idx];
+        SelfTestResultTypeDef *res = &snap[idx];
+        uint64_t us;
+
+        res->tx_bytes = st->count.tx_bytes - st->base.tx_bytes;
+        res->rx_bytes = st->count.rx_bytes - st->base.rx_bytes;
+        res->bit_errors = st->count.bit_errors - st->base.bit_errors;
+        res->sync_loss = st->count.sync_loss - st->base.sync_loss;
+        res->frames = sof - st->sof_base;
+        res->frame_us = SELFTEST_FRAME_US;
+        res->mode = st->mode;
+        res->locked = st->locked;
+        res->reserved = 0;
+
+        /* Bytes per us are MB/s, kept to three decimals */
+        us = (uint64_t)res->frames * SELFTEST_FRAME_US;
+        res->tx_mbs_x1000 = (us != 0) ? (uint32_t)((res->tx_bytes * 1000) / us) : 0;
+        res->rx_mbs_x1000 = (us != 0) ? (uint32_t)((res->rx_bytes * 1000) / us) : 0;
+
+        if(reset)
+        {
+            SelfTest_Rebase(st);
+        }
+    }
+
+    return DCDC_NUM_PORTS * sizeof(SelfTestResultTypeDef);
+}
+
+#endif  /* SELFTEST_ENABLE */
+
+/********************************** EOF ***************************************/
@@ -0,0 +1,120 @@
+/**
+ * PRBS self-test Header file
+ *
+ * This file is part of stm32-usb-dualcdc, an implementation of Dual VCP ports
+ * over USB for STM32F4xx controllers.
+ * This project is available at
+ * <https://github.com/jisszacharia/stm32-usb-dualcdc>
+ *
+ * stm32-usb-dualcdc is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or any
+ * later version (at your option).
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * GNU Lesser General Public License is available at
+ * <http://www.gnu.org/licenses/>
+ *
+ * This project uses STM32F4xx HAL library and STM32 USB Device Library
+ * ST's license agreement is available at
+ * <http://www.st.com/software_license_agreement_liberty_v2>
+ *
+ * Copyright (c) 2016 JZJ <jiss.joseph@gmail.com>
+**/
+
+/* Multiple inclusion */
+#ifndef __SELFTEST_H
+#define __SELFTEST_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Includes */
+#include "stm32f4xx.h"
+
+/* Macros */
+// Set to 1 to build in the PRBS self-test, it takes SELFTEST_TXBUF_NUM
+// source buffers per port. At 0 the hooks compile to nothing and every
+// port runs the application's data path.
+#ifndef SELFTEST_ENABLE
+#define SELFTEST_ENABLE (0)
+#endif
+
+// Modes of a port. A source sends PRBS-31 on Bulk IN, a sink checks that
+// Bulk OUT carries it. With the host looping IN back to OUT, both checks
+// the full duplex path.
+#define SELFTEST_OFF    (0x00)
+#define SELFTEST_SOURCE (0x01)
+#define SELFTEST_SINK   (0x02)
+#define SELFTEST_BOTH   (SELFTEST_SOURCE | SELFTEST_SINK)
+
+// SET_LINE_CODING to SELFTEST_BAUD + mode selects the mode of the port,
+// any other rate leaves it as it is. Far from the standard rates and a
+// multiple of 4.
+#define SELFTEST_BAUD (3141592)
+
+// Source buffers per port, each submitted whole. The number must be a
+// power of 2 and the size a multiple of 4.
+#ifndef SELFTEST_TXBUF_NUM
+#define SELFTEST_TXBUF_NUM  (4)
+#endif
+#ifndef SELFTEST_TXBUF_SIZE
+#define SELFTEST_TXBUF_SIZE (4096)
+#endif
+
+#if (SELFTEST_TXBUF_NUM & (SELFTEST_TXBUF_NUM - 1)) || (SELFTEST_TXBUF_SIZE & 3)
+#error "SELFTEST_TXBUF_NUM must be a power of 2 and SELFTEST_TXBUF_SIZE a multiple of 4"
+#endif
+
+// Time between the SOFs counted by DCDC_GetSofCount
+#ifdef USE_USB_HS
+#define SELFTEST_FRAME_US (125)
+#else
+#define SELFTEST_FRAME_US (1000)
+#endif
+
+// Results of one port since its mode was set or the last reset, as
+// returned to the host. MB/s is bytes / (frames * frame_us), the rates
+// carry it in thousandths.
+typedef struct {
+    uint64_t tx_bytes;      // PRBS sent on Bulk IN
+    uint64_t rx_bytes;      // Received on Bulk OUT
+    uint64_t bit_errors;    // Wrong bits in rx_bytes while in step
+    uint32_t frames;        // SOFs elapsed
+    uint32_t frame_us;      // SELFTEST_FRAME_US
+    uint32_t tx_mbs_x1000;  // tx_bytes rate, MB/s * 1000
+    uint32_t rx_mbs_x1000;  // rx_bytes rate, MB/s * 1000
+    uint32_t sync_loss;     // Times the sink fell out of step
+    uint8_t mode;           // SELFTEST_x
+    uint8_t locked;         // Sink in step with the received stream
+    uint16_t reserved;
+} SelfTestResultTypeDef;
+
+#if (SELFTEST_ENABLE != 0)
+void     SelfTest_Drop(uint8_t com_port);
+uint8_t  SelfTest_SetMode(uint8_t com_port, uint8_t mode);
+uint8_t  SelfTest_GetMode(uint8_t com_port);
+void     SelfTest_LineCoding(uint8_t com_port, uint32_t bitrate);
+uint8_t  SelfTest_Process(uint8_t com_port);
+uint8_t  SelfTest_TxComplete(uint8_t com_port, uint8_t *tx_buf);
+uint32_t SelfTest_Snapshot(SelfTestResultTypeDef *snap, uint8_t reset);
+#else
+#define SelfTest_Drop(com_port)
+#define SelfTest_GetMode(com_port)              (SELFTEST_OFF)
+#define SelfTest_LineCoding(com_port, bitrate)
+#define SelfTest_Process(com_port)              (SELFTEST_OFF)
+#define SelfTest_TxComplete(com_port, tx_buf)   (0)
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* __SELFTEST_H */
+
+/********************************** EOF ***************************************/
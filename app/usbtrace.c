@@ -0,0 +1,69 @@
+/**
+ * USB event trace module
+ *
+ * This file is part of stm32-usb-dualcdc, an implementation of Dual VCP ports
+ * over USB for STM32F4xx controllers.
+ * This project is available at
+ * <https://github.com/jisszacharia/stm32-usb-dualcdc>
+ *
+ * stm32-usb-dualcdc is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or any
+ * later version (at your option).
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * GNU Lesser General Public License is available at
+ * <http://www.gnu.org/licenses/>
+ *
+ * This project uses STM32F4xx HAL library and STM32 USB Device Library
+ * ST's license agreement is available at
+ * <http://www.st.com/software_license_agreement_liberty_v2>
+ *
+ * Copyright (c) 2016 JZJ <jiss.joseph@gmail.com>
+**/
+
+/* Includes */
+#include <string.h>
+#include "usbtrace.h"
+
+#if (USBTRACE_ENABLE != 0)
+
+/* Public */
+UsbTraceTypeDef UsbTrace;
+
+/************************** Public ********************************************/
+/* UsbTrace_Init
+ * Starts the DWT cycle counter and empties the trace
+ */
+void UsbTrace_Init(void)
+{
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+
+    memset(&UsbTrace, 0, sizeof(UsbTrace));
+    UsbTrace.num = USBTRACE_NUM;
+}
+
+/* UsbTrace_Snapshot
+ * Copies the trace out with interrupts off. A record claimed by a preempted
+ * writer may be half filled. Returns the bytes copied.
+ */
+uint32_t UsbTrace_Snapshot(UsbTraceTypeDef *snap)
+{
+    uint32_t primask = __get_PRIMASK();
+
+    __disable_irq();
+    UsbTrace.core_clock = SystemCoreClock;
+    memcpy(snap, &UsbTrace, sizeof(UsbTrace));
+    __set_PRIMASK(primask);
+
+    return sizeof(UsbTrace);
+}
+
+#endif  /* USBTRACE_ENABLE */
+
+/********************************** EOF ***************************************/
@@ -0,0 +1,128 @@
+/**
+ * USB event trace Header file
+ *
+ * This file is part of stm32-usb-dualcdc, an implementation of Dual VCP ports
+ * over USB for STM32F4xx controllers.
+ * This project is available at
+ * <https://github.com/jisszacharia/stm32-usb-dualcdc>
+ *
+ * stm32-usb-dualcdc is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or any
+ * later version (at your option).
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * GNU Lesser General Public License is available at
+ * <http://www.gnu.org/licenses/>
+ *
+ * This project uses STM32F4xx HAL library and STM32 USB Device Library
+ * ST's license agreement is available at
+ * <http://www.st.com/software_license_agreement_liberty_v2>
+ *
+ * Copyright (c) 2016 JZJ <jiss.joseph@gmail.com>
+**/
+
+/* Multiple inclusion */
+#ifndef __USBTRACE_H
+#define __USBTRACE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Includes */
+#include "stm32f4xx.h"
+
+/* Macros */
+// Set to 1 to keep a RAM trace of USB events. At 0 the trace points
+// compile to nothing.
+#ifndef USBTRACE_ENABLE
+#define USBTRACE_ENABLE (0)
+#endif
+
+// Records kept, the oldest is overwritten. Must be a power of 2.
+#ifndef USBTRACE_NUM
+#define USBTRACE_NUM (128)
+#endif
+
+#if (USBTRACE_NUM & (USBTRACE_NUM - 1))
+#error "USBTRACE_NUM must be a power of 2"
+#endif
+
+// Record types, ep and arg as noted
+#define USBTRACE_SETUP      (0x01)  // ep 0, arg bmRequest | bRequest << 8
+#define USBTRACE_DATAOUT    (0x02)  // OUT ep, arg bytes of the transfer
+#define USBTRACE_DATAIN     (0x03)  // IN ep, arg bytes of the transfer
+#define USBTRACE_SOF        (0x04)  // arg frame number
+#define USBTRACE_RESET      (0x05)  // arg USBD_SPEED_x
+#define USBTRACE_SUSPEND    (0x06)
+#define USBTRACE_RESUME     (0x07)
+#define USBTRACE_CONNECT    (0x08)
+#define USBTRACE_DISCONNECT (0x09)
+#define USBTRACE_ISOINCOMP  (0x0A)  // ep
+#define USBTRACE_TXSTART    (0x10)  // Class, IN ep, arg bytes started
+#define USBTRACE_TXDONE     (0x11)  // Class, IN ep, arg bytes sent
+#define USBTRACE_RXDONE     (0x12)  // Class, OUT ep, arg bytes received
+#define USBTRACE_RXARM      (0x13)  // Class, OUT ep armed
+#define USBTRACE_RXNAK      (0x14)  // Class, OUT ep left NAKing
+
+// One event, timestamped with the DWT cycle counter
+typedef struct {
+    uint32_t stamp;
+    uint8_t type;       // USBTRACE_x
+    uint8_t ep;         // Endpoint address, 0 if none
+    uint16_t arg;       // Per type, saturated
+} UsbTraceRecTypeDef;
+
+// The trace as dumped to the host. Record head - 1 is the newest, the
+// ring has wrapped once head exceeds num.
+typedef struct {
+    uint32_t head;                  // Records written since start up
+    uint32_t num;                   // USBTRACE_NUM
+    uint32_t core_clock;            // SystemCoreClock, cycles per second
+    uint32_t reserved;
+    UsbTraceRecTypeDef rec[USBTRACE_NUM];
+} UsbTraceTypeDef;
+
+#if (USBTRACE_ENABLE != 0)
+extern UsbTraceTypeDef UsbTrace;
+
+// Writers may preempt each other, a slot is claimed with one exclusive
+// increment of head and filled afterwards
+static __INLINE void UsbTrace_Put(uint8_t type, uint8_t ep, uint32_t arg)
+{
+    uint32_t head;
+    UsbTraceRecTypeDef *rec;
+
+    do
+    {
+        head = __LDREXW(&UsbTrace.head);
+    } while(__STREXW(head + 1, &UsbTrace.head) != 0);
+
+    rec = &UsbTrace.rec[head & (USBTRACE_NUM - 1)];
+    rec->stamp = DWT->CYCCNT;
+    rec->type = type;
+    rec->ep = ep;
+    rec->arg = (arg > 0xFFFF) ? 0xFFFF : arg;
+}
+
+#define USBTRACE(type, ep, arg) UsbTrace_Put((type), (ep), (arg))
+
+void     UsbTrace_Init(void);
+uint32_t UsbTrace_Snapshot(UsbTraceTypeDef *snap);
+#else
+#define USBTRACE(type, ep, arg)
+#define UsbTrace_Init()
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* __USBTRACE_H */
+
+/********************************** EOF ***************************************/
@@ -39,116 +39,152 @@
 
 /* Private typedef -----------------------------------------------------------*/
 /* Private define ------------------------------------------------------------*/
-USBD_CDC_LineCodingTypeDef LineCoding_P1 =
+// Default line coding of a port
+#define CDC_LINECODING_INIT(n) \
+{ \
+    9600,   /* baud rate*/ \
+    0x00,   /* stop bits-1*/ \
+    0x00,   /* parity - none*/ \
+    0x08    /* nb. of bits 8*/ \
+},
+
+USBD_CDC_LineCodingTypeDef LineCoding[DCDC_NUM_PORTS] =
 {
-    9600,   /* baud rate*/
-    0x00,   /* stop bits-1*/
-    0x00,   /* parity - none*/
-    0x08    /* nb. of bits 8*/
+    DCDC_FOREACH_PORT(CDC_LINECODING_INIT)
 };
 
-USBD_CDC_LineCodingTypeDef LineCoding_P2 =
-{
-    9600,   /* baud rate*/
-    0x00,   /* stop bits-1*/
-    0x00,   /* parity - none*/
-    0x08    /* nb. of bits 8*/
+/* Private macro -------------------------------------------------------------*/
+// The demo bridges ports in pairs, 1 with 2 and 3 with 4. An odd last port
+// echoes back to itself.
+#define CDC_PEER(idx) ((((idx) ^ 1) < DCDC_NUM_PORTS) ? ((idx) ^ 1) : (idx))
+
+// Per port CDC callbacks. DeInit and Control need their port and the class
+// calls them without one, so each port gets thin wrappers.
+#define CDC_ITF_PORT(n) \
+static int8_t CDC##n##_Itf_DeInit(void) \
+{ \
+    return CDC_Itf_DeInit(n); \
+} \
+static int8_t CDC##n##_Itf_Control(uint8_t cmd, uint8_t* pbuf, uint16_t length) \
+{ \
+    return CDC_Itf_Control(&LineCoding[n - 1], cmd, pbuf, length); \
+} \
+USBD_CDC_ItfTypeDef CDC##n##_fops = \
+{ \
+    CDC_Itf_Init, \
+    CDC##n##_Itf_DeInit, \
+    CDC##n##_Itf_Control, \
+    CDC_Itf_Receive \
 };
 
-/* Private macro -------------------------------------------------------------*/
+#define CDC_ITF_FOPS(n) &CDC##n##_fops,
+
 /* Private variables ---------------------------------------------------------*/
 
 /* USB handler declaration */
 extern USBD_HandleTypeDef  USBDevice;
 
-// Application buffers for demo
-char CDC1_Data[512];
-char CDC2_Data[512];
-uint32_t CDC1_DataLen = 0;
-uint32_t CDC2_DataLen = 0;
+// Rx buffers on loan for demo, waiting to be sent out of the peer port
+uint8_t *CDC_Data[DCDC_NUM_PORTS];
+uint32_t CDC_DataLen[DCDC_NUM_PORTS];
 
 
 /* Private function prototypes -----------------------------------------------*/
-static int8_t CDC1_Itf_Init     (void);
-static int8_t CDC1_Itf_DeInit   (void);
-static int8_t CDC1_Itf_Control  (uint8_t cmd, uint8_t* pbuf, uint16_t length);
-static int8_t CDC1_Itf_Receive  (uint8_t* pbuf, uint32_t *Len);
-static int8_t CDC2_Itf_Init     (void);
-static int8_t CDC2_Itf_DeInit   (void);
-static int8_t CDC2_Itf_Control  (uint8_t cmd, uint8_t* pbuf, uint16_t length);
-static int8_t CDC2_Itf_Receive  (uint8_t* pbuf, uint32_t *Len);
-
-USBD_CDC_ItfTypeDef CDC1_fops =
-{
-    // CDC 1 interfaces
-    CDC1_Itf_Init,
-    CDC1_Itf_DeInit,
-    CDC1_Itf_Control,
-    CDC1_Itf_Receive
-};
+static int8_t CDC_Itf_Init     (void);
+static int8_t CDC_Itf_DeInit   (uint8_t com_port);
+static int8_t CDC_Itf_Control  (USBD_CDC_LineCodingTypeDef *linecoding,
+                                uint8_t cmd, uint8_t* pbuf, uint16_t length);
+static int8_t CDC_Itf_Receive  (uint8_t* pbuf, uint32_t *Len);
+static void   CDC_Itf_TxComplete (uint8_t com_port, uint8_t* pbuf, uint32_t Len);
 
-USBD_CDC_ItfTypeDef CDC2_fops =
-{
-    // CDC 2 interfaces
-    CDC2_Itf_Init,
-    CDC2_Itf_DeInit,
-    CDC2_Itf_Control,
-    CDC2_Itf_Receive
-};
+DCDC_FOREACH_PORT(CDC_ITF_PORT)
 
 DCDC_ItfTypeDef DCDC_fops =
 {
-    &CDC1_fops,
-    &CDC2_fops
+    { DCDC_FOREACH_PORT(CDC_ITF_FOPS) },
+    CDC_Itf_TxComplete
 };
 
 /* Public functions ----------------------------------------------------------*/
 void CDC_Itf_ProcessData(void)
 {
-    if(CDC1_DataLen)
+    uint8_t idx;
+
+    // Borrow each filled Rx buffer and submit it to the peer port as is.
+    // It goes back to its pool from the TxComplete callback, so the data is
+    // never copied. While all buffers are out the OUT endpoint NAKs.
+    // A port under self-test runs its own data path instead, and data
+    // bridged to it is dropped.
+    for(idx = 0; idx < DCDC_NUM_PORTS; idx++)
     {
-        DCDC_TransmitData(DCDC_PORT2, (uint8_t*)CDC1_Data, CDC1_DataLen);
-        CDC1_DataLen = 0;
-    }
-    if(CDC2_DataLen)
-    {
-        DCDC_TransmitData(DCDC_PORT1, (uint8_t*)CDC2_Data, CDC2_DataLen);
-        CDC2_DataLen = 0;
+        if(SelfTest_Process(DCDC_PORT1 + idx) != SELFTEST_OFF)
+        {
+            if(CDC_DataLen[idx])
+            {
+                DCDC_ReleaseRxBuffer(DCDC_PORT1 + idx, CDC_Data[idx]);
+                CDC_DataLen[idx] = 0;
+            }
+            continue;
+        }
+        if(CDC_DataLen[idx] == 0)
+        {
+            CDC_DataLen[idx] = DCDC_GetRxBuffer(DCDC_PORT1 + idx, &CDC_Data[idx]);
+        }
+        if(CDC_DataLen[idx])
+        {
+            if(SelfTest_GetMode(DCDC_PORT1 + CDC_PEER(idx)) != SELFTEST_OFF)
+            {
+                DCDC_ReleaseRxBuffer(DCDC_PORT1 + idx, CDC_Data[idx]);
+                CDC_DataLen[idx] = 0;
+            }
+            else if(DCDC_SubmitData(DCDC_PORT1 + CDC_PEER(idx), CDC_Data[idx],
+                                    CDC_DataLen[idx]) != USBD_BUSY)
+            {
+                CDC_DataLen[idx] = 0;
+            }
+        }
     }
 }
 
 /* Private functions ---------------------------------------------------------*/
 /**
-* @brief  CDC1_Itf_Init
-*         Initializes the CDC1 media low layer
+* @brief  CDC_Itf_Init
+*         Initializes the CDC media low layer
 * @param  None
 * @retval Result of the opeartion: USBD_OK if all operations are OK else USBD_FAIL
 */
-static int8_t CDC1_Itf_Init(void)
+static int8_t CDC_Itf_Init(void)
 {
     return (USBD_OK);
 }
 
 /**
-* @brief  CDC1_Itf_DeInit
-*         DeInitializes the CDC media low layer
-* @param  None
+* @brief  CDC_Itf_DeInit
+*         DeInitializes the CDC media low layer of a port
+* @param  com_port: Port deinitialized
 * @retval Result of the opeartion: USBD_OK if all operations are OK else USBD_FAIL
 */
-static int8_t CDC1_Itf_DeInit(void)
+static int8_t CDC_Itf_DeInit(uint8_t com_port)
 {
+    /* Buffers on loan and submitted belong to the old configuration, the
+    pools start over with the next one and would refuse them */
+    CDC_Data[com_port - DCDC_PORT1] = NULL;
+    CDC_DataLen[com_port - DCDC_PORT1] = 0;
+    SelfTest_Drop(com_port);
     return (USBD_OK);
 }
 
 /**
-* @brief  CDC1_Itf_Control
+* @brief  CDC_Itf_Control
 *         Manage the CDC class requests
+* @param  linecoding: Line coding of the port the request is for
 * @param  Cmd: Command code
 * @param  Buf: Buffer containing command data (request parameters)
 * @param  Len: Number of data to be sent (in bytes)
 * @retval Result of the opeartion: USBD_OK if all operations are OK else USBD_FAIL
 */
-static int8_t CDC1_Itf_Control (uint8_t cmd, uint8_t* pbuf, uint16_t length)
+static int8_t CDC_Itf_Control (USBD_CDC_LineCodingTypeDef *linecoding,
+                               uint8_t cmd, uint8_t* pbuf, uint16_t length)
 {
     switch (cmd)
     {
@@ -173,21 +209,24 @@ static int8_t CDC1_Itf_Control (uint8_t cmd, uint8_t* pbuf, uint16_t length)
         break;
 
         case CDC_SET_LINE_CODING:
-            LineCoding_P1.bitrate    = (uint32_t)(pbuf[0] | (pbuf[1] << 8) |
-                                                  (pbuf[2] << 16) | (pbuf[3] << 24));
-            LineCoding_P1.format     = pbuf[4];
-            LineCoding_P1.paritytype = pbuf[5];
-            LineCoding_P1.datatype   = pbuf[6];
+            linecoding->bitrate    = (uint32_t)(pbuf[0] | (pbuf[1] << 8) |
+                                                (pbuf[2] << 16) | (pbuf[3] << 24));
+            linecoding->format     = pbuf[4];
+            linecoding->paritytype = pbuf[5];
+            linecoding->datatype   = pbuf[6];
+            /* A magic rate selects the self-test of the port */
+            SelfTest_LineCoding(DCDC_PORT1 + (linecoding - LineCoding),
+                                linecoding->bitrate);
             break;
 
         case CDC_GET_LINE_CODING:
-            pbuf[0] = (uint8_t)(LineCoding_P1.bitrate);
-            pbuf[1] = (uint8_t)(LineCoding_P1.bitrate >> 8);
-            pbuf[2] = (uint8_t)(LineCoding_P1.bitrate >> 16);
-            pbuf[3] = (uint8_t)(LineCoding_P1.bitrate >> 24);
-            pbuf[4] = LineCoding_P1.format;
-            pbuf[5] = LineCoding_P1.paritytype;
-            pbuf[6] = LineCoding_P1.datatype;
+            pbuf[0] = (uint8_t)(linecoding->bitrate);
+            pbuf[1] = (uint8_t)(linecoding->bitrate >> 8);
+            pbuf[2] = (uint8_t)(linecoding->bitrate >> 16);
+            pbuf[3] = (uint8_t)(linecoding->bitrate >> 24);
+            pbuf[4] = linecoding->format;
+            pbuf[5] = linecoding->paritytype;
+            pbuf[6] = linecoding->datatype;
             break;
 
         case CDC_SET_CONTROL_LINE_STATE:
@@ -206,121 +245,37 @@ static int8_t CDC1_Itf_Control (uint8_t cmd, uint8_t* pbuf, uint16_t length)
 }
 
 /**
-* @brief  CDC1_Itf_Receive
+* @brief  CDC_Itf_Receive
 *         Data received over USB OUT endpoint are sent over CDC interface
 *         through this function.
 * @param  Buf: Buffer of data to be transmitted
 * @param  Len: Number of data received (in bytes)
 * @retval Result of the opeartion: USBD_OK if all operations are OK else USBD_FAIL
 */
-static int8_t CDC1_Itf_Receive(uint8_t* Buf, uint32_t *Len)
-{
-    CDC1_DataLen = *Len;
-    strncpy(CDC1_Data, (const char*) Buf, CDC1_DataLen);
-    return (USBD_OK);
-}
-
-/**
-* @brief  CDC2_Itf_Init
-*         Initializes the CDC2 media low layer
-* @param  None
-* @retval Result of the opeartion: USBD_OK if all operations are OK else USBD_FAIL
-*/
-static int8_t CDC2_Itf_Init(void)
-{
-    return (USBD_OK);
-}
-
-/**
-* @brief  CDC2_Itf_DeInit
-*         DeInitializes the CDC media low layer
-* @param  None
-* @retval Result of the opeartion: USBD_OK if all operations are OK else USBD_FAIL
-*/
-static int8_t CDC2_Itf_DeInit(void)
+static int8_t CDC_Itf_Receive(uint8_t* Buf, uint32_t *Len)
 {
+    /* Buf is already queued in the port's Rx pool, CDC_Itf_ProcessData
+    takes it with DCDC_GetRxBuffer, or SelfTest_Process under self-test */
     return (USBD_OK);
 }
 
 /**
-* @brief  CDC2_Itf_Control
-*         Manage the CDC class requests
-* @param  Cmd: Command code
-* @param  Buf: Buffer containing command data (request parameters)
-* @param  Len: Number of data to be sent (in bytes)
-* @retval Result of the opeartion: USBD_OK if all operations are OK else USBD_FAIL
+* @brief  CDC_Itf_TxComplete
+*         A submitted buffer has been sent. Besides the self-test's own the
+*         demo only submits buffers borrowed from the peer port, so it goes
+*         back to that pool.
+* @param  com_port: Port the buffer was sent on
+* @param  Buf: Buffer that was transmitted
+* @param  Len: Number of data transmitted (in bytes)
+* @retval None
 */
-static int8_t CDC2_Itf_Control (uint8_t cmd, uint8_t* pbuf, uint16_t length)
+static void CDC_Itf_TxComplete(uint8_t com_port, uint8_t* Buf, uint32_t Len)
 {
-    switch (cmd)
+    if(SelfTest_TxComplete(com_port, Buf))
     {
-        case CDC_SEND_ENCAPSULATED_COMMAND:
-        /* Add your code here */
-        break;
-
-        case CDC_GET_ENCAPSULATED_RESPONSE:
-        /* Add your code here */
-        break;
-
-        case CDC_SET_COMM_FEATURE:
-        /* Add your code here */
-        break;
-
-        case CDC_GET_COMM_FEATURE:
-        /* Add your code here */
-        break;
-
-        case CDC_CLEAR_COMM_FEATURE:
-        /* Add your code here */
-        break;
-
-        case CDC_SET_LINE_CODING:
-            LineCoding_P2.bitrate    = (uint32_t)(pbuf[0] | (pbuf[1] << 8) |
-                                                  (pbuf[2] << 16) | (pbuf[3] << 24));
-            LineCoding_P2.format     = pbuf[4];
-            LineCoding_P2.paritytype = pbuf[5];
-            LineCoding_P2.datatype   = pbuf[6];
-            break;
-
-        case CDC_GET_LINE_CODING:
-            pbuf[0] = (uint8_t)(LineCoding_P2.bitrate);
-            pbuf[1] = (uint8_t)(LineCoding_P2.bitrate >> 8);
-            pbuf[2] = (uint8_t)(LineCoding_P2.bitrate >> 16);
-            pbuf[3] = (uint8_t)(LineCoding_P2.bitrate >> 24);
-            pbuf[4] = LineCoding_P2.format;
-            pbuf[5] = LineCoding_P2.paritytype;
-            pbuf[6] = LineCoding_P2.datatype;
-            break;
-
-        case CDC_SET_CONTROL_LINE_STATE:
-        /* Add your code here */
-        break;
-
-        case CDC_SEND_BREAK:
-        /* Add your code here */
-        break;
-
-        default:
-        break;
+        return;
     }
-
-    return (USBD_OK);
-}
-
-/**
-* @brief  CDC2_Itf_Receive
-*         Data received over USB OUT endpoint are sent over CDC interface
-*         through this function.
-* @param  Buf: Buffer of data to be transmitted
-* @param  Len: Number of data received (in bytes)
-* @retval Result of the opeartion: USBD_OK if all operations are OK else USBD_FAIL
-*/
-static int8_t CDC2_Itf_Receive(uint8_t* Buf, uint32_t *Len)
-{
-    CDC2_DataLen = *Len;
-    strncpy(CDC2_Data, (const char*) Buf, CDC2_DataLen);
-    return (USBD_OK);
+    DCDC_ReleaseRxBuffer(DCDC_PORT1 + CDC_PEER(com_port - DCDC_PORT1), Buf);
 }
 
 /************************ (C) COPYRIGHT STMicroelectronics *****END OF FILE****/
-
@@ -28,6 +28,7 @@
 /* Includes ------------------------------------------------------------------*/
 #include "stm32f4xx_hal.h"
 #include "usbd_core.h"
+#include "dualcdc.h"
 
 /* Private typedef -----------------------------------------------------------*/
 /* Private define ------------------------------------------------------------*/
@@ -79,8 +80,11 @@ void HAL_PCD_MspInit(PCD_HandleTypeDef *hpcd)
         /* Enable USB FS Clocks */
 	    __USB_OTG_FS_CLK_ENABLE();
 
-        /* Set USBFS Interrupt priority to 1 */
-        HAL_NVIC_SetPriority(OTG_FS_IRQn, 1, 0);
+        /* Set USBFS Interrupt priority, and the bottom half below it */
+        HAL_NVIC_SetPriority(OTG_FS_IRQn, DCDC_IRQ_PRIORITY, 0);
+#if (DCDC_DEFER == DCDC_DEFER_PENDSV)
+        HAL_NVIC_SetPriority(PendSV_IRQn, DCDC_BH_PRIORITY, 0);
+#endif
 
         /* Enable USBFS Interrupt */
         HAL_NVIC_EnableIRQ(OTG_FS_IRQn);
@@ -161,8 +165,11 @@ void HAL_PCD_MspInit(PCD_HandleTypeDef *hpcd)
         /* Enable USB HS Clocks */
 	    __USB_OTG_HS_CLK_ENABLE();
 
-        /* Set USBHS Interrupt priority to 1 */
-        HAL_NVIC_SetPriority(OTG_HS_IRQn, 1, 0);
+        /* Set USBHS Interrupt priority, and the bottom half below it */
+        HAL_NVIC_SetPriority(OTG_HS_IRQn, DCDC_IRQ_PRIORITY, 0);
+#if (DCDC_DEFER == DCDC_DEFER_PENDSV)
+        HAL_NVIC_SetPriority(PendSV_IRQn, DCDC_BH_PRIORITY, 0);
+#endif
 
         /* Enable USBHS Interrupt */
         HAL_NVIC_EnableIRQ(OTG_HS_IRQn);
@@ -202,6 +209,7 @@ LL Driver Callbacks (PCD -> USB Device Library)
 */
 void HAL_PCD_SetupStageCallback(PCD_HandleTypeDef *hpcd)
 {
+    USBTRACE(USBTRACE_SETUP, 0, ((uint8_t *)hpcd->Setup)[0] | (((uint8_t *)hpcd->Setup)[1] << 8));
     USBD_LL_SetupStage((USBD_HandleTypeDef*)hpcd->pData, (uint8_t *)hpcd->Setup);
 }
 
@@ -213,6 +221,7 @@ void HAL_PCD_SetupStageCallback(PCD_HandleTypeDef *hpcd)
 */
 void HAL_PCD_DataOutStageCallback(PCD_HandleTypeDef *hpcd, uint8_t epnum)
 {
+    USBTRACE(USBTRACE_DATAOUT, epnum, hpcd->OUT_ep[epnum].xfer_count);
     USBD_LL_DataOutStage((USBD_HandleTypeDef*)hpcd->pData, epnum, hpcd->OUT_ep[epnum].xfer_buff);
 }
 
@@ -224,6 +233,7 @@ void HAL_PCD_DataOutStageCallback(PCD_HandleTypeDef *hpcd, uint8_t epnum)
 */
 void HAL_PCD_DataInStageCallback(PCD_HandleTypeDef *hpcd, uint8_t epnum)
 {
+    USBTRACE(USBTRACE_DATAIN, 0x80 | epnum, hpcd->IN_ep[epnum].xfer_count);
     USBD_LL_DataInStage((USBD_HandleTypeDef*)hpcd->pData, epnum, hpcd->IN_ep[epnum].xfer_buff);
 }
 
@@ -234,6 +244,8 @@ void HAL_PCD_DataInStageCallback(PCD_HandleTypeDef *hpcd, uint8_t epnum)
 */
 void HAL_PCD_SOFCallback(PCD_HandleTypeDef *hpcd)
 {
+    USBTRACE(USBTRACE_SOF, 0, (((USB_OTG_DeviceTypeDef *)((uint32_t)hpcd->Instance + USB_OTG_DEVICE_BASE))->DSTS &
+                               USB_OTG_DSTS_FNSOF) >> 8);
     USBD_LL_SOF((USBD_HandleTypeDef*)hpcd->pData);
 }
 
@@ -262,6 +274,7 @@ void HAL_PCD_ResetCallback(PCD_HandleTypeDef *hpcd)
         break;
     }
     USBD_LL_SetSpeed((USBD_HandleTypeDef*)hpcd->pData, speed);
+    USBTRACE(USBTRACE_RESET, 0, speed);
 
     /* Reset Device */
     USBD_LL_Reset((USBD_HandleTypeDef*)hpcd->pData);
@@ -274,6 +287,7 @@ void HAL_PCD_ResetCallback(PCD_HandleTypeDef *hpcd)
 */
 void HAL_PCD_SuspendCallback(PCD_HandleTypeDef *hpcd)
 {
+    USBTRACE(USBTRACE_SUSPEND, 0, 0);
     USBD_LL_Suspend((USBD_HandleTypeDef*)hpcd->pData);
 }
 
@@ -284,6 +298,7 @@ void HAL_PCD_SuspendCallback(PCD_HandleTypeDef *hpcd)
 */
 void HAL_PCD_ResumeCallback(PCD_HandleTypeDef *hpcd)
 {
+    USBTRACE(USBTRACE_RESUME, 0, 0);
     USBD_LL_Resume((USBD_HandleTypeDef*)hpcd->pData);
 }
 
@@ -306,6 +321,7 @@ void HAL_PCD_ISOOUTIncompleteCallback(PCD_HandleTypeDef *hpcd, uint8_t epnum)
 */
 void HAL_PCD_ISOINIncompleteCallback(PCD_HandleTypeDef *hpcd, uint8_t epnum)
 {
+    USBTRACE(USBTRACE_ISOINCOMP, 0x80 | epnum, 0);
     USBD_LL_IsoINIncomplete((USBD_HandleTypeDef*)hpcd->pData, epnum);
 }
 
@@ -316,6 +332,7 @@ void HAL_PCD_ISOINIncompleteCallback(PCD_HandleTypeDef *hpcd, uint8_t epnum)
 */
 void HAL_PCD_ConnectCallback(PCD_HandleTypeDef *hpcd)
 {
+    USBTRACE(USBTRACE_CONNECT, 0, 0);
     USBD_LL_DevConnected((USBD_HandleTypeDef*)hpcd->pData);
 }
 
@@ -326,6 +343,7 @@ void HAL_PCD_ConnectCallback(PCD_HandleTypeDef *hpcd)
 */
 void HAL_PCD_DisconnectCallback(PCD_HandleTypeDef *hpcd)
 {
+    USBTRACE(USBTRACE_DISCONNECT, 0, 0);
     USBD_LL_DevDisconnected((USBD_HandleTypeDef*)hpcd->pData);
 }
 
@@ -339,16 +357,18 @@ LL Driver Interface (USB Device Library --> PCD)
 */
 USBD_StatusTypeDef  USBD_LL_Init (USBD_HandleTypeDef *pdev)
 {
+    uint8_t p;
+
 #ifdef USE_USB_FS
     /*Set LL Driver parameters */
     hpcd.Instance = USB_OTG_FS;
-    hpcd.Init.dev_endpoints = 4;
+    hpcd.Init.dev_endpoints = DCDC_DEV_ENDPOINTS;
     hpcd.Init.use_dedicated_ep1 = 0;
     hpcd.Init.ep0_mps = 0x40;
     hpcd.Init.dma_enable = 0;
     hpcd.Init.low_power_enable = 0;
     hpcd.Init.phy_itface = PCD_PHY_EMBEDDED;
-    hpcd.Init.Sof_enable = 1;
+    hpcd.Init.Sof_enable = 0;   /* Unmasked on demand, USBD_LL_EnableSOF */
     hpcd.Init.speed = PCD_SPEED_FULL;
     hpcd.Init.vbus_sensing_enable = DISABLE;
     /* Link The driver to the stack */
@@ -356,25 +376,18 @@ USBD_StatusTypeDef  USBD_LL_Init (USBD_HandleTypeDef *pdev)
     pdev->pData = &hpcd;
     /*Initialize LL Driver */
     HAL_PCD_Init(&hpcd);
-
-    HAL_PCDEx_SetRxFiFo(&hpcd, 0x80);
-    HAL_PCDEx_SetTxFiFo(&hpcd, 0, 0x40);
-    HAL_PCDEx_SetTxFiFo(&hpcd, 1, 0x80);
-
 #endif
 #ifdef USE_USB_HS
     /*Set LL Driver parameters */
     hpcd.Instance = USB_OTG_HS;
-    hpcd.Init.dev_endpoints = 6;
+    hpcd.Init.dev_endpoints = DCDC_DEV_ENDPOINTS;
     hpcd.Init.use_dedicated_ep1 = 0;
     hpcd.Init.ep0_mps = 0x40;
 
-    /* Be aware that enabling USB-DMA mode will result in data being sent only by
-    multiple of 4 packet sizes. This is due to the fact that USB DMA does
-    not allow sending data from non word-aligned addresses.
-    For this specific application, it is advised to not enable this option
-    unless required. */
-    hpcd.Init.dma_enable = 0;
+    /* USB-DMA mode can only move data from and to word-aligned addresses.
+    It is selected with USBD_DMA_ENABLE in usbd_conf.h, the DCDC class keeps
+    its buffers aligned and bounces unaligned Tx data. */
+    hpcd.Init.dma_enable = USBD_DMA_ENABLE;
     hpcd.Init.low_power_enable = 0;
 
 #ifdef USE_USB_HS_IN_FS
@@ -384,7 +397,7 @@ USBD_StatusTypeDef  USBD_LL_Init (USBD_HandleTypeDef *pdev)
     hpcd.Init.phy_itface = PCD_PHY_ULPI;
     hpcd.Init.speed = PCD_SPEED_HIGH;
 #endif
-    hpcd.Init.Sof_enable = 1;
+    hpcd.Init.Sof_enable = 0;   /* Unmasked on demand, USBD_LL_EnableSOF */
     hpcd.Init.vbus_sensing_enable = DISABLE;
 
     /* Link The driver to the stack */
@@ -392,15 +405,18 @@ USBD_StatusTypeDef  USBD_LL_Init (USBD_HandleTypeDef *pdev)
     pdev->pData = &hpcd;
     /*Initialize LL Driver */
     HAL_PCD_Init(&hpcd);
+#endif
 
-    HAL_PCDEx_SetRxFiFo(&hpcd, 0x200);
-    HAL_PCDEx_SetTxFiFo(&hpcd, 0, 0x0040);
-    HAL_PCDEx_SetTxFiFo(&hpcd, 1, 0x0040);
-    HAL_PCDEx_SetTxFiFo(&hpcd, 2, 0x00A0);
-    HAL_PCDEx_SetTxFiFo(&hpcd, 3, 0x0040);
-    HAL_PCDEx_SetTxFiFo(&hpcd, 4, 0x00A0);
+    /* FIFO layout planned in dualcdc.h. Tx FIFOs are placed in index order,
+    ports take consecutive endpoints so the used FIFOs stay packed. */
+    HAL_PCDEx_SetRxFiFo(&hpcd, DCDC_RXFIFO_WORDS);
+    HAL_PCDEx_SetTxFiFo(&hpcd, 0, DCDC_EP0_TXFIFO_WORDS);
+    for(p = 0; p < DCDC_NUM_PORTS; p++)
+    {
+        HAL_PCDEx_SetTxFiFo(&hpcd, DCDC_INTRIN_EP(p) & 0x0F, DCDC_CMD_TXFIFO_WORDS);
+        HAL_PCDEx_SetTxFiFo(&hpcd, DCDC_BULKIN_EP(p) & 0x0F, DCDC_BULKIN_TXFIFO_WORDS(p));
+    }
 
-#endif
     return USBD_OK;
 }
 
@@ -545,7 +561,7 @@ USBD_StatusTypeDef USBD_LL_SetUSBAddress(USBD_HandleTypeDef *pdev, uint8_t dev_a
 USBD_StatusTypeDef USBD_LL_Transmit(USBD_HandleTypeDef *pdev,
                                     uint8_t  ep_addr,
                                     uint8_t  *pbuf,
-                                    uint16_t  size)
+                                    uint32_t  size)
 {
     HAL_PCD_EP_Transmit((PCD_HandleTypeDef*)pdev->pData, ep_addr, pbuf, size);
     return USBD_OK;
@@ -568,6 +584,28 @@ USBD_StatusTypeDef USBD_LL_PrepareReceive(USBD_HandleTypeDef *pdev,
     return USBD_OK;
 }
 
+/**
+* @brief  Ends an OUT transfer before it fills, for hosts that send no ZLP
+*         after a write of whole packets. Called with the USB interrupt
+*         held off or from it.
+* @param  pdev: Device handle
+* @param  ep_addr: Endpoint Number
+* @retval USBD_OK when stopped, USBD_LL_GetRxDataSize then gives the bytes
+*         received. USBD_BUSY when it completed first, its DataOut follows.
+*/
+USBD_StatusTypeDef USBD_LL_EndReceive(USBD_HandleTypeDef *pdev, uint8_t ep_addr)
+{
+    switch(HAL_PCD_EP_EndReceive((PCD_HandleTypeDef*)pdev->pData, ep_addr))
+    {
+    case HAL_OK:
+        return USBD_OK;
+    case HAL_BUSY:
+        return USBD_BUSY;
+    default:
+        return USBD_FAIL;
+    }
+}
+
 /**
 * @brief  Returns the last transfered packet size.
 * @param  pdev: Device handle
@@ -579,6 +617,29 @@ uint32_t USBD_LL_GetRxDataSize(USBD_HandleTypeDef *pdev, uint8_t  ep_addr)
     return HAL_PCD_EP_GetRxCount((PCD_HandleTypeDef*)pdev->pData, ep_addr);
 }
 
+/**
+* @brief  Masks or unmasks the SOF interrupt. Only frame timed class work
+*         needs it, so it stays off while idle. Called with the USB
+*         interrupt held off or from it, GINTMSK is also changed there.
+* @param  pdev: Device handle
+* @param  enable: 1 to unmask, 0 to mask
+* @retval USBD Status
+*/
+USBD_StatusTypeDef USBD_LL_EnableSOF(USBD_HandleTypeDef *pdev, uint8_t enable)
+{
+    PCD_HandleTypeDef *hpcd = (PCD_HandleTypeDef*)pdev->pData;
+
+    if(enable)
+    {
+        hpcd->Instance->GINTMSK |= USB_OTG_GINTMSK_SOFM;
+    }
+    else
+    {
+        hpcd->Instance->GINTMSK &= ~USB_OTG_GINTMSK_SOFM;
+    }
+    return USBD_OK;
+}
+
 /**
 * @brief  Delay routine for the USB Device Library
 * @param  Delay: Delay in ms
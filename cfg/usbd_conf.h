@@ -38,13 +38,27 @@
 /* Exported types ------------------------------------------------------------*/
 /* Exported constants --------------------------------------------------------*/
 /* Common Config */
-#define USBD_MAX_NUM_INTERFACES               2
+#define USBD_MAX_NUM_INTERFACES               8    /* Two per DCDC port */
 #define USBD_MAX_NUM_CONFIGURATION            1
 #define USBD_MAX_STR_DESC_SIZ                 0x100
 #define USBD_SUPPORT_USER_STRING              0
 #define USBD_SELF_POWERED                     1
 #define USBD_DEBUG_LEVEL                      0
 
+/* OTG HS internal DMA. The core then moves packets between the FIFOs and
+   memory by itself, but only to and from word aligned addresses in SRAM1/2,
+   not CCM. Class buffers are aligned for it and unaligned Tx data is staged
+   through a bounce buffer. Not available on the OTG FS core. Per MB looped
+   back in the sim, slave mode has the CPU copy 250000 FIFO words in 2268
+   interrupts, DMA mode no words in 404 (sim_otg against sim_otg_dma). */
+#ifndef USBD_DMA_ENABLE
+#define USBD_DMA_ENABLE                       0
+#endif
+
+#if defined(USE_USB_FS) && (USBD_DMA_ENABLE != 0)
+#error "USBD_DMA_ENABLE needs the OTG HS core"
+#endif
+
 /* Exported macro ------------------------------------------------------------*/
 /* Memory management macros */
 
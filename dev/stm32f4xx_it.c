@@ -24,6 +24,7 @@
 /* Includes ------------------------------------------------------------------*/
 #include "main.h"
 #include "stm32f4xx_it.h"
+#include "dualcdc.h"
 
 /* Private typedef -----------------------------------------------------------*/
 /* Private define ------------------------------------------------------------*/
@@ -126,6 +127,10 @@ void DebugMon_Handler(void)
 */
 void PendSV_Handler(void)
 {
+#if (DCDC_DEFER == DCDC_DEFER_PENDSV)
+    // USB class bottom half
+    DCDC_ProcessEvents();
+#endif
 }
 
 /**
@@ -158,7 +163,10 @@ void OTG_FS_IRQHandler(void)
 void OTG_HS_IRQHandler(void)
 #endif
 {
+    CYCPROF_START(irq);
+    CYCPROF_ENTRY();
     HAL_PCD_IRQHandler(&hpcd);
+    CYCPROF_STOP(irq, CYCPROF_IRQ);
 }
 
 /******************* (C) COPYRIGHT 2011 STMicroelectronics *****END OF FILE****/
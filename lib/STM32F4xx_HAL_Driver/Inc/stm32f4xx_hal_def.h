@@ -150,7 +150,7 @@ typedef enum
     #if defined   (__CC_ARM)      /* ARM Compiler */
       #define __ALIGN_BEGIN    __align(4)
     #elif defined (__ICCARM__)    /* IAR Compiler */
-      #define __ALIGN_BEGIN
+      #define __ALIGN_BEGIN    _Pragma("data_alignment=4")
     #endif /* __CC_ARM */
   #endif /* __ALIGN_BEGIN */
 #endif /* __GNUC__ */
@@ -107,6 +107,7 @@
   * @{
   */
 static HAL_StatusTypeDef PCD_WriteEmptyTxFifo(PCD_HandleTypeDef *hpcd, uint32_t epnum);
+static void PCD_ReadRxFifo(PCD_HandleTypeDef *hpcd);
 /**
   * @}
   */
@@ -322,113 +323,133 @@ void HAL_PCD_IRQHandler(PCD_HandleTypeDef *hpcd)
 {
   USB_OTG_GlobalTypeDef *USBx = hpcd->Instance;
   uint32_t i = 0, ep_intr = 0, epint = 0, epnum = 0;
-  uint32_t fifoemptymsk = 0, temp = 0;
-  USB_OTG_EPTypeDef *ep;
+  uint32_t fifoemptymsk = 0, temp = 0, gintsts = 0;
 
   /* ensure that we are in device mode */
   if (USB_GetMode(hpcd->Instance) == USB_OTG_MODE_DEVICE)
   {
+    /* Pending and enabled causes are read once, anything raised while they
+       are handled keeps the interrupt pending for the next entry */
+    gintsts = USB_ReadInterrupts(hpcd->Instance);
+
     /* avoid spurious interrupt */
-    if(__HAL_PCD_IS_INVALID_INTERRUPT(hpcd))
+    if(gintsts == 0)
     {
       return;
     }
 
-    if(__HAL_PCD_GET_FLAG(hpcd, USB_OTG_GINTSTS_MMIS))
+    if((gintsts & USB_OTG_GINTSTS_MMIS) != 0)
     {
      /* incorrect mode, acknowledge the interrupt */
       __HAL_PCD_CLEAR_FLAG(hpcd, USB_OTG_GINTSTS_MMIS);
     }
 
-    if(__HAL_PCD_GET_FLAG(hpcd, USB_OTG_GINTSTS_OEPINT))
+    if((gintsts & USB_OTG_GINTSTS_OEPINT) != 0)
     {
-      epnum = 0;
-
       /* Read in the device interrupt bits */
       ep_intr = USB_ReadDevAllOutEpInterrupt(hpcd->Instance);
 
+      /* Visit pending endpoints only, lowest number first */
       while ( ep_intr )
       {
-        if (ep_intr & 0x1)
+        epnum = __CLZ(__RBIT(ep_intr));
+        ep_intr &= ~(1U << epnum);
+        epint = USB_ReadDevOutEPInterrupt(hpcd->Instance, epnum);
+
+        if(( epint & USB_OTG_DOEPINT_XFRC) == USB_OTG_DOEPINT_XFRC)
         {
-          epint = USB_ReadDevOutEPInterrupt(hpcd->Instance, epnum);
+          CLEAR_OUT_EP_INTR(epnum, USB_OTG_DOEPINT_XFRC);
 
-          if(( epint & USB_OTG_DOEPINT_XFRC) == USB_OTG_DOEPINT_XFRC)
+          if(hpcd->Init.dma_enable == 1)
           {
-            CLEAR_OUT_EP_INTR(epnum, USB_OTG_DOEPINT_XFRC);
-
-            if(hpcd->Init.dma_enable == 1)
+            /* USB_EPStartXfer programs whole packets, EP0 one at a time */
+            temp = hpcd->OUT_ep[epnum].maxpacket;
+            if((epnum != 0) && (hpcd->OUT_ep[epnum].xfer_len != 0))
             {
-              hpcd->OUT_ep[epnum].xfer_count = hpcd->OUT_ep[epnum].maxpacket- (USBx_OUTEP(epnum)->DOEPTSIZ & USB_OTG_DOEPTSIZ_XFRSIZ);
-              hpcd->OUT_ep[epnum].xfer_buff += hpcd->OUT_ep[epnum].maxpacket;
+              temp *= (hpcd->OUT_ep[epnum].xfer_len + hpcd->OUT_ep[epnum].maxpacket - 1) / hpcd->OUT_ep[epnum].maxpacket;
             }
+            hpcd->OUT_ep[epnum].xfer_count = temp - (USBx_OUTEP(epnum)->DOEPTSIZ & USB_OTG_DOEPTSIZ_XFRSIZ);
+            hpcd->OUT_ep[epnum].xfer_buff += hpcd->OUT_ep[epnum].xfer_count;
+          }
 
-            HAL_PCD_DataOutStageCallback(hpcd, epnum);
-            if(hpcd->Init.dma_enable == 1)
+          HAL_PCD_DataOutStageCallback(hpcd, epnum);
+          if(hpcd->Init.dma_enable == 1)
+          {
+            if((epnum == 0) && (hpcd->OUT_ep[epnum].xfer_len == 0))
             {
-              if((epnum == 0) && (hpcd->OUT_ep[epnum].xfer_len == 0))
-              {
-                 /* this is ZLP, so prepare EP0 for next setup */
-                USB_EP0_OutStart(hpcd->Instance, 1, (uint8_t *)hpcd->Setup);
-              }
+               /* this is ZLP, so prepare EP0 for next setup */
+              USB_EP0_OutStart(hpcd->Instance, 1, (uint8_t *)hpcd->Setup);
             }
           }
+        }
 
-          if(( epint & USB_OTG_DOEPINT_STUP) == USB_OTG_DOEPINT_STUP)
-          {
-            /* Inform the upper layer that a setup packet is available */
-            HAL_PCD_SetupStageCallback(hpcd);
-            CLEAR_OUT_EP_INTR(epnum, USB_OTG_DOEPINT_STUP);
-          }
+        if(( epint & USB_OTG_DOEPINT_STUP) == USB_OTG_DOEPINT_STUP)
+        {
+          /* Inform the upper layer that a setup packet is available */
+          HAL_PCD_SetupStageCallback(hpcd);
+          CLEAR_OUT_EP_INTR(epnum, USB_OTG_DOEPINT_STUP);
+        }
 
-          if(( epint & USB_OTG_DOEPINT_OTEPDIS) == USB_OTG_DOEPINT_OTEPDIS)
-          {
-            CLEAR_OUT_EP_INTR(epnum, USB_OTG_DOEPINT_OTEPDIS);
-          }
+        if(( epint & USB_OTG_DOEPINT_OTEPDIS) == USB_OTG_DOEPINT_OTEPDIS)
+        {
+          CLEAR_OUT_EP_INTR(epnum, USB_OTG_DOEPINT_OTEPDIS);
+        }
+
+        /* HAL_PCD_EP_EndReceive acknowledges its own disable, this only
+           keeps a stray one from holding the interrupt pending */
+        if(( epint & USB_OTG_DOEPINT_EPDISD) == USB_OTG_DOEPINT_EPDISD)
+        {
+          CLEAR_OUT_EP_INTR(epnum, USB_OTG_DOEPINT_EPDISD);
         }
-        epnum++;
-        ep_intr >>= 1;
       }
     }
 
-    if(__HAL_PCD_GET_FLAG(hpcd, USB_OTG_GINTSTS_IEPINT))
+    if((gintsts & USB_OTG_GINTSTS_IEPINT) != 0)
     {
       /* Read in the device interrupt bits */
       ep_intr = USB_ReadDevAllInEpInterrupt(hpcd->Instance);
 
-      epnum = 0;
-
+      /* Visit pending endpoints only, lowest number first */
       while ( ep_intr )
       {
-        if (ep_intr & 0x1) /* In ITR */
-        {
-          epint = USB_ReadDevInEPInterrupt(hpcd->Instance, epnum);
+        epnum = __CLZ(__RBIT(ep_intr));
+        ep_intr &= ~(1U << epnum);
+        epint = USB_ReadDevInEPInterrupt(hpcd->Instance, epnum);
 
-           if(( epint & USB_OTG_DIEPINT_XFRC) == USB_OTG_DIEPINT_XFRC)
-          {
-            fifoemptymsk = 0x1 << epnum;
-            USBx_DEVICE->DIEPEMPMSK &= ~fifoemptymsk;
+         if(( epint & USB_OTG_DIEPINT_XFRC) == USB_OTG_DIEPINT_XFRC)
+        {
+          fifoemptymsk = 0x1 << epnum;
+          USBx_DEVICE->DIEPEMPMSK &= ~fifoemptymsk;
 
-            CLEAR_IN_EP_INTR(epnum, USB_OTG_DIEPINT_XFRC);
+          CLEAR_IN_EP_INTR(epnum, USB_OTG_DIEPINT_XFRC);
 
-            if (hpcd->Init.dma_enable == 1)
-            {
-              hpcd->IN_ep[epnum].xfer_buff += hpcd->IN_ep[epnum].maxpacket;
-            }
+          if (hpcd->Init.dma_enable == 1)
+          {
+            hpcd->IN_ep[epnum].xfer_buff += hpcd->IN_ep[epnum].maxpacket;
+          }
 
-            HAL_PCD_DataInStageCallback(hpcd, epnum);
+          HAL_PCD_DataInStageCallback(hpcd, epnum);
 
-            if (hpcd->Init.dma_enable == 1)
+          if (hpcd->Init.dma_enable == 1)
+          {
+            /* this is ZLP, so prepare EP0 for next setup */
+            if((epnum == 0) && (hpcd->IN_ep[epnum].xfer_len == 0))
             {
-              /* this is ZLP, so prepare EP0 for next setup */
-              if((epnum == 0) && (hpcd->IN_ep[epnum].xfer_len == 0))
-              {
-                /* prepare to rx more setup packets */
-                USB_EP0_OutStart(hpcd->Instance, 1, (uint8_t *)hpcd->Setup);
-              }
+              /* prepare to rx more setup packets */
+              USB_EP0_OutStart(hpcd->Instance, 1, (uint8_t *)hpcd->Setup);
             }
           }
-           if(( epint & USB_OTG_DIEPINT_TOC) == USB_OTG_DIEPINT_TOC)
+        }
+        if(( epint & USB_OTG_DIEPINT_TXFE) == USB_OTG_DIEPINT_TXFE)
+        {
+          PCD_WriteEmptyTxFifo(hpcd , epnum);
+        }
+
+        /* Rare causes, only acknowledged */
+        if(( epint & (USB_OTG_DIEPINT_TOC | USB_OTG_DIEPINT_ITTXFE |
+                      USB_OTG_DIEPINT_INEPNE | USB_OTG_DIEPINT_EPDISD)) != 0)
+        {
+          if(( epint & USB_OTG_DIEPINT_TOC) == USB_OTG_DIEPINT_TOC)
           {
             CLEAR_IN_EP_INTR(epnum, USB_OTG_DIEPINT_TOC);
           }
@@ -444,18 +465,12 @@ void HAL_PCD_IRQHandler(PCD_HandleTypeDef *hpcd)
           {
             CLEAR_IN_EP_INTR(epnum, USB_OTG_DIEPINT_EPDISD);
           }
-          if(( epint & USB_OTG_DIEPINT_TXFE) == USB_OTG_DIEPINT_TXFE)
-          {
-            PCD_WriteEmptyTxFifo(hpcd , epnum);
-          }
         }
-        epnum++;
-        ep_intr >>= 1;
       }
     }
 
     /* Handle Resume Interrupt */
-    if(__HAL_PCD_GET_FLAG(hpcd, USB_OTG_GINTSTS_WKUINT))
+    if((gintsts & USB_OTG_GINTSTS_WKUINT) != 0)
     {
       /* Clear the Remote Wake-up Signaling */
       USBx_DEVICE->DCTL &= ~USB_OTG_DCTL_RWUSIG;
@@ -476,7 +491,7 @@ void HAL_PCD_IRQHandler(PCD_HandleTypeDef *hpcd)
     }
 
     /* Handle Suspend Interrupt */
-    if(__HAL_PCD_GET_FLAG(hpcd, USB_OTG_GINTSTS_USBSUSP))
+    if((gintsts & USB_OTG_GINTSTS_USBSUSP) != 0)
     {
       if((USBx_DEVICE->DSTS & USB_OTG_DSTS_SUSPSTS) == USB_OTG_DSTS_SUSPSTS)
       {
@@ -488,7 +503,7 @@ void HAL_PCD_IRQHandler(PCD_HandleTypeDef *hpcd)
 
 #ifdef USB_OTG_GLPMCFG_LPMEN
     /* Handle LPM Interrupt */
-    if(__HAL_PCD_GET_FLAG(hpcd, USB_OTG_GINTSTS_LPMINT))
+    if((gintsts & USB_OTG_GINTSTS_LPMINT) != 0)
     {
       __HAL_PCD_CLEAR_FLAG(hpcd, USB_OTG_GINTSTS_LPMINT);
       if( hpcd->LPM_State == LPM_L0)
@@ -505,7 +520,7 @@ void HAL_PCD_IRQHandler(PCD_HandleTypeDef *hpcd)
 #endif /* USB_OTG_GLPMCFG_LPMEN */
 
     /* Handle Reset Interrupt */
-    if(__HAL_PCD_GET_FLAG(hpcd, USB_OTG_GINTSTS_USBRST))
+    if((gintsts & USB_OTG_GINTSTS_USBRST) != 0)
     {
       USBx_DEVICE->DCTL &= ~USB_OTG_DCTL_RWUSIG;
       USB_FlushTxFifo(hpcd->Instance ,  0 );
@@ -539,7 +554,7 @@ void HAL_PCD_IRQHandler(PCD_HandleTypeDef *hpcd)
     }
 
     /* Handle Enumeration done Interrupt */
-    if(__HAL_PCD_GET_FLAG(hpcd, USB_OTG_GINTSTS_ENUMDNE))
+    if((gintsts & USB_OTG_GINTSTS_ENUMDNE) != 0)
     {
       USB_ActivateSetup(hpcd->Instance);
       hpcd->Instance->GUSBCFG &= ~USB_OTG_GUSBCFG_TRDT;
@@ -563,61 +578,43 @@ void HAL_PCD_IRQHandler(PCD_HandleTypeDef *hpcd)
     }
 
     /* Handle RxQLevel Interrupt */
-    if(__HAL_PCD_GET_FLAG(hpcd, USB_OTG_GINTSTS_RXFLVL))
+    if((gintsts & USB_OTG_GINTSTS_RXFLVL) != 0)
     {
       USB_MASK_INTERRUPT(hpcd->Instance, USB_OTG_GINTSTS_RXFLVL);
-
-      temp = USBx->GRXSTSP;
-
-      ep = &hpcd->OUT_ep[temp & USB_OTG_GRXSTSP_EPNUM];
-
-      if(((temp & USB_OTG_GRXSTSP_PKTSTS) >> 17) ==  STS_DATA_UPDT)
-      {
-        if((temp & USB_OTG_GRXSTSP_BCNT) != 0)
-        {
-          USB_ReadPacket(USBx, ep->xfer_buff, (temp & USB_OTG_GRXSTSP_BCNT) >> 4);
-          ep->xfer_buff += (temp & USB_OTG_GRXSTSP_BCNT) >> 4;
-          ep->xfer_count += (temp & USB_OTG_GRXSTSP_BCNT) >> 4;
-        }
-      }
-      else if (((temp & USB_OTG_GRXSTSP_PKTSTS) >> 17) ==  STS_SETUP_UPDT)
-      {
-        USB_ReadPacket(USBx, (uint8_t *)hpcd->Setup, 8);
-        ep->xfer_count += (temp & USB_OTG_GRXSTSP_BCNT) >> 4;
-      }
+      PCD_ReadRxFifo(hpcd);
       USB_UNMASK_INTERRUPT(hpcd->Instance, USB_OTG_GINTSTS_RXFLVL);
     }
 
     /* Handle SOF Interrupt */
-    if(__HAL_PCD_GET_FLAG(hpcd, USB_OTG_GINTSTS_SOF))
+    if((gintsts & USB_OTG_GINTSTS_SOF) != 0)
     {
       HAL_PCD_SOFCallback(hpcd);
       __HAL_PCD_CLEAR_FLAG(hpcd, USB_OTG_GINTSTS_SOF);
     }
 
     /* Handle Incomplete ISO IN Interrupt */
-    if(__HAL_PCD_GET_FLAG(hpcd, USB_OTG_GINTSTS_IISOIXFR))
+    if((gintsts & USB_OTG_GINTSTS_IISOIXFR) != 0)
     {
       HAL_PCD_ISOINIncompleteCallback(hpcd, epnum);
       __HAL_PCD_CLEAR_FLAG(hpcd, USB_OTG_GINTSTS_IISOIXFR);
     }
 
     /* Handle Incomplete ISO OUT Interrupt */
-    if(__HAL_PCD_GET_FLAG(hpcd, USB_OTG_GINTSTS_PXFR_INCOMPISOOUT))
+    if((gintsts & USB_OTG_GINTSTS_PXFR_INCOMPISOOUT) != 0)
     {
       HAL_PCD_ISOOUTIncompleteCallback(hpcd, epnum);
       __HAL_PCD_CLEAR_FLAG(hpcd, USB_OTG_GINTSTS_PXFR_INCOMPISOOUT);
     }
 
     /* Handle Connection event Interrupt */
-    if(__HAL_PCD_GET_FLAG(hpcd, USB_OTG_GINTSTS_SRQINT))
+    if((gintsts & USB_OTG_GINTSTS_SRQINT) != 0)
     {
       HAL_PCD_ConnectCallback(hpcd);
       __HAL_PCD_CLEAR_FLAG(hpcd, USB_OTG_GINTSTS_SRQINT);
     }
 
     /* Handle Disconnection event Interrupt */
-    if(__HAL_PCD_GET_FLAG(hpcd, USB_OTG_GINTSTS_OTGINT))
+    if((gintsts & USB_OTG_GINTSTS_OTGINT) != 0)
     {
       temp = hpcd->Instance->GOTGINT;
 
@@ -937,6 +934,84 @@ HAL_StatusTypeDef HAL_PCD_EP_Receive(PCD_HandleTypeDef *hpcd, uint8_t ep_addr, u
   return HAL_OK;
 }
 
+/**
+  * @brief  End an armed OUT transfer early, keeping what has arrived.
+  *         Follows the reference manual's OUT endpoint disable sequence:
+  *         global OUT NAK, EPDIS with SNAK, then release the global NAK.
+  *         The host is NAKed until the endpoint is armed again.
+  * @param  hpcd: PCD handle
+  * @param  ep_addr: endpoint address
+  * @retval HAL_OK when the transfer was stopped, HAL_PCD_EP_GetRxCount then
+  *         gives the bytes received. HAL_BUSY when it had already completed,
+  *         its DataOut stage callback is still to come.
+  */
+HAL_StatusTypeDef HAL_PCD_EP_EndReceive(PCD_HandleTypeDef *hpcd, uint8_t ep_addr)
+{
+  USB_OTG_GlobalTypeDef *USBx = hpcd->Instance;
+  USB_OTG_EPTypeDef *ep;
+  HAL_StatusTypeDef ret = HAL_OK;
+  uint32_t epnum = ep_addr & 0x7F;
+  uint32_t count = 0;
+  uint32_t pktcnt;
+
+  ep = &hpcd->OUT_ep[epnum];
+
+  if((USBx_OUTEP(epnum)->DOEPCTL & USB_OTG_DOEPCTL_EPENA) == 0)
+  {
+    return HAL_BUSY;
+  }
+
+  /* In slave mode the NAK takes effect once its status entry is popped, so
+     the packets ahead of it are copied out on the way */
+  USBx_DEVICE->DCTL |= USB_OTG_DCTL_SGONAK;
+  while((USBx->GINTSTS & USB_OTG_GINTSTS_BOUTNAKEFF) == 0)
+  {
+    if(++count > 200000)
+    {
+      USBx_DEVICE->DCTL |= USB_OTG_DCTL_CGONAK;
+      return HAL_TIMEOUT;
+    }
+    if((hpcd->Init.dma_enable == 0) && ((USBx->GINTSTS & USB_OTG_GINTSTS_RXFLVL) != 0))
+    {
+      PCD_ReadRxFifo(hpcd);
+    }
+  }
+
+  /* The last packet may have completed the transfer before the NAK */
+  if((USBx_OUTEP(epnum)->DOEPCTL & USB_OTG_DOEPCTL_EPENA) == 0)
+  {
+    ret = HAL_BUSY;
+  }
+  else
+  {
+    USBx_OUTEP(epnum)->DOEPCTL |= USB_OTG_DOEPCTL_SNAK | USB_OTG_DOEPCTL_EPDIS;
+
+    count = 0;
+    while((USBx_OUTEP(epnum)->DOEPINT & USB_OTG_DOEPINT_EPDISD) == 0)
+    {
+      if(++count > 200000)
+      {
+        ret = HAL_TIMEOUT;
+        break;
+      }
+    }
+    CLEAR_OUT_EP_INTR(epnum, USB_OTG_DOEPINT_EPDISD);
+
+    if(hpcd->Init.dma_enable == 1)
+    {
+      /* Only whole packets are left when the transfer is cut short */
+      pktcnt = (ep->xfer_len + ep->maxpacket - 1) / ep->maxpacket;
+      pktcnt -= (USBx_OUTEP(epnum)->DOEPTSIZ & USB_OTG_DOEPTSIZ_PKTCNT) >> 19;
+      ep->xfer_count = pktcnt * ep->maxpacket;
+      ep->xfer_buff += ep->xfer_count;
+    }
+  }
+
+  USBx_DEVICE->DCTL |= USB_OTG_DCTL_CGONAK;
+
+  return ret;
+}
+
 /**
   * @brief  Get Received Data Size.
   * @param  hpcd: PCD handle
@@ -1159,26 +1234,19 @@ static HAL_StatusTypeDef PCD_WriteEmptyTxFifo(PCD_HandleTypeDef *hpcd, uint32_t
 {
   USB_OTG_GlobalTypeDef *USBx = hpcd->Instance;
   USB_OTG_EPTypeDef *ep;
-  int32_t len = 0;
+  uint32_t len = 0;
   uint32_t len32b;
+  uint32_t space32b;
   uint32_t fifoemptymsk = 0;
 
   ep = &hpcd->IN_ep[epnum];
-  len = ep->xfer_len - ep->xfer_count;
 
-  if (len > ep->maxpacket)
-  {
-    len = ep->maxpacket;
-  }
-
-
-  len32b = (len + 3) / 4;
+  /* Fill every whole packet the free space takes in one go, the space only
+     grows while packets leave so one read of DTXFSTS is enough */
+  space32b = USBx_INEP(epnum)->DTXFSTS & USB_OTG_DTXFSTS_INEPTFSAV;
 
-  while  ( (USBx_INEP(epnum)->DTXFSTS & USB_OTG_DTXFSTS_INEPTFSAV) > len32b &&
-          ep->xfer_count < ep->xfer_len &&
-            ep->xfer_len != 0)
+  while (ep->xfer_count < ep->xfer_len)
   {
-    /* Write the FIFO */
     len = ep->xfer_len - ep->xfer_count;
 
     if (len > ep->maxpacket)
@@ -1187,22 +1255,59 @@ static HAL_StatusTypeDef PCD_WriteEmptyTxFifo(PCD_HandleTypeDef *hpcd, uint32_t
     }
     len32b = (len + 3) / 4;
 
+    if (len32b > space32b)
+    {
+      break;
+    }
+
     USB_WritePacket(USBx, ep->xfer_buff, epnum, len, hpcd->Init.dma_enable);
 
     ep->xfer_buff  += len;
     ep->xfer_count += len;
+    space32b -= len32b;
   }
 
-  if(len <= 0)
+  /* Whole transfer queued, nothing left for TXFE to do until XFRC */
+  if (ep->xfer_count >= ep->xfer_len)
   {
     fifoemptymsk = 0x1 << epnum;
     USBx_DEVICE->DIEPEMPMSK &= ~fifoemptymsk;
-
   }
 
   return HAL_OK;
 }
 
+/**
+  * @brief  Pop one entry off the RxFIFO and copy its data out.
+  * @param  hpcd: PCD handle
+  * @retval None
+  */
+static void PCD_ReadRxFifo(PCD_HandleTypeDef *hpcd)
+{
+  USB_OTG_GlobalTypeDef *USBx = hpcd->Instance;
+  USB_OTG_EPTypeDef *ep;
+  uint32_t temp;
+
+  temp = USBx->GRXSTSP;
+
+  ep = &hpcd->OUT_ep[temp & USB_OTG_GRXSTSP_EPNUM];
+
+  if(((temp & USB_OTG_GRXSTSP_PKTSTS) >> 17) ==  STS_DATA_UPDT)
+  {
+    if((temp & USB_OTG_GRXSTSP_BCNT) != 0)
+    {
+      USB_ReadPacket(USBx, ep->xfer_buff, (temp & USB_OTG_GRXSTSP_BCNT) >> 4);
+      ep->xfer_buff += (temp & USB_OTG_GRXSTSP_BCNT) >> 4;
+      ep->xfer_count += (temp & USB_OTG_GRXSTSP_BCNT) >> 4;
+    }
+  }
+  else if (((temp & USB_OTG_GRXSTSP_PKTSTS) >> 17) ==  STS_SETUP_UPDT)
+  {
+    USB_ReadPacket(USBx, (uint8_t *)hpcd->Setup, 8);
+    ep->xfer_count += (temp & USB_OTG_GRXSTSP_BCNT) >> 4;
+  }
+}
+
 /**
   * @}
   */
@@ -57,6 +57,7 @@
 
 /* Includes ------------------------------------------------------------------*/
 #include "stm32f4xx_hal.h"
+#include "cycprof.h"
 
 /** @addtogroup STM32F4xx_LL_USB_DRIVER
   * @{
@@ -600,17 +601,6 @@ HAL_StatusTypeDef USB_EPStartXfer(USB_OTG_GlobalTypeDef *USBx , USB_OTG_EPTypeDe
     {
       USBx_INEP(ep->num)->DIEPDMA = (uint32_t)(ep->dma_addr);
     }
-    else
-    {
-      if (ep->type != EP_TYPE_ISOC)
-      {
-        /* Enable the Tx FIFO Empty Interrupt for this EP */
-        if (ep->xfer_len > 0)
-        {
-          USBx_DEVICE->DIEPEMPMSK |= 1 << ep->num;
-        }
-      }
-    }
 
     if (ep->type == EP_TYPE_ISOC)
     {
@@ -630,7 +620,36 @@ HAL_StatusTypeDef USB_EPStartXfer(USB_OTG_GlobalTypeDef *USBx , USB_OTG_EPTypeDe
     if (ep->type == EP_TYPE_ISOC)
     {
       USB_WritePacket(USBx, ep->xfer_buff, ep->num, ep->xfer_len, dma);   
-    }    
+    }
+    else if ((dma == 0) && (ep->xfer_len > 0))
+    {
+      /* Load the whole packets that fit right away, and only enable the
+         Tx FIFO Empty Interrupt when the rest has to wait for space */
+      uint32_t space32b = USBx_INEP(ep->num)->DTXFSTS & USB_OTG_DTXFSTS_INEPTFSAV;
+      uint32_t len;
+      
+      while (ep->xfer_count < ep->xfer_len)
+      {
+        len = ep->xfer_len - ep->xfer_count;
+        if (len > ep->maxpacket)
+        {
+          len = ep->maxpacket;
+        }
+        if (((len + 3) / 4) > space32b)
+        {
+          break;
+        }
+        USB_WritePacket(USBx, ep->xfer_buff, ep->num, len, dma);
+        ep->xfer_buff  += len;
+        ep->xfer_count += len;
+        space32b -= (len + 3) / 4;
+      }
+      
+      if (ep->xfer_count < ep->xfer_len)
+      {
+        USBx_DEVICE->DIEPEMPMSK |= 1 << ep->num;
+      }
+    }
   }
   else /* OUT endpoint */
   {
@@ -780,11 +799,36 @@ HAL_StatusTypeDef USB_WritePacket(USB_OTG_GlobalTypeDef *USBx, uint8_t *src, uin
   
   if (dma == 0)
   {
+    CYCPROF_START(fifowr);
     count32b =  (len + 3) / 4;
-    for (i = 0; i < count32b; i++, src += 4)
+    
+    if (((uint32_t)src & 3U) == 0U)
+    {
+      /* Word aligned buffer: the FIFO is a single register, so bursts of
+         eight loads are issued back to back before the stores */
+      __IO uint32_t *fifo = &USBx_DFIFO(ch_ep_num);
+      uint32_t *src32 = (uint32_t *)src;
+      
+      for (i = count32b >> 3; i != 0U; i--, src32 += 8)
+      {
+        uint32_t w0 = src32[0], w1 = src32[1], w2 = src32[2], w3 = src32[3];
+        uint32_t w4 = src32[4], w5 = src32[5], w6 = src32[6], w7 = src32[7];
+        *fifo = w0; *fifo = w1; *fifo = w2; *fifo = w3;
+        *fifo = w4; *fifo = w5; *fifo = w6; *fifo = w7;
+      }
+      for (i = count32b & 7U; i != 0U; i--)
+      {
+        *fifo = *src32++;
+      }
+    }
+    else
     {
-      USBx_DFIFO(ch_ep_num) = *((__packed uint32_t *)src);
+      for (i = 0; i < count32b; i++, src += 4)
+      {
+        USBx_DFIFO(ch_ep_num) = *((__packed uint32_t *)src);
+      }
     }
+    CYCPROF_STOP(fifowr, CYCPROF_FIFOWR);
   }
   return HAL_OK;
 }
@@ -806,12 +850,35 @@ void *USB_ReadPacket(USB_OTG_GlobalTypeDef *USBx, uint8_t *dest, uint16_t len)
 {
   uint32_t i=0;
   uint32_t count32b = (len + 3) / 4;
+  CYCPROF_START(fiford);
+  
+  if (((uint32_t)dest & 3U) == 0U)
+  {
+    /* Word aligned buffer: pop the FIFO in bursts of eight words */
+    __IO uint32_t *fifo = &USBx_DFIFO(0);
+    uint32_t *dest32 = (uint32_t *)dest;
+    
+    for (i = count32b >> 3; i != 0U; i--, dest32 += 8)
+    {
+      uint32_t w0 = *fifo, w1 = *fifo, w2 = *fifo, w3 = *fifo;
+      uint32_t w4 = *fifo, w5 = *fifo, w6 = *fifo, w7 = *fifo;
+      dest32[0] = w0; dest32[1] = w1; dest32[2] = w2; dest32[3] = w3;
+      dest32[4] = w4; dest32[5] = w5; dest32[6] = w6; dest32[7] = w7;
+    }
+    for (i = count32b & 7U; i != 0U; i--)
+    {
+      *dest32++ = *fifo;
+    }
+    CYCPROF_STOP(fiford, CYCPROF_FIFORD);
+    return ((void *)dest32);
+  }
   
   for ( i = 0; i < count32b; i++, dest += 4 )
   {
     *(__packed uint32_t *)dest = USBx_DFIFO(0);
     
   }
+  CYCPROF_STOP(fiford, CYCPROF_FIFORD);
   return ((void *)dest);
 }
 
@@ -133,14 +133,16 @@ USBD_StatusTypeDef  USBD_LL_SetUSBAddress (USBD_HandleTypeDef *pdev, uint8_t dev
 USBD_StatusTypeDef  USBD_LL_Transmit (USBD_HandleTypeDef *pdev, 
                                       uint8_t  ep_addr,                                      
                                       uint8_t  *pbuf,
-                                      uint16_t  size);
+                                      uint32_t  size);
 
 USBD_StatusTypeDef  USBD_LL_PrepareReceive(USBD_HandleTypeDef *pdev, 
                                            uint8_t  ep_addr,                                      
                                            uint8_t  *pbuf,
                                            uint16_t  size);
 
+USBD_StatusTypeDef  USBD_LL_EndReceive (USBD_HandleTypeDef *pdev, uint8_t ep_addr);
 uint32_t USBD_LL_GetRxDataSize  (USBD_HandleTypeDef *pdev, uint8_t  ep_addr);  
+USBD_StatusTypeDef  USBD_LL_EnableSOF (USBD_HandleTypeDef *pdev, uint8_t enable);
 void  USBD_LL_Delay (uint32_t Delay);
 
 /**
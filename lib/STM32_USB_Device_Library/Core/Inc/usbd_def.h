@@ -285,7 +285,7 @@ typedef struct _USBD_HandleTypeDef
   #if defined   (__CC_ARM)      /* ARM Compiler */
     #define __ALIGN_BEGIN    __align(4)  
   #elif defined (__ICCARM__)    /* IAR Compiler */
-    #define __ALIGN_BEGIN 
+    #define __ALIGN_BEGIN    _Pragma("data_alignment=4")
   #elif defined  (__TASKING__)  /* TASKING Compiler */
     #define __ALIGN_BEGIN    __align(4) 
   #endif /* __CC_ARM */  
@@ -120,6 +120,21 @@ USBD_StatusTypeDef  USBD_StdDevReq (USBD_HandleTypeDef *pdev , USBD_SetupReqType
 {
   USBD_StatusTypeDef ret = USBD_OK;  
   
+  /* Vendor requests go to the class, addressed to the device the host can
+     send them without claiming an interface another driver owns */
+  if ((req->bmRequest & USB_REQ_TYPE_MASK) == USB_REQ_TYPE_VENDOR)
+  {
+    if (pdev->dev_state == USBD_STATE_CONFIGURED)
+    {
+      pdev->pClass->Setup (pdev, req);
+    }
+    else
+    {
+      USBD_CtlError(pdev , req);
+    }
+    return ret;
+  }
+  
   switch (req->bRequest) 
   {
   case USB_REQ_GET_DESCRIPTOR: 
@@ -177,7 +192,8 @@ USBD_StatusTypeDef  USBD_StdItfReq (USBD_HandleTypeDef *pdev , USBD_SetupReqType
     
     if (LOBYTE(req->wIndex) <= USBD_MAX_NUM_INTERFACES) 
     {
-      pdev->pClass->Setup (pdev, req); 
+      /* A class that failed the request has stalled EP0, no status then */
+      ret = (USBD_StatusTypeDef)pdev->pClass->Setup (pdev, req); 
       
       if((req->wLength == 0)&& (ret == USBD_OK))
       {
@@ -0,0 +1,45 @@
+/**
+ * Host build stand-in for the CMSIS core register access header
+ *
+ * This file is part of stm32-usb-dualcdc, an implementation of Dual VCP ports
+ * over USB for STM32F4xx controllers.
+ * This project is available at
+ * <https://github.com/jisszacharia/stm32-usb-dualcdc>
+ *
+ * stm32-usb-dualcdc is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or any
+ * later version (at your option).
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * GNU Lesser General Public License is available at
+ * <http://www.gnu.org/licenses/>
+ *
+ * Copyright (c) 2016 JZJ <jiss.joseph@gmail.com>
+**/
+
+/* Multiple inclusion */
+#ifndef __CORE_CMFUNC_H
+#define __CORE_CMFUNC_H
+
+/* Includes */
+#include <stdint.h>
+
+/* Macros */
+// Masking has nothing to guard, interrupts never preempt the simulation
+static inline void __enable_irq(void)                  { }
+static inline void __disable_irq(void)                 { }
+static inline uint32_t __get_PRIMASK(void)             { return 0; }
+static inline void __set_PRIMASK(uint32_t primask)     { (void)primask; }
+static inline uint32_t __get_BASEPRI(void)             { return 0; }
+static inline void __set_BASEPRI(uint32_t basepri)     { (void)basepri; }
+static inline uint32_t __get_FPSCR(void)               { return 0; }
+static inline void __set_FPSCR(uint32_t fpscr)         { (void)fpscr; }
+
+#endif  /* __CORE_CMFUNC_H */
+
+/********************************** EOF ***************************************/
@@ -0,0 +1,81 @@
+/**
+ * Host build stand-in for the CMSIS core instruction header
+ *
+ * This file is part of stm32-usb-dualcdc, an implementation of Dual VCP ports
+ * over USB for STM32F4xx controllers.
+ * This project is available at
+ * <https://github.com/jisszacharia/stm32-usb-dualcdc>
+ *
+ * stm32-usb-dualcdc is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or any
+ * later version (at your option).
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * GNU Lesser General Public License is available at
+ * <http://www.gnu.org/licenses/>
+ *
+ * Copyright (c) 2016 JZJ <jiss.joseph@gmail.com>
+**/
+
+/* Multiple inclusion */
+#ifndef __CORE_CMINSTR_H
+#define __CORE_CMINSTR_H
+
+/* Includes */
+#include <stdint.h>
+
+/* Macros */
+// Found ahead of lib/CMSIS/Include by the host builds. The simulations run
+// interrupts as plain calls, so barriers only order the compiler and the
+// exclusive pair always succeeds.
+static inline void __NOP(void) { }
+static inline void __WFI(void) { }
+static inline void __WFE(void) { }
+static inline void __SEV(void) { }
+static inline void __DMB(void) { __atomic_thread_fence(__ATOMIC_SEQ_CST); }
+static inline void __DSB(void) { __atomic_thread_fence(__ATOMIC_SEQ_CST); }
+static inline void __ISB(void) { __atomic_thread_fence(__ATOMIC_SEQ_CST); }
+
+static inline uint32_t __REV(uint32_t value)
+{
+    return __builtin_bswap32(value);
+}
+
+static inline uint32_t __CLZ(uint32_t value)
+{
+    return (value != 0) ? (uint32_t)__builtin_clz(value) : 32;
+}
+
+static inline uint32_t __RBIT(uint32_t value)
+{
+    uint32_t result = 0;
+    int bit;
+
+    for(bit = 0; bit < 32; bit++)
+    {
+        result = (result << 1) | ((value >> bit) & 1);
+    }
+    return result;
+}
+
+static inline uint32_t __LDREXW(volatile uint32_t *addr)
+{
+    return *addr;
+}
+
+static inline uint32_t __STREXW(uint32_t value, volatile uint32_t *addr)
+{
+    *addr = value;
+    return 0;
+}
+
+static inline void __CLREX(void) { }
+
+#endif  /* __CORE_CMINSTR_H */
+
+/********************************** EOF ***************************************/
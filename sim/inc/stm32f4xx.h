@@ -0,0 +1,92 @@
+/**
+ * Host build stand-in for the CMSIS device header
+ *
+ * This file is part of stm32-usb-dualcdc, an implementation of Dual VCP ports
+ * over USB for STM32F4xx controllers.
+ * This project is available at
+ * <https://github.com/jisszacharia/stm32-usb-dualcdc>
+ *
+ * stm32-usb-dualcdc is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or any
+ * later version (at your option).
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * GNU Lesser General Public License is available at
+ * <http://www.gnu.org/licenses/>
+ *
+ * Copyright (c) 2016 JZJ <jiss.joseph@gmail.com>
+**/
+
+/* Multiple inclusion */
+#ifndef __STM32F4xx_H
+#define __STM32F4xx_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Includes */
+#include <stdint.h>
+#include <core_cmInstr.h>
+#include <core_cmFunc.h>
+
+/* Macros */
+// Only what the class layer touches. The simulator runs interrupts as
+// plain calls from its bus loop, the intrinsics come from cmsis/.
+#define __IO    volatile
+#define __I     volatile const
+#define __O     volatile
+
+#define __INLINE inline
+
+#define __NVIC_PRIO_BITS 4
+
+typedef enum {
+    PendSV_IRQn = -2,
+    OTG_FS_IRQn = 67,
+    OTG_HS_IRQn = 77
+} IRQn_Type;
+
+typedef struct {
+    __IO uint32_t ICSR;
+} SCB_Type;
+
+typedef struct {
+    __IO uint32_t CTRL;
+    __IO uint32_t CYCCNT;
+} DWT_Type;
+
+typedef struct {
+    __IO uint32_t DEMCR;
+} CoreDebug_Type;
+
+#define SCB_ICSR_PENDSVSET_Msk          (1UL << 28)
+#define DWT_CTRL_CYCCNTENA_Msk          (1UL << 0)
+#define CoreDebug_DEMCR_TRCENA_Msk      (1UL << 24)
+
+// Owned by the simulator, DWT->CYCCNT follows its clock
+extern SCB_Type Sim_SCB;
+extern DWT_Type Sim_DWT;
+extern CoreDebug_Type Sim_CoreDebug;
+extern uint32_t SystemCoreClock;
+
+#define SCB         (&Sim_SCB)
+#define DWT         (&Sim_DWT)
+#define CoreDebug   (&Sim_CoreDebug)
+
+static inline void NVIC_EnableIRQ(IRQn_Type irq)                      { (void)irq; }
+static inline void NVIC_DisableIRQ(IRQn_Type irq)                     { (void)irq; }
+static inline void NVIC_SetPriority(IRQn_Type irq, uint32_t priority) { (void)irq; (void)priority; }
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* __STM32F4xx_H */
+
+/********************************** EOF ***************************************/
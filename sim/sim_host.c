@@ -0,0 +1,1002 @@
+/**
+ * Scripted host for the class stack simulation
+ *
+ * This file is part of stm32-usb-dualcdc, an implementation of Dual VCP ports
+ * over USB for STM32F4xx controllers.
+ * This project is available at
+ * <https://github.com/jisszacharia/stm32-usb-dualcdc>
+ *
+ * stm32-usb-dualcdc is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or any
+ * later version (at your option).
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * GNU Lesser General Public License is available at
+ * <http://www.gnu.org/licenses/>
+ *
+ * Copyright (c) 2016 JZJ <jiss.joseph@gmail.com>
+**/
+
+/*
+ * Runs usbd_core, app/dualcdc.c and the demo interface of cfg/usbd_cdc_if.c
+ * in a Linux process, either against sim_ll.c instead of cfg/usbd_conf.c
+ * and the HAL, or against the OTG core model of sim_otg.c under both. The
+ * host enumerates the device, then streams a pattern into every
+ * port's Bulk OUT and checks what the demo bridges back out of the peer's
+ * Bulk IN, all ports at once in both directions. A ping test times single
+ * packets through the bridge. The coalescing run has the device write
+ * small pieces into each port's Tx ring and counts the IN packets they
+ * take, without and with DCDC_SetTxCoalescing. The weight run has the
+ * device fill every port's Tx ring as fast as it takes data and times each
+ * port, without and with DCDC_SetTxWeight on the last port. The self-test
+ * run loops
+ * every port's PRBS back to itself and reads the device's count.
+ *
+ * Time is simulated high speed bus time, the device CPU costs nothing.
+ * Results are repeatable to the byte, so they compare class changes, not
+ * boards. See cycprof for CPU time on the target.
+ *
+ *    sim_dualcdc | sim_otg [-n bytes per port] [-p pings]
+ *                          [-c coalescing run write size] [-f coalescing frames]
+ *                          [-w weight run bytes per SOF of the last port]
+ *                          [-s self-test bytes per port] [-e flip a bit every n packets]
+ */
+
+/* Includes */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sim_ll.h"
+#include "dualcdc.h"
+
+/* Macros */
+#define HOST_ADDRESS    (5)
+#define HOST_NAK_WAIT   (10000)     // ns between polls of NAKing pipes
+#define HOST_DESC_MAX   (512)
+#define HOST_CTL_TRIES  (1000)      // NAKs before a control stage fails
+#define HOST_LOOP_SIZE  (65536)     // Self-test data on its way back
+#define HOST_WRITE_NS   (2000)      // ns between small application writes
+#define HOST_WRITE_MAX  (512)
+#define HOST_PING_WAIT  (100000000) // ns a ping may take before the run fails
+#define HOST_STALL_WAIT (100000000) // ns a transfer loop may sit idle before the run fails
+
+// Host view of a port
+typedef struct {
+    uint8_t comm_itf;
+    uint8_t in_ep;
+    uint8_t out_ep;
+    uint16_t mps;
+    uint8_t peer;           // Port whose OUT data comes back on in_ep
+    uint64_t sent;
+    uint64_t rcvd;
+    uint64_t errors;
+} HostPortTypeDef;
+
+/* Extern */
+extern USBD_ClassTypeDef DCDC_cbs;
+extern DCDC_ItfTypeDef DCDC_fops;
+
+/* Global */
+USBD_HandleTypeDef USBDevice;
+
+/* Private */
+static HostPortTypeDef Host_Port[DCDC_NUM_PORTS];
+static uint8_t Host_Ports;
+static uint8_t Host_Loop[DCDC_NUM_PORTS][HOST_LOOP_SIZE];
+
+/* Device_Loop
+ * The body of main()'s loop, run until the class raises nothing more
+ */
+static void Device_Loop(void)
+{
+    uint32_t events;
+
+    while((events = DCDC_GetEvents()) != 0)
+    {
+#if (DCDC_DEFER == DCDC_DEFER_POLL)
+        if(events & DCDC_EVF_BH)
+        {
+            DCDC_ProcessEvents();
+        }
+#endif
+        CDC_Itf_ProcessData();
+    }
+}
+
+/* Device_Sleep
+ * Lets ns of bus time pass. With nothing raised the device sleeps through
+ * them in main()'s WFI, so they are booked as idle the same way.
+ */
+static void Device_Sleep(uint64_t ns)
+{
+    if(DCDC_PeekEvents() == 0)
+    {
+        CycProf_Idle((uint32_t)((ns * (SystemCoreClock / 1000000)) / 1000));
+    }
+    Sim_Advance(ns);
+}
+
+/* Host_Pattern
+ * Byte pos of the stream a port is fed, distinct per port
+ */
+static uint8_t Host_Pattern(uint8_t port, uint64_t pos)
+{
+    uint32_t x = (uint32_t)pos ^ (uint32_t)(pos >> 11) ^ (port * 0x9E3779B9U);
+
+    x ^= x >> 7;
+    x *= 0x2545F491U;
+    return (uint8_t)(x >> 24);
+}
+
+/* Host_Wait
+ * End of one pass of a transfer loop: moved is when data last moved. Lets
+ * the bus poll interval pass if nothing did, and exits once nothing has
+ * for HOST_STALL_WAIT.
+ */
+static void Host_Wait(const char *what, uint8_t progress, uint64_t *moved)
+{
+    if(progress)
+    {
+        *moved = Sim_Now();
+        return;
+    }
+    if((Sim_Now() - *moved) >= HOST_STALL_WAIT)
+    {
+        fprintf(stderr, "sim: %s stalled, nothing moved for %u ms\n",
+                what, HOST_STALL_WAIT / 1000000);
+        exit(1);
+    }
+    Device_Sleep(HOST_NAK_WAIT);
+}
+
+/* Host_Stage
+ * One control stage packet, retried while the device NAKs. Returns the IN
+ * length, 0 for OUT, or SIM_STALL.
+ */
+static int Host_Stage(uint8_t ep_addr, uint8_t *buf, uint32_t len)
+{
+    uint32_t tries;
+    int ret = SIM_NAK;
+
+    for(tries = 0; (tries < HOST_CTL_TRIES) && (ret == SIM_NAK); tries++)
+    {
+        ret = (ep_addr & 0x80) ? Sim_In(ep_addr, buf) : Sim_Out(ep_addr, buf, len);
+        Device_Loop();
+        if(ret == SIM_NAK)
+        {
+            Device_Sleep(HOST_NAK_WAIT);
+        }
+    }
+    return (ret == SIM_NAK) ? SIM_STALL : ret;
+}
+
+/* Host_Control
+ * One control transfer: setup, data stage into or out of data, status.
+ * Exits on a stall.
+ */
+static int Host_Control(uint8_t type, uint8_t request, uint16_t value,
+                        uint16_t index, uint16_t length, uint8_t *data)
+{
+    uint8_t setup[8] = { type, request, LOBYTE(value), HIBYTE(value),
+                         LOBYTE(index), HIBYTE(index), LOBYTE(length), HIBYTE(length) };
+    uint8_t packet[USB_MAX_EP0_SIZE];
+    uint32_t done = 0;
+    int ret;
+
+    Sim_Setup(setup);
+    Device_Loop();
+
+    if((length != 0) && (type & 0x80))
+    {
+        /* Data IN until a short packet or wLength, then status OUT */
+        do
+        {
+            ret = Host_Stage(0x80, packet, 0);
+            if(ret < 0)
+            {
+                break;
+            }
+            memcpy(data + done, packet, MIN((uint32_t)ret, length - done));
+            done += MIN((uint32_t)ret, length - done);
+        } while((ret == USB_MAX_EP0_SIZE) && (done < length));
+
+        if(ret >= 0)
+        {
+            ret = Host_Stage(0x00, NULL, 0);
+        }
+    }
+    else
+    {
+        /* Data OUT in max packets, then status IN */
+        ret = 0;
+        while((done < length) && (ret >= 0))
+        {
+            uint32_t len = MIN(length - done, USB_MAX_EP0_SIZE);
+
+            ret = Host_Stage(0x00, data + done, len);
+            done += len;
+        }
+        if(ret >= 0)
+        {
+            ret = Host_Stage(0x80, packet, 0);
+        }
+    }
+
+    if(ret < 0)
+    {
+        fprintf(stderr, "sim: request %02x %02x stalled\n", type, request);
+        exit(1);
+    }
+    return (int)done;
+}
+
+/* Host_Enumerate
+ * Reset, address, read the descriptors, configure and open every port
+ */
+static void Host_Enumerate(void)
+{
+    uint8_t desc[HOST_DESC_MAX];
+    uint8_t line[7] = { 0x00, 0xC2, 0x01, 0x00, 0x00, 0x00, 0x08 };  // 115200 8N1
+    uint16_t total;
+    uint16_t pos;
+    uint8_t data_itf = 0;
+    uint8_t comm_itf = 0;
+    uint8_t idx;
+
+    Sim_BusReset();
+    Sim_Sof();
+
+    Host_Control(0x80, USB_REQ_GET_DESCRIPTOR, USB_DESC_TYPE_DEVICE << 8, 0, USB_LEN_DEV_DESC, desc);
+    printf("device %02x%02x:%02x%02x, EP0 %u bytes\n", desc[9], desc[8], desc[11], desc[10], desc[7]);
+
+    Host_Control(0x00, USB_REQ_SET_ADDRESS, HOST_ADDRESS, 0, 0, NULL);
+
+    Host_Control(0x80, USB_REQ_GET_DESCRIPTOR, USB_DESC_TYPE_CONFIGURATION << 8, 0, USB_LEN_CFG_DESC, desc);
+    total = desc[2] | (desc[3] << 8);
+    if(total > sizeof(desc))
+    {
+        fprintf(stderr, "sim: configuration descriptor of %u bytes\n", total);
+        exit(1);
+    }
+    Host_Control(0x80, USB_REQ_GET_DESCRIPTOR, USB_DESC_TYPE_CONFIGURATION << 8, 0, total, desc);
+
+    /* Bulk pairs of each CDC data interface, in port order */
+    for(pos = 0; (pos + 1 < total) && (desc[pos] != 0); pos += desc[pos])
+    {
+        if(desc[pos + 1] == USB_DESC_TYPE_INTERFACE)
+        {
+            data_itf = (desc[pos + 5] == 0x0A);
+            if(desc[pos + 5] == 0x02)
+            {
+                comm_itf = desc[pos + 2];
+            }
+            if(data_itf && (Host_Ports < DCDC_NUM_PORTS))
+            {
+                Host_Port[Host_Ports].comm_itf = comm_itf;
+                Host_Ports++;
+            }
+        }
+        else if((desc[pos + 1] == USB_DESC_TYPE_ENDPOINT) && data_itf && ((desc[pos + 3] & 0x03) == 0x02))
+        {
+            HostPortTypeDef *port = &Host_Port[Host_Ports - 1];
+
+            if(desc[pos + 2] & 0x80)
+            {
+                port->in_ep = desc[pos + 2];
+            }
+            else
+            {
+                port->out_ep = desc[pos + 2];
+            }
+            port->mps = desc[pos + 4] | (desc[pos + 5] << 8);
+        }
+    }
+
+    Host_Control(0x00, USB_REQ_SET_CONFIGURATION, 1, 0, 0, NULL);
+
+    for(idx = 0; idx < Host_Ports; idx++)
+    {
+        HostPortTypeDef *port = &Host_Port[idx];
+
+        Host_Control(0x21, CDC_SET_LINE_CODING, 0, port->comm_itf, sizeof(line), line);
+        Host_Control(0x21, CDC_SET_CONTROL_LINE_STATE, 0x0003, port->comm_itf, 0, NULL);
+
+        /* The demo bridges ports in pairs, an odd last one to itself */
+        port->peer = ((idx ^ 1) < Host_Ports) ? (idx ^ 1) : idx;
+        printf("port %u: interface %u, OUT %02x, IN %02x, %u byte packets\n",
+               idx + 1, port->comm_itf, port->out_ep, port->in_ep, port->mps);
+    }
+}
+
+/* Host_Stream
+ * Feeds bytes into every port and reads them back from the peers, all
+ * pipes served in turn. Returns the simulated ns taken.
+ */
+static uint64_t Host_Stream(uint64_t bytes)
+{
+    uint8_t packet[DCDC_DATA_PACKET_SIZE];
+    uint64_t start = Sim_Now();
+    uint64_t moved = start;
+    uint8_t done = 0;
+    uint8_t idx;
+
+    while(!done)
+    {
+        uint8_t progress = 0;
+
+        done = 1;
+        for(idx = 0; idx < Host_Ports; idx++)
+        {
+            HostPortTypeDef *port = &Host_Port[idx];
+
+            if(port->sent < bytes)
+            {
+                uint32_t len = (uint32_t)MIN(bytes - port->sent, port->mps);
+                uint32_t i;
+
+                for(i = 0; i < len; i++)
+                {
+                    packet[i] = Host_Pattern(idx, port->sent + i);
+                }
+                if(Sim_Out(port->out_ep, packet, len) == 0)
+                {
+                    port->sent += len;
+                    progress = 1;
+                }
+                Device_Loop();
+                done = 0;
+            }
+
+            if(port->rcvd < bytes)
+            {
+                int len = Sim_In(port->in_ep, packet);
+                int i;
+
+                for(i = 0; i < len; i++)
+                {
+                    if(packet[i] != Host_Pattern(port->peer, port->rcvd + i))
+                    {
+                        port->errors++;
+                    }
+                }
+                if(len > 0)
+                {
+                    port->rcvd += len;
+                    progress = 1;
+                }
+                Device_Loop();
+                done = 0;
+            }
+        }
+
+        if(done)
+        {
+            break;
+        }
+        Host_Wait("stream", progress, &moved);
+    }
+
+    return Sim_Now() - start;
+}
+
+/* Host_Ping
+ * Times single packets of size bytes from a port's OUT to its peer's IN.
+ * A full packet ends no transfer, it only comes back once the device gives
+ * up waiting for the rest. Reports the spread in us. A ping not back and
+ * closed within HOST_PING_WAIT counts as an error and ends the series.
+ */
+static void Host_Ping(uint8_t idx, uint32_t pings, uint16_t size)
+{
+    HostPortTypeDef *port = &Host_Port[idx];
+    HostPortTypeDef *back = &Host_Port[port->peer];
+    uint8_t packet[DCDC_DATA_PACKET_SIZE];
+    uint64_t min = ~0ULL, max = 0, sum = 0;
+    uint32_t n;
+
+    for(n = 0; n < pings; n++)
+    {
+        uint64_t start;
+        uint64_t deadline;
+        uint64_t lat;
+        int len;
+
+        memset(packet, (uint8_t)n, size);
+        Sim_Sof();
+        deadline = Sim_Now() + HOST_PING_WAIT;
+        while((Sim_Out(port->out_ep, packet, size) != 0) && (Sim_Now() < deadline))
+        {
+            Device_Loop();
+            Device_Sleep(HOST_NAK_WAIT);
+        }
+        start = Sim_Now();
+        Device_Loop();
+
+        /* Past the ZLP that closed the previous stream */
+        while(((len = Sim_In(back->in_ep, packet)) <= 0) && (Sim_Now() < deadline))
+        {
+            Device_Loop();
+            Device_Sleep(HOST_NAK_WAIT);
+        }
+        Device_Loop();
+        lat = Sim_Now() - start;
+
+        if(len <= 0)
+        {
+            printf("ping port %u -> %u: %u bytes not back after %u ms\n",
+                   idx + 1, port->peer + 1, size, HOST_PING_WAIT / 1000000);
+            port->errors++;
+            return;
+        }
+        if(len != size)
+        {
+            printf("ping port %u -> %u: %d of %u bytes back\n",
+                   idx + 1, port->peer + 1, len, size);
+            port->errors++;
+        }
+        /* A full packet is closed with a ZLP */
+        while((size == port->mps) && ((len = Sim_In(back->in_ep, packet)) != 0))
+        {
+            if(Sim_Now() >= deadline)
+            {
+                printf("ping port %u -> %u: no ZLP after %u ms\n",
+                       idx + 1, port->peer + 1, HOST_PING_WAIT / 1000000);
+                port->errors++;
+                return;
+            }
+            Device_Loop();
+            Device_Sleep(HOST_NAK_WAIT);
+        }
+
+        min = MIN(min, lat);
+        max = MAX(max, lat);
+        sum += lat;
+    }
+
+    printf("ping port %u -> %u: %u bytes, min %.2f avg %.2f max %.2f us over %u\n",
+           idx + 1, port->peer + 1, size, min / 1000.0, (sum / (double)pings) / 1000.0,
+           max / 1000.0, pings);
+}
+
+/* Host_Latency
+ * Upper bound in us of the pct percentile of a tx_lat histogram, 0 if empty
+ */
+static uint32_t Host_Latency(const uint32_t *hist, uint32_t pct)
+{
+    uint64_t total = 0;
+    uint64_t sum = 0;
+    uint32_t k;
+
+    for(k = 0; k < DCDC_TXLAT_BUCKETS; k++)
+    {
+        total += hist[k];
+    }
+    for(k = 0; (k < DCDC_TXLAT_BUCKETS) && (total != 0); k++)
+    {
+        sum += hist[k];
+        if((sum * 100) >= (total * pct))
+        {
+            return 1U << k;
+        }
+    }
+    return 0;
+}
+
+/* Host_ShowStats
+ * Reads the class counters with DCDC_VREQ_GET_STATS and starts them over
+ */
+static void Host_ShowStats(void)
+{
+    DCDC_PortStatsTypeDef stats[DCDC_NUM_PORTS];
+    uint8_t idx;
+
+    Host_Control(0xC0, DCDC_VREQ_GET_STATS, DCDC_VREQ_RESET, 0, sizeof(stats), (uint8_t *)stats);
+    for(idx = 0; idx < Host_Ports; idx++)
+    {
+        printf("port %u: tx %u B %u pkt, busy %u, pending %u us, latency p50 < %u p99 < %u us "
+               "(%u unsampled); rx %u B %u pkt, overrun %u, nak %u us, flush %u\n",
+               idx + 1, stats[idx].tx_bytes, stats[idx].tx_packets, stats[idx].tx_busy,
+               stats[idx].tx_pending_us, Host_Latency(stats[idx].tx_lat, 50),
+               Host_Latency(stats[idx].tx_lat, 99), stats[idx].tx_lat_unsampled,
+               stats[idx].rx_bytes, stats[idx].rx_packets,
+               stats[idx].rx_overrun, stats[idx].rx_nak_us, stats[idx].rx_flush);
+    }
+}
+
+#if (CYCPROF_ENABLE != 0)
+/* Host_ShowProfile
+ * Reads the cycle profile with DCDC_VREQ_GET_PROFILE and starts it over.
+ * The sim CPU costs nothing, so the probes only count runs and the idle
+ * share is the bus time the device spent waiting for the host.
+ */
+static void Host_ShowProfile(void)
+{
+    static const char *names[CYCPROF_NUM] =
+    {
+        "irq", "datain", "dataout", "receive", "txcomplete", "sof", "bh",
+        "fifowr", "fiford", "irqlat"
+    };
+    static CycProfTypeDef prof;
+    uint64_t cycles;
+    uint8_t probe;
+
+    Host_Control(0xC0, DCDC_VREQ_GET_PROFILE, DCDC_VREQ_RESET, 0, sizeof(prof), (uint8_t *)&prof);
+    cycles = (uint64_t)prof.elapsed_ms * (prof.core_clock / 1000);
+    printf("profile: %u ms, idle %.2f %%, runs", prof.elapsed_ms,
+           (cycles != 0) ? (100.0 * prof.idle_cycles) / cycles : 0.0);
+    for(probe = 0; probe < prof.num; probe++)
+    {
+        printf(" %s %u", names[probe], prof.stat[probe].count);
+    }
+    printf("\n");
+}
+
+/* Host_SofIdle
+ * Leaves the device idle for ms with the SOF interrupt gated, then with it
+ * kept on by DCDC_VREQ_SET_SOF, and shows the profile of each. The target
+ * tells the idle cycles apart, here only the SOF runs differ.
+ */
+static void Host_SofIdle(uint32_t ms)
+{
+    static CycProfTypeDef prof;
+    uint8_t on;
+
+    for(on = 0; on < 2; on++)
+    {
+        uint64_t end;
+
+        /* Start the profile over as the mode changes */
+        Host_Control(0x40, DCDC_VREQ_SET_SOF, on, 0, 0, NULL);
+        Host_Control(0xC0, DCDC_VREQ_GET_PROFILE, DCDC_VREQ_RESET, 0, sizeof(prof), (uint8_t *)&prof);
+        end = Sim_Now() + (uint64_t)ms * 1000000;
+        while(Sim_Now() < end)
+        {
+            Device_Loop();
+            Device_Sleep(HOST_NAK_WAIT);
+        }
+        printf("idle, SOF %s: ", on ? "on" : "gated");
+        Host_ShowProfile();
+    }
+    Host_Control(0x40, DCDC_VREQ_SET_SOF, 0, 0, 0, NULL);
+}
+#endif
+
+/* Host_Coalesce
+ * Has the device write bytes into every port's Tx ring, write bytes at a
+ * time every HOST_WRITE_NS, while the host drains the Bulk INs. Ring data
+ * below a packet waits up to frames SOFs, 0 sends it at once. Reports the
+ * IN packets per MB and the class counters of the run. Returns 1 if data
+ * came back wrong.
+ */
+static int Host_Coalesce(uint64_t bytes, uint32_t write, uint16_t frames)
+{
+    DCDC_PortStatsTypeDef stats[DCDC_NUM_PORTS];
+    uint8_t data[HOST_WRITE_MAX];
+    uint8_t packet[DCDC_DATA_PACKET_SIZE];
+    uint64_t written[DCDC_NUM_PORTS] = { 0 };
+    uint64_t rcvd[DCDC_NUM_PORTS] = { 0 };
+    uint64_t errors = 0;
+    uint64_t next = Sim_Now();
+    uint64_t start = Sim_Now();
+    uint64_t moved = start;
+    uint32_t in_packets = Sim_Stats.in_packets;
+    uint32_t xfer_irqs = Sim_Stats.xfer_irqs;
+    uint32_t sof_irqs = Sim_Stats.sof_irqs;
+    uint32_t busy = 0;
+    uint8_t done = 0;
+    uint8_t idx;
+    double mb;
+
+    for(idx = 0; idx < Host_Ports; idx++)
+    {
+        DCDC_SetTxCoalescing(idx + DCDC_PORT1, DCDC_DATA_PACKET_SIZE, frames);
+    }
+    Host_Control(0xC0, DCDC_VREQ_GET_STATS, DCDC_VREQ_RESET, 0, sizeof(stats), (uint8_t *)stats);
+
+    while(!done)
+    {
+        uint8_t progress = 0;
+
+        /* The application's writes due by now */
+        while(next <= Sim_Now())
+        {
+            for(idx = 0; idx < Host_Ports; idx++)
+            {
+                uint32_t len = (uint32_t)MIN(bytes - written[idx], write);
+                uint32_t i;
+
+                if(len == 0)
+                {
+                    continue;
+                }
+                for(i = 0; i < len; i++)
+                {
+                    data[i] = Host_Pattern(idx, written[idx] + i);
+                }
+                if(DCDC_TransmitData(idx + DCDC_PORT1, data, len) == USBD_OK)
+                {
+                    written[idx] += len;
+                }
+                else
+                {
+                    busy++;
+                }
+            }
+            next += HOST_WRITE_NS;
+        }
+        Device_Loop();
+
+        done = 1;
+        for(idx = 0; idx < Host_Ports; idx++)
+        {
+            int len;
+            int i;
+
+            if(rcvd[idx] >= bytes)
+            {
+                continue;
+            }
+            done = 0;
+
+            len = Sim_In(Host_Port[idx].in_ep, packet);
+            for(i = 0; i < len; i++)
+            {
+                if(packet[i] != Host_Pattern(idx, rcvd[idx] + i))
+                {
+                    errors++;
+                }
+            }
+            if(len > 0)
+            {
+                rcvd[idx] += len;
+                progress = 1;
+            }
+            Device_Loop();
+        }
+
+        if(!done)
+        {
+            Host_Wait("coalescing run", progress, &moved);
+        }
+    }
+
+    for(idx = 0; idx < Host_Ports; idx++)
+    {
+        DCDC_SetTxCoalescing(idx + DCDC_PORT1, DCDC_TX_COALESCE_BYTES, DCDC_TX_COALESCE_FRAMES);
+    }
+
+    mb = (Host_Ports * bytes) / 1e6;
+    printf("coalesce %u frames, %u byte writes: %.0f IN packets, %.0f transfer irqs, "
+           "%.0f SOF irqs per MB, %u busy, %llu errors, %.3f ms\n",
+           frames, write, (Sim_Stats.in_packets - in_packets) / mb,
+           (Sim_Stats.xfer_irqs - xfer_irqs) / mb, (Sim_Stats.sof_irqs - sof_irqs) / mb,
+           busy, (unsigned long long)errors, (Sim_Now() - start) / 1e6);
+    Host_ShowStats();
+
+    return (errors != 0);
+}
+
+/* Host_Weight
+ * The device writes bytes into every port's Tx ring as fast as the ring
+ * takes them, with the last port's weight at weight bytes per SOF, and the
+ * host reads every Bulk IN. Reports each port's rate over its own run.
+ * Returns 1 on wrong data.
+ */
+static int Host_Weight(uint64_t bytes, uint32_t weight)
+{
+    uint8_t data[HOST_WRITE_MAX];
+    uint8_t packet[DCDC_DATA_PACKET_SIZE];
+    uint64_t written[DCDC_NUM_PORTS] = { 0 };
+    uint64_t rcvd[DCDC_NUM_PORTS] = { 0 };
+    uint64_t end[DCDC_NUM_PORTS] = { 0 };
+    uint64_t errors = 0;
+    uint64_t start = Sim_Now();
+    uint64_t moved = start;
+    uint32_t sof_irqs = Sim_Stats.sof_irqs;
+    uint8_t last = Host_Ports - 1;
+    uint8_t done = 0;
+    uint8_t idx;
+
+    DCDC_SetTxWeight(last + DCDC_PORT1, weight);
+
+    while(!done)
+    {
+        uint8_t progress = 0;
+
+        done = 1;
+        for(idx = 0; idx < Host_Ports; idx++)
+        {
+            int len;
+            int i;
+
+            /* Keep the ring full */
+            while(written[idx] < bytes)
+            {
+                uint32_t n = (uint32_t)MIN(bytes - written[idx], HOST_WRITE_MAX);
+
+                for(i = 0; i < (int)n; i++)
+                {
+                    data[i] = Host_Pattern(idx, written[idx] + i);
+                }
+                if(DCDC_TransmitData(idx + DCDC_PORT1, data, n) != USBD_OK)
+                {
+                    break;
+                }
+                written[idx] += n;
+            }
+            Device_Loop();
+
+            if(rcvd[idx] >= bytes)
+            {
+                continue;
+            }
+            done = 0;
+
+            len = Sim_In(Host_Port[idx].in_ep, packet);
+            for(i = 0; i < len; i++)
+            {
+                if(packet[i] != Host_Pattern(idx, rcvd[idx] + i))
+                {
+                    errors++;
+                }
+            }
+            if(len > 0)
+            {
+                rcvd[idx] += len;
+                progress = 1;
+                if(rcvd[idx] >= bytes)
+                {
+                    end[idx] = Sim_Now();
+                }
+            }
+            Device_Loop();
+        }
+
+        if(!done)
+        {
+            Host_Wait("weight run", progress, &moved);
+        }
+    }
+
+    DCDC_SetTxWeight(last + DCDC_PORT1, DCDC_TX_WEIGHT);
+
+    printf("weight %u bytes per SOF on port %u:", weight, last + 1);
+    for(idx = 0; idx < Host_Ports; idx++)
+    {
+        printf(" port %u %.2f MB/s,", idx + 1, (bytes / 1e6) / ((end[idx] - start) / 1e9));
+    }
+    printf(" %.0f SOF irqs, %llu errors\n", (double)(Sim_Stats.sof_irqs - sof_irqs),
+           (unsigned long long)errors);
+
+    return (errors != 0);
+}
+
+/* Host_SelfTest
+ * Puts every port under self-test both ways with DCDC_VREQ_SET_SELFTEST
+ * to the device, and loops its Bulk IN back into its Bulk OUT until bytes
+ * went round, flipping one bit of every flip-th packet if flip is set. The
+ * test ends with the request to the port's interface. Returns 1 if the
+ * device counted other wrong bits than the flips or lost step.
+ */
+static int Host_SelfTest(uint64_t bytes, uint32_t flip)
+{
+    SelfTestResultTypeDef res[DCDC_NUM_PORTS];
+    uint64_t looped[DCDC_NUM_PORTS] = { 0 };
+    uint64_t flips[DCDC_NUM_PORTS] = { 0 };
+    uint32_t held[DCDC_NUM_PORTS] = { 0 };
+    uint32_t packets[DCDC_NUM_PORTS] = { 0 };
+    uint64_t start;
+    uint64_t moved;
+    uint64_t ns;
+    uint8_t done = 0;
+    uint8_t idx;
+    int ret = 0;
+
+    for(idx = 0; idx < Host_Ports; idx++)
+    {
+        Host_Control(0x40, DCDC_VREQ_SET_SELFTEST, ((idx + DCDC_PORT1) << 8) | SELFTEST_BOTH,
+                     0, 0, NULL);
+    }
+    start = moved = Sim_Now();
+
+    while(!done)
+    {
+        uint8_t progress = 0;
+
+        done = 1;
+        for(idx = 0; idx < Host_Ports; idx++)
+        {
+            HostPortTypeDef *port = &Host_Port[idx];
+            uint8_t *loop = Host_Loop[idx];
+            int len;
+
+            if(looped[idx] >= bytes)
+            {
+                continue;
+            }
+            done = 0;
+
+            if((held[idx] + port->mps) <= HOST_LOOP_SIZE)
+            {
+                len = Sim_In(port->in_ep, &loop[held[idx]]);
+                if(len > 0)
+                {
+                    if((flip != 0) && ((++packets[idx] % flip) == 0))
+                    {
+                        loop[held[idx]] ^= 0x01;
+                        flips[idx]++;
+                    }
+                    held[idx] += len;
+                    progress = 1;
+                }
+                Device_Loop();
+            }
+
+            if(held[idx] != 0)
+            {
+                len = MIN(held[idx], port->mps);
+                if(Sim_Out(port->out_ep, loop, len) == 0)
+                {
+                    memmove(loop, loop + len, held[idx] - len);
+                    held[idx] -= len;
+                    looped[idx] += len;
+                    progress = 1;
+                }
+                Device_Loop();
+            }
+        }
+
+        if(done)
+        {
+            break;
+        }
+        Host_Wait("self-test", progress, &moved);
+    }
+
+    Host_Control(0xC0, DCDC_VREQ_GET_SELFTEST, 0, 0, sizeof(res), (uint8_t *)res);
+    for(idx = 0; idx < Host_Ports; idx++)
+    {
+        printf("self-test port %u: tx %llu B %.2f MB/s, rx %llu B %.2f MB/s over %u frames, "
+               "%llu bit errors (%llu flipped), %u sync losses\n",
+               idx + 1, (unsigned long long)res[idx].tx_bytes, res[idx].tx_mbs_x1000 / 1000.0,
+               (unsigned long long)res[idx].rx_bytes, res[idx].rx_mbs_x1000 / 1000.0, res[idx].frames,
+               (unsigned long long)res[idx].bit_errors, (unsigned long long)flips[idx],
+               res[idx].sync_loss);
+        if((res[idx].bit_errors != flips[idx]) || (res[idx].sync_loss != 0) || !res[idx].locked)
+        {
+            ret = 1;
+        }
+
+        /* Addressed to the port's interface, the core sends the status */
+        Host_Control(0x41, DCDC_VREQ_SET_SELFTEST, ((idx + DCDC_PORT1) << 8) | SELFTEST_OFF,
+                     Host_Port[idx].comm_itf, 0, NULL);
+    }
+    /* A transaction running over the end of a microframe stretches it,
+    so the device's frame count runs slow against the bus time */
+    ns = Sim_Now() - start;
+    printf("self-test bus: %.3f ms, %.2f MB/s each way per port\n",
+           ns / 1e6, (bytes / 1e6) / (ns / 1e9));
+
+    return ret;
+}
+
+int main(int argc, char **argv)
+{
+    uint64_t bytes = 4 * 1024 * 1024;
+    uint64_t selftest = 0;
+    uint32_t flip = 0;
+    uint32_t write = 0;
+    uint16_t frames = 4;
+    uint32_t pings = 100;
+    uint32_t weight = 0;
+    uint64_t ns;
+    uint8_t idx;
+    int opt;
+
+    for(opt = 1; opt + 1 < argc; opt += 2)
+    {
+        if(strcmp(argv[opt], "-n") == 0)
+        {
+            bytes = strtoull(argv[opt + 1], NULL, 0);
+        }
+        else if(strcmp(argv[opt], "-p") == 0)
+        {
+            pings = strtoul(argv[opt + 1], NULL, 0);
+        }
+        else if(strcmp(argv[opt], "-s") == 0)
+        {
+            selftest = strtoull(argv[opt + 1], NULL, 0);
+        }
+        else if(strcmp(argv[opt], "-c") == 0)
+        {
+            write = MIN(strtoul(argv[opt + 1], NULL, 0), HOST_WRITE_MAX);
+        }
+        else if(strcmp(argv[opt], "-f") == 0)
+        {
+            frames = (uint16_t)strtoul(argv[opt + 1], NULL, 0);
+        }
+        else if(strcmp(argv[opt], "-w") == 0)
+        {
+            weight = strtoul(argv[opt + 1], NULL, 0);
+        }
+        else if(strcmp(argv[opt], "-e") == 0)
+        {
+            flip = strtoul(argv[opt + 1], NULL, 0);
+        }
+    }
+
+#if (SELFTEST_ENABLE == 0)
+    if(selftest != 0)
+    {
+        fprintf(stderr, "sim: built without SELFTEST_ENABLE, no -s\n");
+        return 1;
+    }
+#endif
+
+    Sim_Init();
+    CycProf_Init();
+    USBD_Init(&USBDevice, &USBD_Desc, 0);
+    USBD_RegisterClass(&USBDevice, &DCDC_cbs);
+    DCDC_RegisterInterface(&USBDevice, &DCDC_fops);
+    USBD_Start(&USBDevice);
+
+    Host_Enumerate();
+
+    ns = Host_Stream(bytes);
+    for(idx = 0; idx < Host_Ports; idx++)
+    {
+        HostPortTypeDef *port = &Host_Port[idx];
+
+        printf("port %u: %llu bytes out, %llu back from port %u, %llu errors, %.2f MB/s each way\n",
+               idx + 1, (unsigned long long)port->sent, (unsigned long long)port->rcvd,
+               port->peer + 1, (unsigned long long)port->errors,
+               (port->rcvd / 1e6) / (ns / 1e9));
+    }
+    printf("bus: %.3f ms, %u IN / %u OUT packets, %u IN / %u OUT NAKs, %u transfer irqs, %u SOF irqs\n",
+           ns / 1e6, Sim_Stats.in_packets, Sim_Stats.out_packets, Sim_Stats.in_naks,
+           Sim_Stats.out_naks, Sim_Stats.xfer_irqs, Sim_Stats.sof_irqs);
+    Sim_Report();
+    Host_ShowStats();
+
+    for(idx = 0; idx < Host_Ports; idx++)
+    {
+        Host_Ping(idx, pings, 64);
+        Host_Ping(idx, pings, Host_Port[idx].mps);
+    }
+#if (CYCPROF_ENABLE != 0)
+    Host_ShowProfile();
+    Host_SofIdle(10);
+#endif
+
+    if((write != 0) &&
+       ((Host_Coalesce(bytes, write, 0) != 0) || (Host_Coalesce(bytes, write, frames) != 0)))
+    {
+        return 1;
+    }
+
+    if((weight != 0) &&
+       ((Host_Weight(bytes, 0) != 0) || (Host_Weight(bytes, weight) != 0)))
+    {
+        return 1;
+    }
+
+    if((selftest != 0) && (Host_SelfTest(selftest, flip) != 0))
+    {
+        return 1;
+    }
+
+    for(idx = 0; idx < Host_Ports; idx++)
+    {
+        if(Host_Port[idx].errors != 0)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/********************************** EOF ***************************************/
@@ -0,0 +1,471 @@
+/**
+ * Host simulation of the USB device core
+ *
+ * This file is part of stm32-usb-dualcdc, an implementation of Dual VCP ports
+ * over USB for STM32F4xx controllers.
+ * This project is available at
+ * <https://github.com/jisszacharia/stm32-usb-dualcdc>
+ *
+ * stm32-usb-dualcdc is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or any
+ * later version (at your option).
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * GNU Lesser General Public License is available at
+ * <http://www.gnu.org/licenses/>
+ *
+ * Copyright (c) 2016 JZJ <jiss.joseph@gmail.com>
+**/
+
+/* Includes */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sim_ll.h"
+#include "dualcdc.h"
+
+/* Macros */
+#ifdef USE_USB_FS
+#error "sim_ll times the bus at high speed, build with USE_USB_HS"
+#endif
+
+/* Private */
+// One direction of an endpoint, armed by USBD_LL_Transmit or
+// USBD_LL_PrepareReceive and drained or filled a packet at a time
+typedef struct {
+    uint8_t open;
+    uint8_t stall;
+    uint8_t armed;
+    uint16_t mps;
+    uint8_t *buf;
+    uint32_t len;
+    uint32_t count;
+} Sim_EpTypeDef;
+
+static USBD_HandleTypeDef *Sim_Dev;
+static Sim_EpTypeDef Sim_InEp[16];
+static Sim_EpTypeDef Sim_OutEp[16];
+static uint8_t Sim_SofEnable;
+static uint8_t Sim_Address;
+static uint64_t Sim_Time;
+static uint64_t Sim_FrameEnd;
+
+/* Public */
+Sim_StatsTypeDef Sim_Stats;
+SCB_Type Sim_SCB;
+DWT_Type Sim_DWT;
+CoreDebug_Type Sim_CoreDebug;
+uint32_t SystemCoreClock = 180000000;
+
+/* Sim_Clock
+ * Moves the simulated time on, the DWT cycle counter follows it
+ */
+static void Sim_Clock(uint64_t ns)
+{
+    Sim_Time += ns;
+    Sim_DWT.CYCCNT = (uint32_t)((Sim_Time * (SystemCoreClock / 1000000)) / 1000);
+}
+
+/* Sim_BusTime
+ * Charges a transaction of len bytes on the wire
+ */
+static void Sim_BusTime(uint32_t len)
+{
+    Sim_Clock(((uint64_t)len * 1000) / SIM_BUS_BYTES_PER_US);
+}
+
+/* Sim_IrqExit
+ * What the core does on leaving the OTG interrupt, run a pended PendSV
+ */
+static void Sim_IrqExit(void)
+{
+    if(Sim_SCB.ICSR & SCB_ICSR_PENDSVSET_Msk)
+    {
+        Sim_SCB.ICSR &= ~SCB_ICSR_PENDSVSET_Msk;
+        Sim_Stats.bh_runs++;
+        DCDC_ProcessEvents();
+    }
+}
+
+/* Sim_StartFrame
+ * Starts a microframe now, with its SOF
+ */
+static void Sim_StartFrame(void)
+{
+    Sim_FrameEnd = Sim_Time + SIM_UFRAME_NS;
+    Sim_Stats.sofs++;
+
+    if(Sim_SofEnable)
+    {
+        Sim_Stats.sof_irqs++;
+        USBD_LL_SOF(Sim_Dev);
+        Sim_IrqExit();
+    }
+}
+
+/* Sim_FrameCheck
+ * Ahead of a transaction, starts the next microframe if this one is over.
+ * A transaction running past the end of a microframe stretches it.
+ */
+static void Sim_FrameCheck(void)
+{
+    if(Sim_Time >= Sim_FrameEnd)
+    {
+        Sim_StartFrame();
+    }
+}
+
+/************************** Host side *****************************************/
+/* Sim_Init
+ * Nothing to set up, the endpoints start closed
+ */
+void Sim_Init(void)
+{
+}
+
+/* Sim_Now
+ * Returns the simulated time in ns
+ */
+uint64_t Sim_Now(void)
+{
+    return Sim_Time;
+}
+
+/* Sim_Advance
+ * Lets the bus idle for ns, starting each microframe on time
+ */
+void Sim_Advance(uint64_t ns)
+{
+    uint64_t end = Sim_Time + ns;
+
+    while(Sim_FrameEnd <= end)
+    {
+        if(Sim_Time < Sim_FrameEnd)
+        {
+            Sim_Clock(Sim_FrameEnd - Sim_Time);
+        }
+        Sim_StartFrame();
+    }
+    Sim_Clock(end - Sim_Time);
+}
+
+/* Sim_BusReset
+ * Resets the bus at high speed, as HAL_PCD_ResetCallback
+ */
+void Sim_BusReset(void)
+{
+    memset(Sim_InEp, 0, sizeof(Sim_InEp));
+    memset(Sim_OutEp, 0, sizeof(Sim_OutEp));
+    Sim_Address = 0;
+
+    USBD_LL_SetSpeed(Sim_Dev, USBD_SPEED_HIGH);
+    USBD_LL_Reset(Sim_Dev);
+    Sim_IrqExit();
+}
+
+/* Sim_Sof
+ * Waits for the current microframe to end and starts the next one
+ */
+void Sim_Sof(void)
+{
+    if(Sim_Time < Sim_FrameEnd)
+    {
+        Sim_Clock(Sim_FrameEnd - Sim_Time);
+    }
+    Sim_StartFrame();
+}
+
+/* Sim_In
+ * One IN transaction. Returns the data packet length, SIM_NAK or SIM_STALL.
+ * A short packet, or the last of the armed length, completes the transfer.
+ * EP0 completes every packet, the library continues it packet by packet.
+ */
+int Sim_In(uint8_t ep_addr, uint8_t *buf)
+{
+    uint8_t epnum = ep_addr & 0x0F;
+    Sim_EpTypeDef *ep = &Sim_InEp[epnum];
+    uint32_t len;
+
+    Sim_FrameCheck();
+    if(ep->stall)
+    {
+        Sim_BusTime(SIM_NAK_OVERHEAD);
+        return SIM_STALL;
+    }
+    if(!ep->armed)
+    {
+        Sim_Stats.in_naks++;
+        Sim_BusTime(SIM_NAK_OVERHEAD);
+        return SIM_NAK;
+    }
+
+    len = ep->len - ep->count;
+    if(len > ep->mps)
+    {
+        len = ep->mps;
+    }
+    if(len != 0)
+    {
+        memcpy(buf, ep->buf + ep->count, len);
+    }
+    ep->count += len;
+    Sim_Stats.in_packets++;
+    Sim_Stats.in_bytes += len;
+    Sim_BusTime(len + SIM_PACKET_OVERHEAD);
+
+    if((epnum == 0) || (len < ep->mps) || (ep->count >= ep->len))
+    {
+        ep->armed = 0;
+        Sim_Stats.xfer_irqs++;
+        CYCPROF_ENTRY();
+        USBD_LL_DataInStage(Sim_Dev, epnum, ep->buf + ep->count);
+        Sim_IrqExit();
+    }
+
+    return (int)len;
+}
+
+/* Sim_Out
+ * One OUT transaction of len bytes, at most the endpoint's max packet.
+ * Returns 0 when the device took it, SIM_NAK or SIM_STALL.
+ */
+int Sim_Out(uint8_t ep_addr, const uint8_t *buf, uint32_t len)
+{
+    uint8_t epnum = ep_addr & 0x0F;
+    Sim_EpTypeDef *ep = &Sim_OutEp[epnum];
+
+    Sim_FrameCheck();
+    if(ep->stall)
+    {
+        Sim_BusTime(SIM_NAK_OVERHEAD);
+        return SIM_STALL;
+    }
+    if(!ep->armed)
+    {
+        Sim_Stats.out_naks++;
+        Sim_BusTime(len + SIM_NAK_OVERHEAD);
+        return SIM_NAK;
+    }
+
+    /* Babble past the armed length is dropped, as the core would */
+    uint32_t take = ep->len - ep->count;
+    if(take > len)
+    {
+        take = len;
+    }
+    if(take != 0)
+    {
+        memcpy(ep->buf + ep->count, buf, take);
+    }
+    ep->count += take;
+    Sim_Stats.out_packets++;
+    Sim_Stats.out_bytes += len;
+    Sim_BusTime(len + SIM_PACKET_OVERHEAD);
+
+    if((epnum == 0) || (len < ep->mps) || (ep->count >= ep->len))
+    {
+        ep->armed = 0;
+        Sim_Stats.xfer_irqs++;
+        CYCPROF_ENTRY();
+        USBD_LL_DataOutStage(Sim_Dev, epnum, ep->buf + ep->count);
+        Sim_IrqExit();
+    }
+
+    return 0;
+}
+
+/* Sim_Setup
+ * One SETUP transaction, always taken. Clears an EP0 stall.
+ */
+int Sim_Setup(const uint8_t *setup)
+{
+    Sim_FrameCheck();
+    Sim_InEp[0].stall = 0;
+    Sim_OutEp[0].stall = 0;
+    Sim_InEp[0].armed = 0;
+    Sim_OutEp[0].armed = 0;
+    Sim_Stats.setups++;
+    Sim_BusTime(8 + SIM_PACKET_OVERHEAD);
+    USBD_LL_SetupStage(Sim_Dev, (uint8_t *)setup);
+    Sim_IrqExit();
+
+    return 0;
+}
+
+/* Sim_Report
+ * Callbacks per MB of payload moved on the bus
+ */
+void Sim_Report(void)
+{
+    double mb = (Sim_Stats.in_bytes + Sim_Stats.out_bytes) / 1e6;
+
+    if(mb == 0)
+    {
+        return;
+    }
+    printf("ll per MB: %.0f transfer callbacks, %.0f SOF callbacks, %.0f bottom half runs\n",
+           Sim_Stats.xfer_irqs / mb, Sim_Stats.sof_irqs / mb, Sim_Stats.bh_runs / mb);
+}
+
+/************************** USBD_LL_ ******************************************/
+USBD_StatusTypeDef USBD_LL_Init(USBD_HandleTypeDef *pdev)
+{
+    Sim_Dev = pdev;
+    return USBD_OK;
+}
+
+USBD_StatusTypeDef USBD_LL_DeInit(USBD_HandleTypeDef *pdev)
+{
+    return USBD_OK;
+}
+
+USBD_StatusTypeDef USBD_LL_Start(USBD_HandleTypeDef *pdev)
+{
+    return USBD_OK;
+}
+
+USBD_StatusTypeDef USBD_LL_Stop(USBD_HandleTypeDef *pdev)
+{
+    return USBD_OK;
+}
+
+USBD_StatusTypeDef USBD_LL_OpenEP(USBD_HandleTypeDef *pdev,
+                                  uint8_t ep_addr,
+                                  uint8_t ep_type,
+                                  uint16_t ep_mps)
+{
+    Sim_EpTypeDef *ep = (ep_addr & 0x80) ? &Sim_InEp[ep_addr & 0x0F] : &Sim_OutEp[ep_addr & 0x0F];
+
+    memset(ep, 0, sizeof(*ep));
+    ep->open = 1;
+    ep->mps = ep_mps;
+    return USBD_OK;
+}
+
+USBD_StatusTypeDef USBD_LL_CloseEP(USBD_HandleTypeDef *pdev, uint8_t ep_addr)
+{
+    Sim_EpTypeDef *ep = (ep_addr & 0x80) ? &Sim_InEp[ep_addr & 0x0F] : &Sim_OutEp[ep_addr & 0x0F];
+
+    ep->open = 0;
+    ep->armed = 0;
+    return USBD_OK;
+}
+
+USBD_StatusTypeDef USBD_LL_FlushEP(USBD_HandleTypeDef *pdev, uint8_t ep_addr)
+{
+    return USBD_OK;
+}
+
+USBD_StatusTypeDef USBD_LL_StallEP(USBD_HandleTypeDef *pdev, uint8_t ep_addr)
+{
+    if(ep_addr & 0x80)
+    {
+        Sim_InEp[ep_addr & 0x0F].stall = 1;
+    }
+    else
+    {
+        Sim_OutEp[ep_addr & 0x0F].stall = 1;
+    }
+    return USBD_OK;
+}
+
+USBD_StatusTypeDef USBD_LL_ClearStallEP(USBD_HandleTypeDef *pdev, uint8_t ep_addr)
+{
+    if(ep_addr & 0x80)
+    {
+        Sim_InEp[ep_addr & 0x0F].stall = 0;
+    }
+    else
+    {
+        Sim_OutEp[ep_addr & 0x0F].stall = 0;
+    }
+    return USBD_OK;
+}
+
+uint8_t USBD_LL_IsStallEP(USBD_HandleTypeDef *pdev, uint8_t ep_addr)
+{
+    return (ep_addr & 0x80) ? Sim_InEp[ep_addr & 0x0F].stall : Sim_OutEp[ep_addr & 0x0F].stall;
+}
+
+USBD_StatusTypeDef USBD_LL_SetUSBAddress(USBD_HandleTypeDef *pdev, uint8_t dev_addr)
+{
+    Sim_Address = dev_addr;
+    return USBD_OK;
+}
+
+/* EP0 IN is armed with address 0x00 by the library */
+USBD_StatusTypeDef USBD_LL_Transmit(USBD_HandleTypeDef *pdev,
+                                    uint8_t ep_addr,
+                                    uint8_t *pbuf,
+                                    uint32_t size)
+{
+    Sim_EpTypeDef *ep = &Sim_InEp[ep_addr & 0x0F];
+
+    /* The core would drop the transfer in flight, or send a packet twice */
+    if(ep->armed)
+    {
+        fprintf(stderr, "sim: EP%02x armed while busy\n", ep_addr | 0x80);
+        exit(1);
+    }
+    ep->buf = pbuf;
+    ep->len = size;
+    ep->count = 0;
+    ep->armed = 1;
+    return USBD_OK;
+}
+
+USBD_StatusTypeDef USBD_LL_PrepareReceive(USBD_HandleTypeDef *pdev,
+                                          uint8_t ep_addr,
+                                          uint8_t *pbuf,
+                                          uint16_t size)
+{
+    Sim_EpTypeDef *ep = &Sim_OutEp[ep_addr & 0x0F];
+
+    ep->buf = pbuf;
+    ep->len = size;
+    ep->count = 0;
+    ep->armed = 1;
+    return USBD_OK;
+}
+
+/* Packets are taken whole by Sim_Out, so an armed transfer is never part
+   way through completing */
+USBD_StatusTypeDef USBD_LL_EndReceive(USBD_HandleTypeDef *pdev, uint8_t ep_addr)
+{
+    Sim_EpTypeDef *ep = &Sim_OutEp[ep_addr & 0x0F];
+
+    if(!ep->armed)
+    {
+        return USBD_BUSY;
+    }
+    ep->armed = 0;
+    return USBD_OK;
+}
+
+uint32_t USBD_LL_GetRxDataSize(USBD_HandleTypeDef *pdev, uint8_t ep_addr)
+{
+    return Sim_OutEp[ep_addr & 0x0F].count;
+}
+
+USBD_StatusTypeDef USBD_LL_EnableSOF(USBD_HandleTypeDef *pdev, uint8_t enable)
+{
+    Sim_SofEnable = enable;
+    return USBD_OK;
+}
+
+void USBD_LL_Delay(uint32_t Delay)
+{
+    Sim_Clock((uint64_t)Delay * 1000000);
+}
+
+uint32_t HAL_GetTick(void)
+{
+    return (uint32_t)(Sim_Time / 1000000);
+}
+
+/********************************** EOF ***************************************/
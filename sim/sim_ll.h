@@ -0,0 +1,89 @@
+/**
+ * Host simulation of the USB device core Header file
+ *
+ * This file is part of stm32-usb-dualcdc, an implementation of Dual VCP ports
+ * over USB for STM32F4xx controllers.
+ * This project is available at
+ * <https://github.com/jisszacharia/stm32-usb-dualcdc>
+ *
+ * stm32-usb-dualcdc is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or any
+ * later version (at your option).
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * GNU Lesser General Public License is available at
+ * <http://www.gnu.org/licenses/>
+ *
+ * Copyright (c) 2016 JZJ <jiss.joseph@gmail.com>
+**/
+
+/* Multiple inclusion */
+#ifndef __SIM_LL_H
+#define __SIM_LL_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Includes */
+#include "usbd_core.h"
+
+/* Macros */
+// Transaction outcomes, or the byte count of an IN data packet
+#define SIM_NAK     (-1)
+#define SIM_STALL   (-2)
+
+// High speed bus timing. A transaction costs its payload plus token,
+// handshake, sync, PID and CRC bytes at 60 bytes per us.
+#define SIM_BUS_BYTES_PER_US    (60)
+#define SIM_PACKET_OVERHEAD     (20)
+#define SIM_NAK_OVERHEAD        (12)
+#define SIM_UFRAME_NS           (125000)
+
+// Bus and device side counters
+typedef struct {
+    uint64_t in_bytes;      // IN data, EP0 included
+    uint64_t out_bytes;     // OUT data, EP0 included
+    uint32_t in_packets;
+    uint32_t out_packets;
+    uint32_t in_naks;
+    uint32_t out_naks;
+    uint32_t setups;
+    uint32_t sofs;          // Microframes started
+    uint32_t sof_irqs;      // SOF callbacks, only while unmasked
+    uint32_t xfer_irqs;     // Transfer complete callbacks
+    uint32_t bh_runs;       // PendSV bottom half runs
+} Sim_StatsTypeDef;
+
+extern Sim_StatsTypeDef Sim_Stats;
+
+// Host side of the bus, implemented by sim_ll.c over the USBD_LL_ calls
+// and by sim_otg.c over the core's registers. Each call is one
+// transaction, the device side interrupt runs inside it.
+void     Sim_Init(void);
+void     Sim_BusReset(void);
+void     Sim_Sof(void);
+int      Sim_In(uint8_t ep_addr, uint8_t *buf);
+int      Sim_Out(uint8_t ep_addr, const uint8_t *buf, uint32_t len);
+int      Sim_Setup(const uint8_t *setup);
+
+// Prints the backend's own counters per MB moved
+void     Sim_Report(void);
+
+// Simulated time in ns, the only clock of the run. Sim_Advance idles the
+// bus, the microframes passing meanwhile start with their SOF.
+uint64_t Sim_Now(void);
+void     Sim_Advance(uint64_t ns);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* __SIM_LL_H */
+
+/********************************** EOF ***************************************/
@@ -0,0 +1,1105 @@
+/**
+ * Register level model of the OTG HS core for host runs
+ *
+ * This file is part of stm32-usb-dualcdc, an implementation of Dual VCP ports
+ * over USB for STM32F4xx controllers.
+ * This project is available at
+ * <https://github.com/jisszacharia/stm32-usb-dualcdc>
+ *
+ * stm32-usb-dualcdc is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or any
+ * later version (at your option).
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * GNU Lesser General Public License is available at
+ * <http://www.gnu.org/licenses/>
+ *
+ * Copyright (c) 2016 JZJ <jiss.joseph@gmail.com>
+**/
+
+/*
+ * Stands in for the OTG HS core under the unmodified HAL: cfg/usbd_conf.c,
+ * stm32f4xx_hal_pcd.c, stm32f4xx_ll_usb.c and dev/stm32f4xx_it.c all build
+ * as on the target and drive it through the register block at its usual
+ * address. It implements the same host side as sim_ll.c, so sim_host.c
+ * runs on either.
+ *
+ * The register block and the FIFO windows are mapped with no access. Each
+ * load or store faults, the model brings the register up to date (or pops
+ * the Rx FIFO), opens the pages and single steps the instruction with the
+ * trap flag, then applies the write and closes the pages again. The model
+ * itself works on a second mapping of the same pages. Peripherals the MSP
+ * touches and the Cortex-M system space are plain memory.
+ *
+ * Slave mode, or buffer DMA mode with USBD_DMA_ENABLE 1. In DMA mode the
+ * core moves packets between the bus and the address in DIEPDMA/DOEPDMA
+ * itself, so the DMA registers must hold real pointers: that build links
+ * without PIE, and the static image and the heap above it stand in for the
+ * SRAM the core can reach. One control endpoint and bulk and interrupt endpoints, no
+ * isochronous, no suspend. x86-64 Linux only, the single step and the
+ * fault's access type come from its signal frame.
+ */
+
+#if !defined(__linux__) || !defined(__x86_64__)
+#error "sim_otg single steps register accesses, x86-64 Linux only"
+#endif
+
+#define _GNU_SOURCE
+
+/* Includes */
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <ucontext.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "sim_ll.h"
+#include "dualcdc.h"
+#include "stm32f4xx_it.h"
+
+#if (USBD_DMA_ENABLE != 0) && defined(__PIE__)
+#error "sim_otg DMA addresses are 32 bits, build with -fno-pie -no-pie"
+#endif
+
+/* Macros */
+#ifdef USE_USB_FS
+#error "sim_otg times the bus at high speed, build with USE_USB_HS"
+#endif
+
+#define OTG_BASE            ((uintptr_t)USB_OTG_HS)
+#define OTG_TRAP_SIZE       (USB_OTG_FIFO_BASE + 16 * USB_OTG_FIFO_SIZE)
+#define OTG_FIFO_RAM_WORDS  (1024)      // 4 KB of FIFO RAM in the HS core
+#define OTG_NUM_EPS         (16)
+#define OTG_IRQ_STORM       (100000)    // Entries without the line dropping
+
+// Plain memory under the peripherals the MSP and HAL reach, and under the
+// Cortex-M system space (NVIC, SCB, DWT)
+#define SIM_PERIPH_BASE     (0x40000000UL)
+#define SIM_PERIPH_SIZE     (0x00080000UL)
+#define SIM_PPB_BASE        (0xE0000000UL)
+#define SIM_PPB_SIZE        (0x00100000UL)
+
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE (0x100000)
+#endif
+
+#define OTG_EFLAGS_TF       (0x100)     // Trap after the next instruction
+#define OTG_PF_WRITE        (0x2)       // Page fault error code, write access
+
+// GINTSTS causes latched by the core and cleared by writing 1, the others
+// follow the FIFO and endpoint state
+#define OTG_GINTSTS_W1C     (USB_OTG_GINTSTS_MMIS | USB_OTG_GINTSTS_SOF |         \
+                             USB_OTG_GINTSTS_ESUSP | USB_OTG_GINTSTS_USBSUSP |    \
+                             USB_OTG_GINTSTS_USBRST | USB_OTG_GINTSTS_ENUMDNE |   \
+                             USB_OTG_GINTSTS_ISOODRP | USB_OTG_GINTSTS_EOPF |     \
+                             USB_OTG_GINTSTS_IISOIXFR |                           \
+                             USB_OTG_GINTSTS_PXFR_INCOMPISOOUT |                  \
+                             USB_OTG_GINTSTS_DATAFSUSP | USB_OTG_GINTSTS_CIDSCHG |\
+                             USB_OTG_GINTSTS_DISCINT | USB_OTG_GINTSTS_SRQINT |   \
+                             USB_OTG_GINTSTS_WKUINT)
+
+// Endpoint control bits that act on write and read back as 0
+#define OTG_EPCTL_ACTIONS   (USB_OTG_DIEPCTL_CNAK | USB_OTG_DIEPCTL_SNAK |        \
+                             USB_OTG_DIEPCTL_SD0PID_SEVNFRM |                     \
+                             USB_OTG_DIEPCTL_SODDFRM | USB_OTG_DIEPCTL_EPDIS)
+
+#define OTG_DCTL_ACTIONS    (USB_OTG_DCTL_SGINAK | USB_OTG_DCTL_CGINAK |          \
+                             USB_OTG_DCTL_SGONAK | USB_OTG_DCTL_CGONAK |          \
+                             USB_OTG_DCTL_POPRGDNE)
+
+// The model's view of the registers
+#define OTG_REG(off)        (*(__IO uint32_t *)(Otg_Mem + (off)))
+#define OTG_GLB             ((USB_OTG_GlobalTypeDef *)Otg_Mem)
+#define OTG_DEV             ((USB_OTG_DeviceTypeDef *)(Otg_Mem + USB_OTG_DEVICE_BASE))
+#define OTG_INEP(i)         ((USB_OTG_INEndpointTypeDef *)(Otg_Mem + USB_OTG_IN_ENDPOINT_BASE + (i) * USB_OTG_EP_REG_SIZE))
+#define OTG_OUTEP(i)        ((USB_OTG_OUTEndpointTypeDef *)(Otg_Mem + USB_OTG_OUT_ENDPOINT_BASE + (i) * USB_OTG_EP_REG_SIZE))
+
+#define OTG_OFF(reg)        ((uint32_t)offsetof(USB_OTG_GlobalTypeDef, reg))
+#define OTG_RXSTS(ep, len, sts) ((ep) | ((uint32_t)(len) << 4) | ((uint32_t)(sts) << 17))
+
+// Word queue, free running indices masked on access
+typedef struct {
+    uint32_t word[OTG_FIFO_RAM_WORDS];
+    uint32_t head;
+    uint32_t tail;
+} Otg_FifoTypeDef;
+
+// Register traffic, [0] from thread mode and [1] from the interrupt and the
+// PendSV bottom half
+typedef struct {
+    uint64_t reg_reads[2];
+    uint64_t reg_writes[2];
+    uint64_t fifo_reads[2];     // Rx FIFO words popped through DFIFO
+    uint64_t fifo_writes[2];    // Tx FIFO words pushed through DFIFO
+    uint64_t dma_words;         // Words the core's DMA moved, no CPU involved
+    uint64_t irqs;              // Handler entries
+    uint64_t causes[32];        // GINTSTS & GINTMSK bits seen on entry
+    uint64_t in_short;          // IN NAKs on an enabled EP short of a packet
+    uint64_t rx_full;           // OUT NAKs for Rx FIFO space
+    uint64_t errors;            // Accesses the core would get wrong
+} Otg_StatsTypeDef;
+
+/* Private */
+static uint8_t *Otg_Trap;           // The block the firmware sees, OTG_BASE
+static uint8_t *Otg_Mem;            // The model's mapping of the same pages
+static Otg_FifoTypeDef Otg_Rx;
+static Otg_FifoTypeDef Otg_Tx[OTG_NUM_EPS];
+static uint32_t Otg_RxData;         // Data words left of the popped status
+static uint8_t Otg_GoNak;           // Global OUT NAK, 1 set and 2 effective
+static uint32_t Otg_Frame;
+static Otg_StatsTypeDef Otg_Stats;
+static uint8_t Otg_Context;         // Index into the traffic counters
+
+// Access in flight between the fault and the single step trap
+static uint32_t Otg_AccessOff;
+static uint32_t Otg_AccessOld;
+static uint8_t Otg_AccessWrite;
+
+static uint64_t Sim_Time;
+static uint64_t Sim_FrameEnd;
+
+// Start of the static image, the DMA reaches from there to the heap's end
+extern char __executable_start[];
+
+/* Public */
+Sim_StatsTypeDef Sim_Stats;
+uint32_t SystemCoreClock = 180000000;
+
+/************************** Core model ****************************************/
+/* Otg_Used
+ * Words waiting in a FIFO
+ */
+static uint32_t Otg_Used(Otg_FifoTypeDef *fifo)
+{
+    return fifo->head - fifo->tail;
+}
+
+static void Otg_Push(Otg_FifoTypeDef *fifo, uint32_t word)
+{
+    fifo->word[fifo->head++ & (OTG_FIFO_RAM_WORDS - 1)] = word;
+}
+
+static uint32_t Otg_Pop(Otg_FifoTypeDef *fifo)
+{
+    return fifo->word[fifo->tail++ & (OTG_FIFO_RAM_WORDS - 1)];
+}
+
+/* Otg_TxDepth
+ * Tx FIFO size of an IN endpoint in words, as the firmware set it up
+ */
+static uint32_t Otg_TxDepth(uint8_t epnum)
+{
+    uint32_t cfg = (epnum == 0) ? OTG_GLB->DIEPTXF0_HNPTXFSIZ : OTG_GLB->DIEPTXF[epnum - 1];
+
+    return MIN(cfg >> 16, OTG_FIFO_RAM_WORDS);
+}
+
+/* Otg_Dma
+ * Returns 1 if the firmware put the core in buffer DMA mode
+ */
+static uint8_t Otg_Dma(void)
+{
+    return (OTG_GLB->GAHBCFG & USB_OTG_GAHBCFG_DMAEN) != 0;
+}
+
+/* Otg_DmaMove
+ * The core's DMA copying len bytes between a packet and the firmware's
+ * memory at *addr, which then moves past them. The address must be word
+ * aligned, the core drops the low bits, and in static memory or the heap.
+ */
+static void Otg_DmaMove(__IO uint32_t *addr, uint8_t *packet, uint32_t len, uint8_t to_mem)
+{
+    uint32_t at = *addr;
+    uint8_t *mem;
+
+    if(len == 0)
+    {
+        return;
+    }
+    if(at & 0x3)
+    {
+        Otg_Stats.errors++;
+        at &= ~0x3U;
+    }
+    mem = (uint8_t *)(uintptr_t)at;
+    if((mem < (uint8_t *)__executable_start) || (mem + len > (uint8_t *)sbrk(0)))
+    {
+        fprintf(stderr, "sim: DMA of %u bytes at %08x, outside static memory and the heap\n", len, at);
+        exit(1);
+    }
+
+    if(to_mem)
+    {
+        memcpy(mem, packet, len);
+    }
+    else
+    {
+        memcpy(packet, mem, len);
+    }
+    *addr = at + len;
+    Otg_Stats.dma_words += (len + 3) / 4;
+}
+
+static uint32_t Otg_RxFree(void)
+{
+    uint32_t depth = MIN(OTG_GLB->GRXFSIZ & 0xFFFF, OTG_FIFO_RAM_WORDS);
+    uint32_t used = Otg_Used(&Otg_Rx);
+
+    return (used < depth) ? depth - used : 0;
+}
+
+/* Otg_Mps
+ * Max packet of an endpoint, EP0 encodes it in two bits
+ */
+static uint32_t Otg_Mps(uint8_t epnum, uint32_t ctl)
+{
+    if(epnum == 0)
+    {
+        return 64 >> (ctl & 0x3);
+    }
+    return ctl & USB_OTG_DIEPCTL_MPSIZ;
+}
+
+/* Otg_Update
+ * Recomputes everything the core derives from its state: Tx FIFO status
+ * and empty flags, DAINT, the summary bits of GINTSTS and the Rx queue head
+ */
+static void Otg_Update(void)
+{
+    uint32_t daint = 0;
+    uint32_t gintsts;
+    uint8_t epnum;
+
+    for(epnum = 0; epnum < OTG_NUM_EPS; epnum++)
+    {
+        USB_OTG_INEndpointTypeDef *in = OTG_INEP(epnum);
+        uint32_t depth = Otg_TxDepth(epnum);
+        uint32_t used = Otg_Used(&Otg_Tx[epnum]);
+        uint32_t space = (used < depth) ? depth - used : 0;
+        uint32_t level = (OTG_GLB->GAHBCFG & USB_OTG_GAHBCFG_TXFELVL) ? depth : depth / 2;
+        uint32_t diepint = in->DIEPINT & ~USB_OTG_DIEPINT_TXFE;
+        uint32_t inmsk = OTG_DEV->DIEPMSK | (((OTG_DEV->DIEPEMPMSK >> epnum) & 0x1) << 7);
+
+        if((depth != 0) && (space >= level))
+        {
+            diepint |= USB_OTG_DIEPINT_TXFE;
+        }
+        in->DIEPINT = diepint;
+        in->DTXFSTS = space;
+
+        if(diepint & inmsk)
+        {
+            daint |= 1U << epnum;
+        }
+        if(OTG_OUTEP(epnum)->DOEPINT & OTG_DEV->DOEPMSK)
+        {
+            daint |= 0x10000U << epnum;
+        }
+    }
+    OTG_DEV->DAINT = daint;
+
+    /* CMOD stays 0, device mode */
+    gintsts = OTG_GLB->GINTSTS & OTG_GINTSTS_W1C;
+    if(Otg_Used(&Otg_Rx) > Otg_RxData)
+    {
+        gintsts |= USB_OTG_GINTSTS_RXFLVL;
+    }
+    if(Otg_GoNak == 2)
+    {
+        gintsts |= USB_OTG_GINTSTS_BOUTNAKEFF;
+    }
+    if(daint & OTG_DEV->DAINTMSK & 0xFFFF)
+    {
+        gintsts |= USB_OTG_GINTSTS_IEPINT;
+    }
+    if(daint & OTG_DEV->DAINTMSK & 0xFFFF0000)
+    {
+        gintsts |= USB_OTG_GINTSTS_OEPINT;
+    }
+    OTG_GLB->GINTSTS = gintsts;
+
+    OTG_GLB->GRXSTSR = (Otg_Used(&Otg_Rx) > Otg_RxData) ?
+                       Otg_Rx.word[(Otg_Rx.tail + Otg_RxData) & (OTG_FIFO_RAM_WORDS - 1)] : 0;
+}
+
+/* Otg_Latch
+ * Raises one of the latched GINTSTS causes
+ */
+static void Otg_Latch(uint32_t cause)
+{
+    OTG_GLB->GINTSTS |= cause;
+    Otg_Update();
+}
+
+/* Otg_Flush
+ * Empties the Tx FIFO of num, 0x10 for all of them
+ */
+static void Otg_FlushTx(uint32_t num)
+{
+    uint8_t epnum;
+
+    for(epnum = 0; epnum < OTG_NUM_EPS; epnum++)
+    {
+        if((num == 0x10) || (num == epnum))
+        {
+            Otg_Tx[epnum].tail = Otg_Tx[epnum].head;
+        }
+    }
+}
+
+static void Otg_FlushRx(void)
+{
+    Otg_Rx.tail = Otg_Rx.head;
+    Otg_RxData = 0;
+}
+
+/* Otg_RxPopStatus
+ * GRXSTSP read. Popping a completion is what raises XFRC or STUP.
+ */
+static uint32_t Otg_RxPopStatus(void)
+{
+    uint32_t status;
+    uint8_t epnum;
+
+    if(Otg_RxData != 0)
+    {
+        /* The core would hand the rest of the packet out as the next status */
+        Otg_Stats.errors++;
+        Otg_Rx.tail += Otg_RxData;
+        Otg_RxData = 0;
+    }
+    if(Otg_Used(&Otg_Rx) == 0)
+    {
+        Otg_Stats.errors++;
+        return 0;
+    }
+
+    status = Otg_Pop(&Otg_Rx);
+    epnum = status & USB_OTG_GRXSTSP_EPNUM;
+    switch((status & USB_OTG_GRXSTSP_PKTSTS) >> 17)
+    {
+        case STS_DATA_UPDT:
+        case STS_SETUP_UPDT:
+        Otg_RxData = ((((status & USB_OTG_GRXSTSP_BCNT) >> 4) + 3) / 4);
+        break;
+
+        case STS_XFER_COMP:
+        OTG_OUTEP(epnum)->DOEPINT |= USB_OTG_DOEPINT_XFRC;
+        break;
+
+        case STS_SETUP_COMP:
+        OTG_OUTEP(0)->DOEPINT |= USB_OTG_DOEPINT_STUP;
+        break;
+
+        case STS_GOUT_NAK:
+        Otg_GoNak = 2;
+        OTG_DEV->DCTL |= USB_OTG_DCTL_GONSTS;
+        break;
+
+        default:
+        break;
+    }
+    return status;
+}
+
+/* Otg_RxPopData
+ * DFIFO read, the next word of the popped packet
+ */
+static uint32_t Otg_RxPopData(void)
+{
+    if(Otg_RxData == 0)
+    {
+        Otg_Stats.errors++;
+        return 0;
+    }
+    Otg_RxData--;
+    return Otg_Pop(&Otg_Rx);
+}
+
+/* Otg_EpCtl
+ * DIEPCTL or DOEPCTL write. The two share their bit layout.
+ */
+static void Otg_EpCtl(__IO uint32_t *ctl, __IO uint32_t *intr, uint32_t old, uint32_t val)
+{
+    uint32_t nak = old & USB_OTG_DIEPCTL_NAKSTS;
+
+    if(val & USB_OTG_DIEPCTL_CNAK)
+    {
+        nak = 0;
+    }
+    if(val & USB_OTG_DIEPCTL_SNAK)
+    {
+        nak = USB_OTG_DIEPCTL_NAKSTS;
+    }
+    /* Enabling a busy endpoint again loses or repeats a transfer */
+    if((old & USB_OTG_DIEPCTL_EPENA) && (val & USB_OTG_DIEPCTL_EPENA) &&
+       (val & USB_OTG_DIEPCTL_CNAK))
+    {
+        fprintf(stderr, "sim: endpoint enabled while busy\n");
+        exit(1);
+    }
+    if((val & USB_OTG_DIEPCTL_EPDIS) && (old & USB_OTG_DIEPCTL_EPENA))
+    {
+        val &= ~USB_OTG_DIEPCTL_EPENA;
+        *intr |= USB_OTG_DIEPINT_EPDISD;
+    }
+    *ctl = (val & ~(OTG_EPCTL_ACTIONS | USB_OTG_DIEPCTL_NAKSTS)) | nak;
+}
+
+/* Otg_Read
+ * Ahead of a firmware load: makes the word hold what the core would return
+ */
+static void Otg_Read(uint32_t off)
+{
+    if(off >= USB_OTG_FIFO_BASE)
+    {
+        Otg_Stats.fifo_reads[Otg_Context]++;
+        OTG_REG(off) = Otg_RxPopData();
+        Otg_Update();
+        return;
+    }
+
+    Otg_Stats.reg_reads[Otg_Context]++;
+    if(off == OTG_OFF(GRXSTSP))
+    {
+        OTG_REG(off) = Otg_RxPopStatus();
+        Otg_Update();
+    }
+}
+
+/* Otg_Write
+ * After a firmware store of val over old: applies what the core does with it
+ */
+static void Otg_Write(uint32_t off, uint32_t old, uint32_t val)
+{
+    if(off >= USB_OTG_FIFO_BASE)
+    {
+        uint8_t epnum = (off - USB_OTG_FIFO_BASE) / USB_OTG_FIFO_SIZE;
+
+        Otg_Stats.fifo_writes[Otg_Context]++;
+        if(Otg_Used(&Otg_Tx[epnum]) >= Otg_TxDepth(epnum))
+        {
+            Otg_Stats.errors++;
+        }
+        else
+        {
+            Otg_Push(&Otg_Tx[epnum], val);
+        }
+        Otg_Update();
+        return;
+    }
+
+    Otg_Stats.reg_writes[Otg_Context]++;
+    if(off == OTG_OFF(GINTSTS))
+    {
+        OTG_REG(off) = old & ~(val & OTG_GINTSTS_W1C);
+    }
+    else if(off == OTG_OFF(GRSTCTL))
+    {
+        if(val & USB_OTG_GRSTCTL_CSRST)
+        {
+            Otg_FlushTx(0x10);
+            Otg_FlushRx();
+            Otg_GoNak = 0;
+            OTG_GLB->GINTSTS = 0;
+        }
+        if(val & USB_OTG_GRSTCTL_TXFFLSH)
+        {
+            Otg_FlushTx((val & USB_OTG_GRSTCTL_TXFNUM) >> 6);
+        }
+        if(val & USB_OTG_GRSTCTL_RXFFLSH)
+        {
+            Otg_FlushRx();
+        }
+        /* Every reset and flush is done by the next read */
+        OTG_REG(off) = USB_OTG_GRSTCTL_AHBIDL;
+    }
+    else if((off == OTG_OFF(GRXSTSR)) || (off == OTG_OFF(GRXSTSP)) ||
+            (off == USB_OTG_DEVICE_BASE + offsetof(USB_OTG_DeviceTypeDef, DAINT)))
+    {
+        OTG_REG(off) = old;
+    }
+    else if(off == USB_OTG_DEVICE_BASE + offsetof(USB_OTG_DeviceTypeDef, DCTL))
+    {
+        OTG_REG(off) = (val & ~(OTG_DCTL_ACTIONS | USB_OTG_DCTL_GONSTS)) | (old & USB_OTG_DCTL_GONSTS);
+        /* In slave mode the NAK takes effect when its status entry, queued
+           behind the packets already received, is popped. The DMA has
+           nothing queued. */
+        if((val & USB_OTG_DCTL_SGONAK) && (Otg_GoNak == 0) && Otg_Dma())
+        {
+            Otg_GoNak = 2;
+            OTG_DEV->DCTL |= USB_OTG_DCTL_GONSTS;
+        }
+        else if((val & USB_OTG_DCTL_SGONAK) && (Otg_GoNak == 0))
+        {
+            Otg_GoNak = 1;
+            Otg_Push(&Otg_Rx, OTG_RXSTS(0, 0, STS_GOUT_NAK));
+        }
+        if(val & USB_OTG_DCTL_CGONAK)
+        {
+            Otg_GoNak = 0;
+            OTG_DEV->DCTL &= ~USB_OTG_DCTL_GONSTS;
+        }
+    }
+    else if((off >= USB_OTG_IN_ENDPOINT_BASE) && (off < USB_OTG_OUT_ENDPOINT_BASE))
+    {
+        uint8_t epnum = (off - USB_OTG_IN_ENDPOINT_BASE) / USB_OTG_EP_REG_SIZE;
+        USB_OTG_INEndpointTypeDef *in = OTG_INEP(epnum);
+
+        switch((off - USB_OTG_IN_ENDPOINT_BASE) % USB_OTG_EP_REG_SIZE)
+        {
+            case offsetof(USB_OTG_INEndpointTypeDef, DIEPCTL):
+            Otg_EpCtl(&in->DIEPCTL, &in->DIEPINT, old, val);
+            break;
+
+            case offsetof(USB_OTG_INEndpointTypeDef, DIEPINT):
+            in->DIEPINT = old & ~(val & ~USB_OTG_DIEPINT_TXFE);
+            break;
+
+            case offsetof(USB_OTG_INEndpointTypeDef, DTXFSTS):
+            in->DTXFSTS = old;
+            break;
+
+            default:
+            break;
+        }
+    }
+    else if((off >= USB_OTG_OUT_ENDPOINT_BASE) && (off < USB_OTG_OUT_ENDPOINT_BASE + OTG_NUM_EPS * USB_OTG_EP_REG_SIZE))
+    {
+        uint8_t epnum = (off - USB_OTG_OUT_ENDPOINT_BASE) / USB_OTG_EP_REG_SIZE;
+        USB_OTG_OUTEndpointTypeDef *out = OTG_OUTEP(epnum);
+
+        switch((off - USB_OTG_OUT_ENDPOINT_BASE) % USB_OTG_EP_REG_SIZE)
+        {
+            case offsetof(USB_OTG_OUTEndpointTypeDef, DOEPCTL):
+            Otg_EpCtl(&out->DOEPCTL, &out->DOEPINT, old, val);
+            break;
+
+            case offsetof(USB_OTG_OUTEndpointTypeDef, DOEPINT):
+            out->DOEPINT = old & ~val;
+            break;
+
+            default:
+            break;
+        }
+    }
+
+    Otg_Update();
+}
+
+/* Otg_Fault
+ * A firmware access to the register block. Runs the read side of the
+ * model, opens the pages and steps over the instruction.
+ */
+static void Otg_Fault(int sig, siginfo_t *info, void *context)
+{
+    ucontext_t *uc = (ucontext_t *)context;
+    uintptr_t addr = (uintptr_t)info->si_addr;
+
+    if((addr < OTG_BASE) || (addr >= OTG_BASE + OTG_TRAP_SIZE))
+    {
+        /* Not ours, fault again without the handler */
+        signal(SIGSEGV, SIG_DFL);
+        return;
+    }
+
+    Otg_AccessOff = (uint32_t)(addr - OTG_BASE) & ~0x3U;
+    Otg_AccessWrite = (uc->uc_mcontext.gregs[REG_ERR] & OTG_PF_WRITE) != 0;
+    if(!Otg_AccessWrite)
+    {
+        Otg_Read(Otg_AccessOff);
+    }
+    Otg_AccessOld = OTG_REG(Otg_AccessOff);
+
+    mprotect(Otg_Trap, OTG_TRAP_SIZE, PROT_READ | PROT_WRITE);
+    uc->uc_mcontext.gregs[REG_EFL] |= OTG_EFLAGS_TF;
+}
+
+/* Otg_Step
+ * The access is done. Closes the pages and runs the write side.
+ */
+static void Otg_Step(int sig, siginfo_t *info, void *context)
+{
+    ucontext_t *uc = (ucontext_t *)context;
+
+    uc->uc_mcontext.gregs[REG_EFL] &= ~OTG_EFLAGS_TF;
+    mprotect(Otg_Trap, OTG_TRAP_SIZE, PROT_NONE);
+
+    if(Otg_AccessWrite)
+    {
+        Otg_Write(Otg_AccessOff, Otg_AccessOld, OTG_REG(Otg_AccessOff));
+    }
+}
+
+/* Otg_Dispatch
+ * What the NVIC does while the OTG line is up: enter the handler, then run
+ * a PendSV it pended on the way out
+ */
+static void Otg_Dispatch(void)
+{
+    uint32_t storm = 0;
+
+    for(;;)
+    {
+        uint32_t pending = OTG_GLB->GINTSTS & OTG_GLB->GINTMSK;
+        uint8_t bit;
+
+        if(((OTG_GLB->GAHBCFG & USB_OTG_GAHBCFG_GINT) == 0) || (pending == 0) ||
+           ((NVIC->ISER[OTG_HS_IRQn >> 5] & (1UL << (OTG_HS_IRQn & 0x1F))) == 0))
+        {
+            break;
+        }
+        if(++storm > OTG_IRQ_STORM)
+        {
+            fprintf(stderr, "sim: OTG interrupt stuck, GINTSTS %08x GINTMSK %08x\n",
+                    OTG_GLB->GINTSTS, OTG_GLB->GINTMSK);
+            exit(1);
+        }
+
+        Otg_Stats.irqs++;
+        for(bit = 0; bit < 32; bit++)
+        {
+            if(pending & (1U << bit))
+            {
+                Otg_Stats.causes[bit]++;
+            }
+        }
+        if(pending & USB_OTG_GINTSTS_SOF)
+        {
+            Sim_Stats.sof_irqs++;
+        }
+
+        Otg_Context = 1;
+        OTG_HS_IRQHandler();
+
+        if(SCB->ICSR & SCB_ICSR_PENDSVSET_Msk)
+        {
+            SCB->ICSR &= ~SCB_ICSR_PENDSVSET_Msk;
+            Sim_Stats.bh_runs++;
+            PendSV_Handler();
+        }
+        Otg_Context = 0;
+    }
+}
+
+/* Sim_Clock
+ * Moves the simulated time on, the DWT cycle counter follows it
+ */
+static void Sim_Clock(uint64_t ns)
+{
+    Sim_Time += ns;
+    DWT->CYCCNT = (uint32_t)((Sim_Time * (SystemCoreClock / 1000000)) / 1000);
+}
+
+/* Sim_BusTime
+ * Charges a transaction of len bytes on the wire
+ */
+static void Sim_BusTime(uint32_t len)
+{
+    Sim_Clock(((uint64_t)len * 1000) / SIM_BUS_BYTES_PER_US);
+}
+
+/* Sim_StartFrame
+ * Starts a microframe now, the core latches its SOF
+ */
+static void Sim_StartFrame(void)
+{
+    Otg_Dispatch();
+    Sim_FrameEnd = Sim_Time + SIM_UFRAME_NS;
+    Sim_Stats.sofs++;
+
+    Otg_Frame++;
+    OTG_DEV->DSTS = (OTG_DEV->DSTS & ~USB_OTG_DSTS_FNSOF) | ((Otg_Frame << 8) & USB_OTG_DSTS_FNSOF);
+    Otg_Latch(USB_OTG_GINTSTS_SOF);
+    Otg_Dispatch();
+}
+
+/* Sim_FrameCheck
+ * Ahead of a transaction, starts the next microframe if this one is over.
+ * A transaction running past the end of a microframe stretches it.
+ */
+static void Sim_FrameCheck(void)
+{
+    if(Sim_Time >= Sim_FrameEnd)
+    {
+        Sim_StartFrame();
+    }
+}
+
+/* Sim_Map
+ * Places a mapping at the address the firmware expects, or gives up
+ */
+static void *Sim_Map(uintptr_t addr, size_t size, int prot, int flags, int fd)
+{
+    void *map = mmap((void *)addr, size, prot, flags, fd, 0);
+
+    if((map == MAP_FAILED) || ((flags & (MAP_FIXED | MAP_FIXED_NOREPLACE)) && ((uintptr_t)map != addr)))
+    {
+        fprintf(stderr, "sim: cannot map %zu bytes at %08lx\n", size, (unsigned long)addr);
+        exit(1);
+    }
+    return map;
+}
+
+/************************** Host side *****************************************/
+/* Sim_Init
+ * Maps the register block and the memory around it, installs the traps
+ */
+void Sim_Init(void)
+{
+    struct sigaction sa;
+    int fd;
+
+    Sim_Map(SIM_PERIPH_BASE, SIM_PERIPH_SIZE, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1);
+    Sim_Map(SIM_PPB_BASE, SIM_PPB_SIZE, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1);
+
+    /* The OTG pages twice: trapping at their address, open for the model */
+    fd = memfd_create("sim_otg", 0);
+    if((fd < 0) || (ftruncate(fd, OTG_TRAP_SIZE) != 0))
+    {
+        perror("sim: memfd");
+        exit(1);
+    }
+    Otg_Trap = Sim_Map(OTG_BASE, OTG_TRAP_SIZE, PROT_NONE, MAP_SHARED | MAP_FIXED, fd);
+    Otg_Mem = Sim_Map(0, OTG_TRAP_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd);
+    close(fd);
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_flags = SA_SIGINFO;
+    sa.sa_sigaction = Otg_Fault;
+    sigaction(SIGSEGV, &sa, NULL);
+    sa.sa_sigaction = Otg_Step;
+    sigaction(SIGTRAP, &sa, NULL);
+
+    OTG_GLB->GRSTCTL = USB_OTG_GRSTCTL_AHBIDL;
+    Otg_Update();
+}
+
+/* Sim_Now
+ * Returns the simulated time in ns
+ */
+uint64_t Sim_Now(void)
+{
+    return Sim_Time;
+}
+
+/* Sim_Advance
+ * Lets the bus idle for ns, starting each microframe on time
+ */
+void Sim_Advance(uint64_t ns)
+{
+    uint64_t end = Sim_Time + ns;
+
+    while(Sim_FrameEnd <= end)
+    {
+        if(Sim_Time < Sim_FrameEnd)
+        {
+            Sim_Clock(Sim_FrameEnd - Sim_Time);
+        }
+        Sim_StartFrame();
+    }
+    Sim_Clock(end - Sim_Time);
+}
+
+/* Sim_BusReset
+ * Resets the bus and enumerates at high speed
+ */
+void Sim_BusReset(void)
+{
+    Otg_Dispatch();
+    if(OTG_DEV->DCTL & USB_OTG_DCTL_SDIS)
+    {
+        fprintf(stderr, "sim: reset while the device is soft disconnected\n");
+    }
+
+    Otg_Latch(USB_OTG_GINTSTS_USBRST);
+    Otg_Dispatch();
+
+    OTG_DEV->DSTS &= ~USB_OTG_DSTS_ENUMSPD;     // High speed
+    Otg_Latch(USB_OTG_GINTSTS_ENUMDNE);
+    Otg_Dispatch();
+}
+
+/* Sim_Sof
+ * Waits for the current microframe to end and starts the next one
+ */
+void Sim_Sof(void)
+{
+    Otg_Dispatch();
+    if(Sim_Time < Sim_FrameEnd)
+    {
+        Sim_Clock(Sim_FrameEnd - Sim_Time);
+    }
+    Sim_StartFrame();
+}
+
+/* Sim_In
+ * One IN token. The core sends the next packet once the whole of it is in
+ * the Tx FIFO and NAKs otherwise. In DMA mode it fetches the packet from
+ * DIEPDMA instead.
+ */
+int Sim_In(uint8_t ep_addr, uint8_t *buf)
+{
+    uint8_t epnum = ep_addr & 0x0F;
+    USB_OTG_INEndpointTypeDef *in = OTG_INEP(epnum);
+    uint32_t ctl, tsiz, pktcnt, xfrsiz, len, pos;
+
+    Sim_FrameCheck();
+    Otg_Dispatch();
+
+    ctl = in->DIEPCTL;
+    if(ctl & USB_OTG_DIEPCTL_STALL)
+    {
+        Sim_BusTime(SIM_NAK_OVERHEAD);
+        return SIM_STALL;
+    }
+
+    tsiz = in->DIEPTSIZ;
+    pktcnt = (tsiz & USB_OTG_DIEPTSIZ_PKTCNT) >> 19;
+    xfrsiz = tsiz & USB_OTG_DIEPTSIZ_XFRSIZ;
+    len = MIN(xfrsiz, Otg_Mps(epnum, ctl));
+
+    if(((ctl & USB_OTG_DIEPCTL_EPENA) == 0) || (ctl & USB_OTG_DIEPCTL_NAKSTS) || (pktcnt == 0) ||
+       (!Otg_Dma() && (Otg_Used(&Otg_Tx[epnum]) < (len + 3) / 4)))
+    {
+        if((ctl & USB_OTG_DIEPCTL_EPENA) && !(ctl & USB_OTG_DIEPCTL_NAKSTS) && (pktcnt != 0))
+        {
+            Otg_Stats.in_short++;
+        }
+        Sim_Stats.in_naks++;
+        Sim_BusTime(SIM_NAK_OVERHEAD);
+        return SIM_NAK;
+    }
+
+    if(Otg_Dma())
+    {
+        Otg_DmaMove(&in->DIEPDMA, buf, len, 0);
+    }
+    else
+    {
+        for(pos = 0; pos < len; pos += 4)
+        {
+            uint32_t word = Otg_Pop(&Otg_Tx[epnum]);
+            memcpy(buf + pos, &word, MIN(4, len - pos));
+        }
+    }
+
+    pktcnt--;
+    xfrsiz -= len;
+    in->DIEPTSIZ = (tsiz & ~(USB_OTG_DIEPTSIZ_PKTCNT | USB_OTG_DIEPTSIZ_XFRSIZ)) | (pktcnt << 19) | xfrsiz;
+    if(pktcnt == 0)
+    {
+        in->DIEPCTL = ctl & ~USB_OTG_DIEPCTL_EPENA;
+        in->DIEPINT |= USB_OTG_DIEPINT_XFRC;
+        Sim_Stats.xfer_irqs++;
+    }
+
+    Sim_Stats.in_packets++;
+    Sim_Stats.in_bytes += len;
+    Sim_BusTime(len + SIM_PACKET_OVERHEAD);
+    Otg_Update();
+    Otg_Dispatch();
+
+    return (int)len;
+}
+
+/* Sim_Out
+ * One OUT transaction. The core takes the packet into the Rx FIFO while
+ * the endpoint has packets left and there is room, and NAKs otherwise. In
+ * DMA mode it stores the packet at DOEPDMA and raises XFRC itself.
+ */
+int Sim_Out(uint8_t ep_addr, const uint8_t *buf, uint32_t len)
+{
+    uint8_t epnum = ep_addr & 0x0F;
+    USB_OTG_OUTEndpointTypeDef *out = OTG_OUTEP(epnum);
+    uint32_t ctl, tsiz, pktcnt, xfrsiz, pos;
+
+    Sim_FrameCheck();
+    Otg_Dispatch();
+
+    ctl = out->DOEPCTL;
+    if(ctl & USB_OTG_DOEPCTL_STALL)
+    {
+        Sim_BusTime(len + SIM_NAK_OVERHEAD);
+        return SIM_STALL;
+    }
+
+    tsiz = out->DOEPTSIZ;
+    pktcnt = (tsiz & USB_OTG_DOEPTSIZ_PKTCNT) >> 19;
+    xfrsiz = tsiz & USB_OTG_DOEPTSIZ_XFRSIZ;
+
+    /* Room for the status, the data and the completion behind it */
+    if(((ctl & USB_OTG_DOEPCTL_EPENA) == 0) || (ctl & USB_OTG_DOEPCTL_NAKSTS) || (pktcnt == 0) ||
+       (Otg_GoNak != 0) || (!Otg_Dma() && (Otg_RxFree() < ((len + 3) / 4) + 2)))
+    {
+        if((ctl & USB_OTG_DOEPCTL_EPENA) && !(ctl & USB_OTG_DOEPCTL_NAKSTS) && (pktcnt != 0) &&
+           (Otg_GoNak == 0))
+        {
+            Otg_Stats.rx_full++;
+        }
+        Sim_Stats.out_naks++;
+        Sim_BusTime(len + SIM_NAK_OVERHEAD);
+        return SIM_NAK;
+    }
+
+    if(Otg_Dma())
+    {
+        Otg_DmaMove(&out->DOEPDMA, (uint8_t *)buf, len, 1);
+    }
+    else
+    {
+        Otg_Push(&Otg_Rx, OTG_RXSTS(epnum, len, STS_DATA_UPDT));
+        for(pos = 0; pos < len; pos += 4)
+        {
+            uint32_t word = 0;
+            memcpy(&word, buf + pos, MIN(4, len - pos));
+            Otg_Push(&Otg_Rx, word);
+        }
+    }
+
+    pktcnt--;
+    xfrsiz = (len < xfrsiz) ? xfrsiz - len : 0;
+    out->DOEPTSIZ = (tsiz & ~(USB_OTG_DOEPTSIZ_PKTCNT | USB_OTG_DOEPTSIZ_XFRSIZ)) | (pktcnt << 19) | xfrsiz;
+    if((pktcnt == 0) || (len < Otg_Mps(epnum, ctl)))
+    {
+        out->DOEPCTL = ctl & ~USB_OTG_DOEPCTL_EPENA;
+        if(Otg_Dma())
+        {
+            out->DOEPINT |= USB_OTG_DOEPINT_XFRC;
+        }
+        else
+        {
+            Otg_Push(&Otg_Rx, OTG_RXSTS(epnum, 0, STS_XFER_COMP));
+        }
+        Sim_Stats.xfer_irqs++;
+    }
+
+    Sim_Stats.out_packets++;
+    Sim_Stats.out_bytes += len;
+    Sim_BusTime(len + SIM_PACKET_OVERHEAD);
+    Otg_Update();
+    Otg_Dispatch();
+
+    return 0;
+}
+
+/* Sim_Setup
+ * One SETUP transaction. The core always takes it, sets NAK on both
+ * directions of EP0 and clears their stall. In DMA mode it stores the
+ * packet at DOEPDMA, which USB_EP0_OutStart must have armed, and ends the
+ * EP0 OUT transfer with STUP.
+ */
+int Sim_Setup(const uint8_t *setup)
+{
+    uint32_t word;
+    uint32_t tsiz;
+
+    Sim_FrameCheck();
+    Otg_Dispatch();
+
+    if(Otg_Dma())
+    {
+        if((OTG_OUTEP(0)->DOEPCTL & USB_OTG_DOEPCTL_EPENA) == 0)
+        {
+            Otg_Stats.errors++;
+        }
+        Otg_DmaMove(&OTG_OUTEP(0)->DOEPDMA, (uint8_t *)setup, 8, 1);
+        OTG_OUTEP(0)->DOEPCTL &= ~USB_OTG_DOEPCTL_EPENA;
+        OTG_OUTEP(0)->DOEPINT |= USB_OTG_DOEPINT_STUP;
+    }
+    else
+    {
+        if(Otg_RxFree() < 4)
+        {
+            Otg_Stats.errors++;
+        }
+        Otg_Push(&Otg_Rx, OTG_RXSTS(0, 8, STS_SETUP_UPDT));
+        memcpy(&word, setup, 4);
+        Otg_Push(&Otg_Rx, word);
+        memcpy(&word, setup + 4, 4);
+        Otg_Push(&Otg_Rx, word);
+        Otg_Push(&Otg_Rx, OTG_RXSTS(0, 0, STS_SETUP_COMP));
+    }
+
+    OTG_INEP(0)->DIEPCTL = (OTG_INEP(0)->DIEPCTL & ~USB_OTG_DIEPCTL_STALL) | USB_OTG_DIEPCTL_NAKSTS;
+    OTG_OUTEP(0)->DOEPCTL = (OTG_OUTEP(0)->DOEPCTL & ~USB_OTG_DOEPCTL_STALL) | USB_OTG_DOEPCTL_NAKSTS;
+    tsiz = OTG_OUTEP(0)->DOEPTSIZ;
+    if(tsiz & USB_OTG_DOEPTSIZ_STUPCNT)
+    {
+        OTG_OUTEP(0)->DOEPTSIZ = tsiz - (1U << 29);
+    }
+
+    Sim_Stats.setups++;
+    Sim_BusTime(8 + SIM_PACKET_OVERHEAD);
+    Otg_Update();
+    Otg_Dispatch();
+
+    return 0;
+}
+
+/* Sim_Report
+ * Core traffic per MB of payload moved on the bus
+ */
+void Sim_Report(void)
+{
+    static const struct { uint8_t bit; const char *name; } cause[] = {
+        { 3, "SOF" }, { 4, "RXFLVL" }, { 12, "USBRST" }, { 13, "ENUMDNE" },
+        { 18, "IEPINT" }, { 19, "OEPINT" }
+    };
+    double mb = (Sim_Stats.in_bytes + Sim_Stats.out_bytes) / 1e6;
+    uint8_t idx;
+
+    if(mb == 0)
+    {
+        return;
+    }
+    printf("otg per MB: %.0f interrupts, %.0f FIFO words written, %.0f read, %.0f moved by DMA\n",
+           Otg_Stats.irqs / mb,
+           (Otg_Stats.fifo_writes[0] + Otg_Stats.fifo_writes[1]) / mb,
+           (Otg_Stats.fifo_reads[0] + Otg_Stats.fifo_reads[1]) / mb, Otg_Stats.dma_words / mb);
+    printf("otg per MB: %.0f register reads and %.0f writes in interrupts, %.0f and %.0f in thread mode\n",
+           Otg_Stats.reg_reads[1] / mb, Otg_Stats.reg_writes[1] / mb,
+           Otg_Stats.reg_reads[0] / mb, Otg_Stats.reg_writes[0] / mb);
+    printf("otg per MB, interrupt causes:");
+    for(idx = 0; idx < sizeof(cause) / sizeof(cause[0]); idx++)
+    {
+        printf(" %s %.0f", cause[idx].name, Otg_Stats.causes[cause[idx].bit] / mb);
+    }
+    printf("\notg: %llu IN NAKs short of a packet, %llu OUT NAKs for Rx FIFO space, %llu model errors\n",
+           (unsigned long long)Otg_Stats.in_short, (unsigned long long)Otg_Stats.rx_full,
+           (unsigned long long)Otg_Stats.errors);
+}
+
+/************************** HAL time base *************************************/
+// SysTick never runs, the HAL reads simulated time and waits by moving it
+uint32_t HAL_GetTick(void)
+{
+    return (uint32_t)(Sim_Time / 1000000);
+}
+
+void HAL_Delay(uint32_t Delay)
+{
+    Sim_Clock((uint64_t)Delay * 1000000);
+}
+
+void HAL_IncTick(void)
+{
+}
+
+// USE_FULL_ASSERT is on in dev/stm32f4xx_hal_conf.h, main.c breaks there
+void assert_failed(uint8_t *file, uint32_t line)
+{
+    fprintf(stderr, "sim: HAL assert at %s:%u\n", (char *)file, line);
+    exit(1);
+}
+
+/********************************** EOF ***************************************/
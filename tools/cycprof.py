@@ -0,0 +1,128 @@
+#!/usr/bin/env python3
+"""
+Cycle profile reader
+
+This file is part of stm32-usb-dualcdc, an implementation of Dual VCP ports
+over USB for STM32F4xx controllers.
+This project is available at
+<https://github.com/jisszacharia/stm32-usb-dualcdc>
+
+Reads the probe points and the main loop idle time kept by app/cycprof.c,
+built with CYCPROF_ENABLE=1, over the DCDC_VREQ_GET_PROFILE vendor request
+(needs pyusb), and prints them with the CPU load of the interval.
+
+    cycprof.py              everything since start up or the last reset
+    cycprof.py -t 10        restart the counts, wait 10 s, then print
+    cycprof.py -s 10        10 s each with the SOF interrupt gated and kept
+                            on by DCDC_VREQ_SET_SOF, leave the device idle
+"""
+
+import argparse
+import struct
+import sys
+import time
+
+USBD_VID = 0x0483
+USBD_PID = 0x5741
+DCDC_VREQ_GET_PROFILE = 0x01
+DCDC_VREQ_SET_SOF = 0x06
+DCDC_VREQ_RESET = 0x0001
+
+CYCPROF_BUCKETS = 20
+HEADER = struct.Struct('<IIIIQ')     # core_clock, num, elapsed_ms, reserved, idle_cycles
+STAT = struct.Struct('<QIIII%dI' % CYCPROF_BUCKETS)   # sum, count, min, max, reserved, hist
+
+# CYCPROF_x in probe order
+PROBES = ['irq', 'datain', 'dataout', 'receive', 'txcomplete', 'sof', 'bh',
+          'fifowr', 'fiford', 'irqlat']
+
+
+def open_device():
+    import usb.core
+
+    dev = usb.core.find(idVendor=USBD_VID, idProduct=USBD_PID)
+    if dev is None:
+        sys.exit('cycprof: device %04x:%04x not found' % (USBD_VID, USBD_PID))
+    return dev
+
+
+def read_profile(dev, reset):
+    # Vendor, device recipient, so no interface has to be claimed
+    head = bytes(dev.ctrl_transfer(0xC0, DCDC_VREQ_GET_PROFILE, 0, 0, HEADER.size))
+    num = HEADER.unpack_from(head)[1]
+    return bytes(dev.ctrl_transfer(0xC0, DCDC_VREQ_GET_PROFILE,
+                                   DCDC_VREQ_RESET if reset else 0, 0,
+                                   HEADER.size + num * STAT.size))
+
+
+def percentile(hist, pct):
+    """Upper bound in cycles of the pct percentile, bucket k being < 2^k"""
+    total = sum(hist)
+    run = 0
+    for k, n in enumerate(hist):
+        run += n
+        if total and run * 100 >= total * pct:
+            return 1 << k
+    return 0
+
+
+def idle_share(dump):
+    """Idle cycles and their share of the interval in percent"""
+    clock, _, elapsed_ms, _, idle = HEADER.unpack_from(dump)
+    cycles = elapsed_ms * (clock // 1000)
+    return idle, (100.0 * idle / cycles) if cycles else 0.0
+
+
+def show(dump):
+    clock, num, elapsed_ms, _, idle = HEADER.unpack_from(dump)
+    per_us = max(clock // 1000000, 1)
+    cycles = elapsed_ms * (clock // 1000)
+    load = 100.0 * (1.0 - idle / cycles) if cycles else 0.0
+    print('%d ms at %d MHz, idle %d cycles, CPU load %.2f %%' %
+          (elapsed_ms, per_us, idle, load))
+    print('%-11s %10s %10s %10s %10s %10s %10s %8s' %
+          ('probe', 'count', 'min', 'mean', 'max', 'p99 <', 'total us', 'load %'))
+
+    for probe in range(num):
+        fields = STAT.unpack_from(dump, HEADER.size + probe * STAT.size)
+        total, count, low, high = fields[0:4]
+        hist = fields[5:]
+        name = PROBES[probe] if probe < len(PROBES) else str(probe)
+        if count == 0:
+            print('%-11s %10d' % (name, 0))
+            continue
+        print('%-11s %10d %10d %10d %10d %10d %10.0f %8.3f' %
+              (name, count, low, total // count, high, percentile(hist, 99),
+               total / per_us, 100.0 * total / cycles if cycles else 0.0))
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Read the dualcdc cycle profile')
+    parser.add_argument('-t', '--time', type=float,
+                        help='restart the counts and measure this many seconds')
+    parser.add_argument('-s', '--sof', type=float,
+                        help='measure this many seconds with SOF gated, then as many with it on')
+    args = parser.parse_args()
+
+    dev = open_device()
+    if args.sof is not None:
+        idle = []
+        for on in (0, 1):
+            dev.ctrl_transfer(0x40, DCDC_VREQ_SET_SOF, on, 0, None)
+            read_profile(dev, True)
+            time.sleep(args.sof)
+            dump = read_profile(dev, False)
+            print('SOF %s:' % ('on' if on else 'gated'))
+            show(dump)
+            idle.append(idle_share(dump))
+        dev.ctrl_transfer(0x40, DCDC_VREQ_SET_SOF, 0, 0, None)
+        print('idle %.2f %% gated, %.2f %% with SOF on' % (idle[0][1], idle[1][1]))
+        return
+    if args.time is not None:
+        read_profile(dev, True)
+        time.sleep(args.time)
+    show(read_profile(dev, False))
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,200 @@
+#!/usr/bin/env python3
+"""
+PRBS self-test host
+
+This file is part of stm32-usb-dualcdc, an implementation of Dual VCP ports
+over USB for STM32F4xx controllers.
+This project is available at
+<https://github.com/jisszacharia/stm32-usb-dualcdc>
+
+Runs the self-test of app/selftest.c, built with SELFTEST_ENABLE=1. The
+ports are put under test with the DCDC_VREQ_SET_SELFTEST vendor request and
+the device's counts read back with DCDC_VREQ_GET_SELFTEST (needs pyusb).
+The ttys are given in port order and carry the data:
+
+    both    the host loops each port's IN back to its OUT, the device
+            checks what it sent, full duplex (default)
+    source  the host drains IN
+    sink    the host sends PRBS-31 on OUT
+
+    selftest.py /dev/ttyACM0 /dev/ttyACM1           both ways, 10 s
+    selftest.py -m source -t 30 /dev/ttyACM0
+    selftest.py -m off                              all ports back to the demo
+
+Exits with 0 only if every port tested moved data without a bit error or a
+loss of step.
+"""
+
+import argparse
+import os
+import select
+import struct
+import sys
+import termios
+import threading
+import time
+import tty
+
+USBD_VID = 0x0483
+USBD_PID = 0x5741
+DCDC_VREQ_GET_SELFTEST = 0x04
+DCDC_VREQ_SET_SELFTEST = 0x05
+DCDC_VREQ_RESET = 0x0001
+
+MODES = {'off': 0, 'source': 1, 'sink': 2, 'both': 3}
+MODE_NAMES = {v: k for k, v in MODES.items()}
+
+# tx_bytes, rx_bytes, bit_errors, frames, frame_us, tx_mbs_x1000, rx_mbs_x1000,
+# sync_loss, mode, locked, reserved
+RESULT = struct.Struct('<QQQIIIIIBBH')
+
+CHUNK = 65536
+
+
+class Prbs31:
+    """PRBS-31 bytes as the device sends them, x^31 + x^28 + 1, MSB first.
+
+    Bit n is bit n-28 xor bit n-31, and so also bit n-28k xor bit n-31k for
+    k a power of 2. With k = 65536 both distances are whole bytes and a
+    block of 28 * 8192 bytes is one xor of two older blocks.
+    """
+
+    NEAR = 28 * 8192
+    FAR = 31 * 8192
+
+    def __init__(self, seed=0x7FFFFFFF):
+        s = seed
+        hist = bytearray(self.FAR)
+        for i in range(self.FAR):
+            b = ((s >> 20) ^ (s >> 23)) & 0xFF
+            s = ((s << 8) | b) & 0x7FFFFFFF
+            hist[i] = b
+        self.hist = bytes(hist)
+        self.pos = 0
+
+    def block(self):
+        """Next NEAR bytes of the stream"""
+        out = self.hist[self.pos:]
+        near = int.from_bytes(self.hist[-self.NEAR:], 'big')
+        far = int.from_bytes(self.hist[:self.NEAR], 'big')
+        self.hist = self.hist[self.NEAR:] + (near ^ far).to_bytes(self.NEAR, 'big')
+        self.pos = self.FAR - self.NEAR
+        return out
+
+
+def open_device():
+    import usb.core
+
+    dev = usb.core.find(idVendor=USBD_VID, idProduct=USBD_PID)
+    if dev is None:
+        sys.exit('selftest: device %04x:%04x not found' % (USBD_VID, USBD_PID))
+    return dev
+
+
+def set_mode(dev, port, mode):
+    # Vendor, device recipient, so no interface has to be claimed
+    dev.ctrl_transfer(0x40, DCDC_VREQ_SET_SELFTEST, (port << 8) | mode, 0, None)
+
+
+def get_results(dev, reset):
+    data = bytes(dev.ctrl_transfer(0xC0, DCDC_VREQ_GET_SELFTEST,
+                                   DCDC_VREQ_RESET if reset else 0, 0, 4 * RESULT.size))
+    return [RESULT.unpack_from(data, off)
+            for off in range(0, len(data) - RESULT.size + 1, RESULT.size)]
+
+
+def open_tty(path):
+    fd = os.open(path, os.O_RDWR | os.O_NOCTTY)
+    tty.setraw(fd)
+    termios.tcflush(fd, termios.TCIOFLUSH)
+    return fd
+
+
+def pump(fd, mode, stop):
+    """Moves the data of one port until stop is set"""
+    prbs = Prbs31() if mode == 'sink' else None
+    pending = b''
+
+    while not stop.is_set():
+        # Looped data waits for OUT, reading on would only buffer it here
+        want_read = mode != 'sink' and len(pending) < 4 * CHUNK
+        want_write = bool(pending) or prbs is not None
+        rd, wr, _ = select.select([fd] if want_read else [],
+                                  [fd] if want_write else [], [], 0.2)
+        if rd:
+            data = os.read(fd, CHUNK)
+            if mode == 'both':
+                pending += data
+        if wr:
+            if not pending and prbs is not None:
+                pending = prbs.block()
+            pending = pending[os.write(fd, pending[:CHUNK]):]
+
+
+def show(results, ports):
+    ok = True
+    for port, res in enumerate(results[:ports], 1):
+        (tx_bytes, rx_bytes, errors, frames, frame_us, tx_mbs_x1000, rx_mbs_x1000,
+         sync_loss, mode, locked, _) = res
+        name = MODE_NAMES.get(mode, str(mode))
+        secs = frames * frame_us / 1e6
+        print('port %d %-6s %8.3f s  tx %14d B %8.3f MB/s  rx %14d B %8.3f MB/s  '
+              '%d bit errors  %d sync losses%s' %
+              (port, name, secs, tx_bytes, tx_mbs_x1000 / 1000.0, rx_bytes, rx_mbs_x1000 / 1000.0,
+               errors, sync_loss, '' if locked or not (mode & 2) else '  NOT LOCKED'))
+        if (mode & 1) and tx_bytes == 0:
+            ok = False
+        if (mode & 2) and (rx_bytes == 0 or errors != 0 or sync_loss != 0 or not locked):
+            ok = False
+    return ok
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Run the dualcdc PRBS self-test')
+    parser.add_argument('ttys', nargs='*', help='tty of each port, port 1 first')
+    parser.add_argument('-m', '--mode', choices=MODES, default='both')
+    parser.add_argument('-t', '--time', type=float, default=10.0, help='seconds to measure')
+    parser.add_argument('-w', '--warmup', type=float, default=1.0,
+                        help='seconds run before the counts restart')
+    args = parser.parse_args()
+
+    dev = open_device()
+    ports = len(args.ttys)
+
+    if args.mode == 'off' or ports == 0:
+        for port in range(1, 5):
+            try:
+                set_mode(dev, port, MODES['off'])
+            except Exception:
+                break
+        return 0
+
+    fds = [open_tty(path) for path in args.ttys]
+    stop = threading.Event()
+    threads = [threading.Thread(target=pump, args=(fd, args.mode, stop), daemon=True)
+               for fd in fds]
+
+    try:
+        for port in range(1, ports + 1):
+            set_mode(dev, port, MODES[args.mode])
+        for t in threads:
+            t.start()
+
+        time.sleep(args.warmup)
+        get_results(dev, True)
+        time.sleep(args.time)
+        ok = show(get_results(dev, False), ports)
+    finally:
+        for port in range(1, ports + 1):
+            set_mode(dev, port, MODES['off'])
+        stop.set()
+        for t in threads:
+            t.join(1.0)
+        for fd in fds:
+            os.close(fd)
+
+    return 0 if ok else 1
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,132 @@
+#!/usr/bin/env python3
+"""
+USB event trace decoder
+
+This file is part of stm32-usb-dualcdc, an implementation of Dual VCP ports
+over USB for STM32F4xx controllers.
+This project is available at
+<https://github.com/jisszacharia/stm32-usb-dualcdc>
+
+Reads the trace kept by app/usbtrace.c, built with USBTRACE_ENABLE=1, and
+prints it as a timeline. The trace comes from the device over the
+DCDC_VREQ_GET_TRACE vendor request (needs pyusb), or from a file saved
+earlier with -o.
+
+    usbtrace.py                 read the device and print
+    usbtrace.py -o trace.bin    also save the raw dump
+    usbtrace.py -f trace.bin    print a saved dump
+"""
+
+import argparse
+import struct
+import sys
+
+USBD_VID = 0x0483
+USBD_PID = 0x5741
+DCDC_VREQ_GET_TRACE = 0x03
+
+HEADER = struct.Struct('<IIII')      # head, num, core_clock, reserved
+RECORD = struct.Struct('<IBBH')      # stamp, type, ep, arg
+
+# USBTRACE_x, name and how to show arg
+TYPES = {
+    0x01: ('SETUP', 'setup'),
+    0x02: ('DATAOUT', 'bytes'),
+    0x03: ('DATAIN', 'bytes'),
+    0x04: ('SOF', 'frame'),
+    0x05: ('RESET', 'speed'),
+    0x06: ('SUSPEND', None),
+    0x07: ('RESUME', None),
+    0x08: ('CONNECT', None),
+    0x09: ('DISCONNECT', None),
+    0x0A: ('ISOINCOMP', None),
+    0x10: ('TXSTART', 'bytes'),
+    0x11: ('TXDONE', 'bytes'),
+    0x12: ('RXDONE', 'bytes'),
+    0x13: ('RXARM', 'bytes'),
+    0x14: ('RXNAK', None),
+}
+
+SPEEDS = {0: 'high', 1: 'full', 2: 'low'}
+
+
+def read_device():
+    import usb.core
+
+    dev = usb.core.find(idVendor=USBD_VID, idProduct=USBD_PID)
+    if dev is None:
+        sys.exit('usbtrace: device %04x:%04x not found' % (USBD_VID, USBD_PID))
+
+    # Vendor, device recipient, so no interface has to be claimed
+    head = bytes(dev.ctrl_transfer(0xC0, DCDC_VREQ_GET_TRACE, 0, 0, HEADER.size))
+    num = HEADER.unpack_from(head)[1]
+    return bytes(dev.ctrl_transfer(0xC0, DCDC_VREQ_GET_TRACE, 0, 0,
+                                   HEADER.size + num * RECORD.size))
+
+
+def records(dump):
+    """Yields (stamp, type, ep, arg) oldest first"""
+    head, num, clock, _ = HEADER.unpack_from(dump)
+    if len(dump) < HEADER.size + num * RECORD.size:
+        sys.exit('usbtrace: short dump, %d bytes for %d records' % (len(dump), num))
+
+    for seq in range(max(0, head - num), head):
+        yield RECORD.unpack_from(dump, HEADER.size + (seq % num) * RECORD.size)
+
+
+def show_arg(kind, arg):
+    if kind == 'setup':
+        return 'bmRequest 0x%02x bRequest 0x%02x' % (arg & 0xFF, arg >> 8)
+    if kind == 'speed':
+        return SPEEDS.get(arg, str(arg))
+    if kind == 'bytes':
+        return '%d bytes' % arg if arg != 0xFFFF else '>= 65535 bytes'
+    if kind == 'frame':
+        return 'frame %d' % arg
+    return ''
+
+
+def timeline(dump, out):
+    head, num, clock, _ = HEADER.unpack_from(dump)
+    per_us = max(clock // 1000000, 1)
+    out.write('# %d events recorded, %d kept, %d MHz core\n' %
+              (head, min(head, num), per_us))
+    out.write('#       time_us     delta_us  event       ep    detail\n')
+
+    first = last = None
+    elapsed = 0
+    for stamp, kind, ep, arg in records(dump):
+        if first is None:
+            first = last = stamp
+        # 32-bit cycle counter, consecutive events are less than a wrap apart
+        delta = (stamp - last) & 0xFFFFFFFF
+        elapsed += delta
+        last = stamp
+
+        name, argkind = TYPES.get(kind, ('0x%02x' % kind, 'raw'))
+        epname = ('%02x' % ep) if ep else '--'
+        detail = show_arg(argkind, arg) if argkind != 'raw' else '0x%04x' % arg
+        out.write('%15.3f %12.3f  %-10s  %s    %s\n' %
+                  (elapsed / per_us, delta / per_us, name, epname, detail))
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Decode the dualcdc USB event trace')
+    parser.add_argument('-f', '--file', help='decode a saved dump instead of the device')
+    parser.add_argument('-o', '--output', help='save the raw dump read from the device')
+    args = parser.parse_args()
+
+    if args.file:
+        with open(args.file, 'rb') as f:
+            dump = f.read()
+    else:
+        dump = read_device()
+        if args.output:
+            with open(args.output, 'wb') as f:
+                f.write(dump)
+
+    timeline(dump, sys.stdout)
+
+
+if __name__ == '__main__':
+    main()